@@ -9,12 +9,62 @@
 #define _REGEX_PLUS_TRANSPOSITION_TABLE_REGEX_H_
 
 #include <wctype.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "unicode_table.h"   //  Unicode文字プロパティ表(unicode_table.pyで生成する)
+
+//  x86/x64ではSSE2/AVX2のカーネルを使う(AVX2は実行時にCPUを調べて切り替える)
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define REGEX_PTT_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define REGEX_PTT_AVX2
+#else
+#define REGEX_PTT_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+//  C++20のコルーチンが使えれば、regex_jobをコルーチンで包んだregex_taskも用意する
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define REGEX_PTT_COROUTINE
+#include <coroutine>
+#endif
+
+//  mmapが使える環境では、regex_bundleはファイルを読み込まずに写像する
+#if defined(__unix__) || defined(__APPLE__)
+#define REGEX_PTT_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace nfa_plus_ttable
 {
 #ifndef _MSC_VER
@@ -26,6 +76,344 @@ int _wtoi(const wchar_t* ws)
 }
 #endif
 
+/**************************************************************************
+ *                                                                        *
+ *  文字列を一度に複数文字ずつ調べるカーネル                              *
+ *                                                                        *
+ **************************************************************************/
+namespace simd
+{
+//---------------------------------------------------------------------
+//  文字の範囲([lo, hi])の集合。カーネルはこの集合に入る文字を調べる
+//  nが負の場合は範囲で表せない(範囲が多すぎる)ことを表す
+//---------------------------------------------------------------------
+struct ranges {
+    static constexpr int MAX = 8;
+    int     n = -1;
+    wchar_t lo[MAX] = {};
+    wchar_t hi[MAX] = {};
+};
+
+using uchar = std::make_unsigned<wchar_t>::type;
+
+//  文字cが範囲の集合rに入っているか
+inline bool member(const wchar_t c, const ranges& r)
+{
+    for (int i = 0; i < r.n; i++) {
+        if (static_cast<uchar>(static_cast<uchar>(c) - static_cast<uchar>(r.lo[i])) <=
+            static_cast<uchar>(static_cast<uchar>(r.hi[i]) - static_cast<uchar>(r.lo[i])))
+            return true;
+    }
+    return false;
+}
+
+//  0～255以外の文字か(負の値も含む)
+inline bool wide(const wchar_t c)
+{
+    return static_cast<uchar>(c) >= 256;
+}
+
+//---------------------------------------------------------------------
+//  一文字ずつ調べる(SIMDが使えない環境と、ベクタに満たない末尾で使う)
+//---------------------------------------------------------------------
+inline size_t span_scalar(const wchar_t* s, size_t i, const size_t n, const ranges& r)
+{
+    while (i < n && member(s[i], r))
+        i++;
+    return i;
+}
+
+inline size_t find_scalar(const wchar_t* s, size_t i, const size_t n, const ranges& r, const bool w)
+{
+    while (i < n && !member(s[i], r) && !(w && wide(s[i])))
+        i++;
+    return i;
+}
+
+#ifdef REGEX_PTT_SIMD
+inline int ctz(const uint32_t m)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, m);
+    return static_cast<int>(i);
+#else
+    return __builtin_ctz(m);
+#endif
+}
+
+//---------------------------------------------------------------------
+//  AVX2が使えるか(最初の呼び出しで一度だけ調べる)
+//---------------------------------------------------------------------
+inline bool has_avx2()
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7)
+        return false;
+    __cpuid(r, 1);
+    if (!(r[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+        return false;               //  OSがYMMレジスタを保存しない
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+inline bool avx2()
+{
+    static const bool ret = has_avx2();
+    return ret;
+}
+
+//---------------------------------------------------------------------
+//  SSE2(wchar_tの幅に合わせて16ビットか32ビットの要素で比べる)
+//  符号なしの比較は、最上位ビット(TOP)を反転してから符号付きの比較で行う。
+//  範囲の下限と幅は、ループの前に一度だけベクタにしておく
+//---------------------------------------------------------------------
+constexpr uchar TOP = static_cast<uchar>(1u << (sizeof(wchar_t) * 8 - 1));
+
+inline __m128i set1_sse2(const uchar c)
+{
+    if constexpr (sizeof(wchar_t) == 4)
+        return _mm_set1_epi32(static_cast<int>(c));
+    else
+        return _mm_set1_epi16(static_cast<short>(c));
+}
+
+//  範囲のどれにも入らない要素を全ビット1にする
+inline __m128i outside_sse2(const __m128i x, const __m128i* lo, const __m128i* width, const int n)
+{
+    const __m128i bias = set1_sse2(TOP);
+    __m128i out = _mm_set1_epi32(-1);
+    for (int k = 0; k < n; k++) {
+        if constexpr (sizeof(wchar_t) == 4)
+            out = _mm_and_si128(out, _mm_cmpgt_epi32(_mm_xor_si128(_mm_sub_epi32(x, lo[k]), bias), width[k]));
+        else
+            out = _mm_and_si128(out, _mm_cmpgt_epi16(_mm_xor_si128(_mm_sub_epi16(x, lo[k]), bias), width[k]));
+    }
+    return out;
+}
+
+//  0～255以外の要素を全ビット1にする
+inline __m128i wide_sse2(const __m128i x)
+{
+    const __m128i y = _mm_xor_si128(x, set1_sse2(TOP));
+    if constexpr (sizeof(wchar_t) == 4)
+        return _mm_cmpgt_epi32(y, set1_sse2(TOP ^ 255));
+    else
+        return _mm_cmpgt_epi16(y, set1_sse2(TOP ^ 255));
+}
+
+inline size_t span_sse2(const wchar_t* s, const size_t n, const ranges& r)
+{
+    constexpr size_t lanes = 16 / sizeof(wchar_t);
+    __m128i lo[ranges::MAX], width[ranges::MAX];
+    for (int k = 0; k < r.n; k++) {
+        lo[k] = set1_sse2(static_cast<uchar>(r.lo[k]));
+        width[k] = set1_sse2(static_cast<uchar>(TOP ^ static_cast<uchar>(r.hi[k] - r.lo[k])));
+    }
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        if (const uint32_t m = static_cast<uint32_t>(_mm_movemask_epi8(outside_sse2(x, lo, width, r.n))))
+            return i + ctz(m) / sizeof(wchar_t);
+    }
+    return span_scalar(s, i, n, r);
+}
+
+inline size_t find_sse2(const wchar_t* s, const size_t n, const ranges& r, const bool w)
+{
+    constexpr size_t lanes = 16 / sizeof(wchar_t);
+    __m128i lo[ranges::MAX], width[ranges::MAX];
+    for (int k = 0; k < r.n; k++) {
+        lo[k] = set1_sse2(static_cast<uchar>(r.lo[k]));
+        width[k] = set1_sse2(static_cast<uchar>(TOP ^ static_cast<uchar>(r.hi[k] - r.lo[k])));
+    }
+    const __m128i ones = _mm_set1_epi32(-1);
+    size_t i = 0;
+    if (r.n == 1 && r.lo[0] == r.hi[0] && !w) {
+        //  一文字だけなら一致の比較で済む
+        for (; i + lanes <= n; i += lanes) {
+            const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            const __m128i hit = sizeof(wchar_t) == 4 ? _mm_cmpeq_epi32(x, lo[0]) : _mm_cmpeq_epi16(x, lo[0]);
+            if (const uint32_t m = static_cast<uint32_t>(_mm_movemask_epi8(hit)))
+                return i + ctz(m) / sizeof(wchar_t);
+        }
+        return find_scalar(s, i, n, r, w);
+    }
+    for (; i + lanes <= n; i += lanes) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i hit = _mm_xor_si128(outside_sse2(x, lo, width, r.n), ones);
+        if (w)
+            hit = _mm_or_si128(hit, wide_sse2(x));
+        if (const uint32_t m = static_cast<uint32_t>(_mm_movemask_epi8(hit)))
+            return i + ctz(m) / sizeof(wchar_t);
+    }
+    return find_scalar(s, i, n, r, w);
+}
+
+//---------------------------------------------------------------------
+//  AVX2(内容はSSE2と同じで、一度に倍の文字数を調べる)
+//---------------------------------------------------------------------
+REGEX_PTT_AVX2 inline __m256i set1_avx2(const uchar c)
+{
+    if constexpr (sizeof(wchar_t) == 4)
+        return _mm256_set1_epi32(static_cast<int>(c));
+    else
+        return _mm256_set1_epi16(static_cast<short>(c));
+}
+
+//  範囲のどれにも入らない要素を全ビット1にする
+REGEX_PTT_AVX2 inline __m256i outside_avx2(const __m256i x, const __m256i* lo, const __m256i* width, const int n)
+{
+    const __m256i bias = set1_avx2(TOP);
+    __m256i out = _mm256_set1_epi32(-1);
+    for (int k = 0; k < n; k++) {
+        if constexpr (sizeof(wchar_t) == 4)
+            out = _mm256_and_si256(out, _mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_sub_epi32(x, lo[k]), bias), width[k]));
+        else
+            out = _mm256_and_si256(out, _mm256_cmpgt_epi16(_mm256_xor_si256(_mm256_sub_epi16(x, lo[k]), bias), width[k]));
+    }
+    return out;
+}
+
+//  0～255以外の要素を全ビット1にする
+REGEX_PTT_AVX2 inline __m256i wide_avx2(const __m256i x)
+{
+    const __m256i y = _mm256_xor_si256(x, set1_avx2(TOP));
+    if constexpr (sizeof(wchar_t) == 4)
+        return _mm256_cmpgt_epi32(y, set1_avx2(TOP ^ 255));
+    else
+        return _mm256_cmpgt_epi16(y, set1_avx2(TOP ^ 255));
+}
+
+REGEX_PTT_AVX2 inline size_t span_avx2(const wchar_t* s, const size_t n, const ranges& r)
+{
+    constexpr size_t lanes = 32 / sizeof(wchar_t);
+    __m256i lo[ranges::MAX], width[ranges::MAX];
+    for (int k = 0; k < r.n; k++) {
+        lo[k] = set1_avx2(static_cast<uchar>(r.lo[k]));
+        width[k] = set1_avx2(static_cast<uchar>(TOP ^ static_cast<uchar>(r.hi[k] - r.lo[k])));
+    }
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        if (const uint32_t m = static_cast<uint32_t>(_mm256_movemask_epi8(outside_avx2(x, lo, width, r.n))))
+            return i + ctz(m) / sizeof(wchar_t);
+    }
+    return span_scalar(s, i, n, r);
+}
+
+REGEX_PTT_AVX2 inline size_t find_avx2(const wchar_t* s, const size_t n, const ranges& r, const bool w)
+{
+    constexpr size_t lanes = 32 / sizeof(wchar_t);
+    __m256i lo[ranges::MAX], width[ranges::MAX];
+    for (int k = 0; k < r.n; k++) {
+        lo[k] = set1_avx2(static_cast<uchar>(r.lo[k]));
+        width[k] = set1_avx2(static_cast<uchar>(TOP ^ static_cast<uchar>(r.hi[k] - r.lo[k])));
+    }
+    const __m256i ones = _mm256_set1_epi32(-1);
+    size_t i = 0;
+    if (r.n == 1 && r.lo[0] == r.hi[0] && !w) {
+        //  一文字だけなら一致の比較で済む
+        for (; i + lanes <= n; i += lanes) {
+            const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            const __m256i hit = sizeof(wchar_t) == 4 ? _mm256_cmpeq_epi32(x, lo[0]) : _mm256_cmpeq_epi16(x, lo[0]);
+            if (const uint32_t m = static_cast<uint32_t>(_mm256_movemask_epi8(hit)))
+                return i + ctz(m) / sizeof(wchar_t);
+        }
+        return find_scalar(s, i, n, r, w);
+    }
+    for (; i + lanes <= n; i += lanes) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i hit = _mm256_xor_si256(outside_avx2(x, lo, width, r.n), ones);
+        if (w)
+            hit = _mm256_or_si256(hit, wide_avx2(x));
+        if (const uint32_t m = static_cast<uint32_t>(_mm256_movemask_epi8(hit)))
+            return i + ctz(m) / sizeof(wchar_t);
+    }
+    return find_scalar(s, i, n, r, w);
+}
+#endif  //  REGEX_PTT_SIMD
+
+//---------------------------------------------------------------------
+//  s[0]から続く、範囲の集合rに入る文字の数を返す(最大n文字)
+//---------------------------------------------------------------------
+inline size_t span(const wchar_t* s, const size_t n, const ranges& r)
+{
+#ifdef REGEX_PTT_SIMD
+    return avx2() ? span_avx2(s, n, r) : span_sse2(s, n, r);
+#else
+    return span_scalar(s, 0, n, r);
+#endif
+}
+
+//---------------------------------------------------------------------
+//  s[0]からn文字の中で、範囲の集合rに入る最初の文字の位置を返す(無ければn)
+//  wがtrueなら、0～255以外の文字でも止まる(範囲で表せない文字を呼び出し側で調べる)
+//---------------------------------------------------------------------
+inline size_t find(const wchar_t* s, const size_t n, const ranges& r, const bool w = false)
+{
+#ifdef REGEX_PTT_SIMD
+    return avx2() ? find_avx2(s, n, r, w) : find_sse2(s, n, r, w);
+#else
+    return find_scalar(s, 0, n, r, w);
+#endif
+}
+
+//---------------------------------------------------------------------
+//  一文字だけの範囲の集合
+//---------------------------------------------------------------------
+inline ranges single(const wchar_t c)
+{
+    ranges r;
+    r.n = 1;
+    r.lo[0] = r.hi[0] = c;
+    return r;
+}
+
+//---------------------------------------------------------------------
+//  範囲の集合に[lo, hi]を加える(下限の昇順に加える前提。入りきらなければnを-1にする)
+//---------------------------------------------------------------------
+inline void add(ranges& r, const wchar_t lo, const wchar_t hi)
+{
+    if (r.n < 0 || (r.n > 0 && r.hi[r.n - 1] >= hi))
+        return;
+    if (r.n > 0 && r.hi[r.n - 1] >= lo - 1) {
+        r.hi[r.n - 1] = hi;
+    } else if (r.n == ranges::MAX) {
+        r.n = -1;
+    } else {
+        r.lo[r.n] = lo;
+        r.hi[r.n] = hi;
+        r.n++;
+    }
+}
+
+inline void add(ranges& r, const wchar_t c)
+{
+    add(r, c, c);
+}
+
+//---------------------------------------------------------------------
+//  ビット表(0～255の文字)を範囲の集合にする。範囲が多すぎればnを-1にする
+//---------------------------------------------------------------------
+inline ranges from_bits(const uint32_t (&bits)[8])
+{
+    ranges r;
+    r.n = 0;
+    for (int w = 0; w < 8; w++) {
+        for (uint32_t m = bits[w] & (w ? ~0u : ~1u); m && r.n >= 0; m &= m - 1)     //  L'\0'は除く
+            add(r, static_cast<wchar_t>(w * 32 + ctz(m)));
+    }
+    return r;
+}
+}   //  namespace simd
+
 /**************************************************************************
  *                                                                        *
  *  ノードのタイプ                                                        *
@@ -42,6 +430,9 @@ enum struct node_type : int {
     EOL,        //  '$' - 行末
     LOOP,       //  '*' - ループ開始
     ENDLOOP,    //  '*' - ループ終端
+    ATOMIC,     //  "(?>" - アトミックグループ
+    ENDATOMIC,  //  ')' - アトミックグループ終端
+    RUN,        //  '*' - 一文字の繰り返し
 };
 
 /**************************************************************************
@@ -50,11 +441,30 @@ enum struct node_type : int {
  *                                                                        *
  **************************************************************************/
 struct nfa_node {
+    //  flagメンバ変数の値
+    static constexpr int EXACT  = 0x01;         //  RUN - 強欲(大文字小文字を区別する探索で有効)
+    static constexpr int ICASE  = 0x02;         //  RUN - 強欲(regex_ptt::NOCASE指定の探索で有効)
+    static constexpr int LAZY   = 0x04;         //  RUN - 最短一致
+    static constexpr int GROUPS = 0x08;         //  ATOMIC - 本体にキャプチャを含む
+
+    //  0～255の文字に一致するかを表すビット表([0]は大文字小文字を区別する、[1]は区別しない)
+    struct char_set {
+        uint32_t      bits[2][8] = {};
+        simd::ranges  range[2];                 //  一致する文字の範囲(SIMDカーネル用。範囲で表せない256以上の文字は含まない)
+
+        bool test(const wchar_t c, const bool nocase) const { return (bits[nocase][c >> 5] >> (c & 31)) & 1; }
+        void set(const wchar_t c, const bool nocase) { bits[nocase][c >> 5] |= 1u << (c & 31); }
+    };
+
     nfa_node*      n1   = nullptr;              //  遷移先１
     nfa_node*      n2   = nullptr;              //  遷移先２
     const wchar_t* val  = nullptr;              //  正規表現パターン文字列
     intptr_t       len  = 0;                    //  文字列長
     node_type      type = node_type::DEFAULT;   //  識別子(ノードタイプ)
+    int            min  = 0;                    //  RUN - 最小繰り返し回数
+    int            max  = 0;                    //  RUN - 最大繰り返し回数(-1は上限なし)
+    int            flag = 0;                    //  RUN, ATOMIC - 付加情報
+    const char_set* set = nullptr;              //  一文字を消費するノード - コンパイル時に作るビット表(作れなければnullptr)
 };
 
 /**************************************************************************
@@ -64,24 +474,33 @@ struct nfa_node {
  **************************************************************************/
 class regex_compiled
 {
+    friend class regex_bundle;      //  バイナリ形式への書き出しと、そこからの構築を使う
+
 public:
     //---------------------------------------------------------------------
     //  コンストラクタ
     //  コンパイルされた正規表現を作成する
     //---------------------------------------------------------------------
-    //  regex  :  正規表現パターン文字列
+    //  regex     :  正規表現パターン文字列
+    //  resource  :  メモリの確保元(nullptrならstd::pmr::get_default_resource())
+    //---------------------------------------------------------------------
+    //  ノードはresourceから取る一つの領域(arena_)に並べ、regex_compiledと共に一度に解放する。
+    //  コンパイル中の一時的な表は作業用のプールから取り、コンパイルが終われば解放する
     //---------------------------------------------------------------------
-    regex_compiled(const wchar_t* regex) : group_cnt_(0)
+    regex_compiled(const wchar_t* regex, std::pmr::memory_resource* resource = nullptr)
+        : arena_(sizeof(nfa_node) * 64, resource ? resource : std::pmr::get_default_resource()), group_cnt_(0)
     {
         pattern_ = regex;    //  文字列へのポインタを参照するため、コピーを取る
         work_ = pattern_.c_str();
+        std::pmr::unsynchronized_pool_resource scratch(arena_.upstream_resource());
+        scratch_ = &scratch;
         this->re_ = compile_regex();
+        scratch_ = arena_.upstream_resource();
     }
 
     virtual ~regex_compiled()
     {
-        if (this->re_)
-            clear(this->re_);
+        //  ノードはarena_と共に解放される
     }
 
     //---------------------------------------------------------------------
@@ -89,8 +508,120 @@ public:
     //---------------------------------------------------------------------
     const nfa_node* get() const { return re_; }             //  リンクリストの先頭ノードを返す
     int capture() const { return group_cnt_ + 1; }          //  キャプチャ数。「+1」の意味は"[0]を全体マッチ"で使用するため
+    int loops() const { return loop_cnt_; }                 //  ε遷移無限ループの監視が必要なループの数
+    int runs() const { return run_cnt_; }                   //  一文字の繰り返し(RUN)の数
+    intptr_t min_length() const { return min_len_; }        //  マッチ長の下限
+    intptr_t max_length() const { return max_len_; }        //  マッチ長の上限(-1は上限なし)
+    bool anchored() const { return anchored_; }             //  パターンが必ず行頭「^」から始まるか
+    bool end_anchored() const { return end_anchored_; }     //  パターンが必ず行末「$」で終わるか(テキスト末尾にしか一致しない)
+
+    bool has_backref() const { return has_backref_; }       //  後方参照を含むか
+    const std::vector<int>& backrefs() const { return refs_; }  //  後方参照されるグループの番号(昇順)
+    bool atomic() const { return atomic_; }                 //  アトミックグループか強欲な量指定子を含むか
+
+    //---------------------------------------------------------------------
+    //  序数を振ったノードと遷移(状態集合による探索に使う)
+    //---------------------------------------------------------------------
+    struct nfa_graph {
+        std::vector<const nfa_node*>  node;     //  序数順のノード
+        std::vector<std::vector<int>> succ;     //  ノード毎の遷移先の序数
+        std::vector<std::vector<int>> pred;     //  ノード毎の「そのノードへ遷移してくるノード」の序数
+        std::vector<int>              slot;     //  RUNノード毎の、繰り返した回数の印の先頭位置(RUN以外と、回数がRUN_MAXを超えるRUNは-1)
+        int slots = 0;                          //  回数の印の数(RUNノード毎に上限回数+1個、上限が無ければ最小回数+1個)
+        int head = -1;                          //  先頭ノードの序数
+        int end  = -1;                          //  終了状態の序数
+
+        //  slotとslotsを求める(nodeを設定した後に呼ぶ)
+        void number_slots()
+        {
+            slot.assign(node.size(), -1);
+            slots = 0;
+            for (size_t x = 0; x < node.size(); x++) {
+                if (node[x]->type == node_type::RUN && node[x]->min <= RUN_MAX && node[x]->max <= RUN_MAX) {
+                    slot[x] = slots;
+                    slots += (node[x]->max < 0 ? node[x]->min : node[x]->max) + 1;
+                }
+            }
+        }
+    };
+    const nfa_graph* graph() const { return (has_backref_ || long_run_) ? nullptr : &graph_; }  //  状態集合で探索できなければnullptr
+
+    //---------------------------------------------------------------------
+    //  一致の先頭になり得る文字の集合([0]は大文字小文字を区別する、[1]は区別しない)
+    //---------------------------------------------------------------------
+    struct char_range {                         //  文字の範囲[lo, hi]
+        wchar_t lo, hi;
+    };
+
+    struct first_set {
+        nfa_node::char_set      low;            //  0～255の文字
+        std::vector<char_range> high[2];        //  256以上の文字の範囲(昇順で重ならない)
+        simd::ranges            range[2];       //  全ての候補の範囲(SIMDカーネル用)
+        bool                    wide[2] = {};   //  rangeに入らない256以上の候補がある
+
+        bool test(const wchar_t c, const bool nocase) const
+        {
+            if (static_cast<uint32_t>(c) < 256)
+                return low.test(c, nocase);
+            auto it = std::upper_bound(high[nocase].begin(), high[nocase].end(), c,
+                                       [](const wchar_t c, const char_range& r) { return c < r.lo; });
+            return it != high[nocase].begin() && c <= (--it)->hi;
+        }
+
+        //  highを昇順に並べて重なる範囲をまとめ、SIMDカーネル用の範囲を求める
+        void finish()
+        {
+            for (const bool nocase : { false, true }) {
+                auto& h = high[nocase];
+                std::sort(h.begin(), h.end(), [](const char_range& a, const char_range& b) { return a.lo < b.lo; });
+                size_t n = 0;
+                for (auto& r : h) {
+                    if (n > 0 && r.lo <= h[n - 1].hi)
+                        h[n - 1].hi = std::max(h[n - 1].hi, r.hi);
+                    else
+                        h[n++] = r;
+                }
+                h.resize(n);
+
+                auto& ranges = range[nocase];
+                ranges = simd::from_bits(low.bits[nocase]);
+                for (auto& r : h) {
+                    simd::ranges wider = ranges;
+                    simd::add(wider, r.lo, r.hi);
+                    if (wider.n < 0) {
+                        wide[nocase] = true;        //  残りはカーネルが止まった位置で判定する
+                        break;
+                    }
+                    ranges = wider;
+                }
+            }
+        }
+    };
+    const first_set* first() const { return has_first_ ? &first_ : nullptr; }  //  求められなければnullptr
+    const std::wstring& literal() const { return literal_; }    //  一致が必ず含む文字列(大文字小文字を区別する場合。無ければ空)
     const std::wstring& err_msg() const { return what_; }   //  エラーメッセージを返す
 
+    //  状態集合で探索できる一文字の繰り返しの回数の上限(最小回数、最大回数のどちらかが
+    //  これを超えるパターンは、回数を正確に数えられないのでバックトラックで照合する)
+    static constexpr int RUN_MAX = 64;
+
+    //  量指定子{n,m}に書ける回数の上限(PCREと同じ。回数の計算があふれないようにする)
+    static constexpr int COUNT_MAX = 65535;
+
+    //---------------------------------------------------------------------
+    //  コンパイルされた正規表現が使うメモリのバイト数(regex_cacheの容量の目安)
+    //---------------------------------------------------------------------
+    size_t bytes() const
+    {
+        size_t ret = sizeof(*this) + (pattern_.size() + literal_.size() + what_.size()) * sizeof(wchar_t);
+        ret += node_cnt_ * sizeof(nfa_node) + sets_.size() * sizeof(nfa_node::char_set);
+        ret += graph_.node.size() * (sizeof(const nfa_node*) + 2 * sizeof(std::vector<int>) + sizeof(int));
+        for (size_t i = 0; i < graph_.succ.size(); i++)
+            ret += (graph_.succ[i].size() + graph_.pred[i].size()) * sizeof(int);
+        ret += (first_.high[0].size() + first_.high[1].size()) * sizeof(char_range) + refs_.size() * sizeof(int);
+        return ret;
+    }
+
 private:
     //---------------------------------------------------------------------
     //  デフォルトコンストラクタなどを使用禁止にする
@@ -102,13 +633,368 @@ private:
     regex_compiled& operator=(const regex_compiled&) = delete;
     regex_compiled operator=(regex_compiled&&) = delete;
 
+    //---------------------------------------------------------------------
+    //  バイナリ形式(regex_bundleが書き出す一つのパターン分)
+    //---------------------------------------------------------------------
+    //  ノードの遷移先とビット表は序数、ノードのval(パターン文字列の中を指す)は先頭からの
+    //  位置で表す。image_headerの後に、8バイト境界に揃えた次の並びが続く
+    //      パターン文字列(wchar_t × pattern), ノード(image_node × nodes),
+    //      ビット表(char_set × sets), 状態集合のノード(int32_t × graph),
+    //      遷移の開始位置(uint32_t × graph + 1), 遷移先(int32_t × succ),
+    //      逆向きの遷移の開始位置(uint32_t × graph + 1), 遷移元(int32_t × pred),
+    //      一致の先頭になり得る256以上の文字の範囲(char_range × high0, high1),
+    //      必ず含む文字列(wchar_t × literal), エラーメッセージ(wchar_t × what),
+    //      後方参照されるグループの番号(int32_t × refs)
+    //---------------------------------------------------------------------
+    static constexpr uint32_t ANCHORED = 0x01, END_ANCHORED = 0x02, BACKREF = 0x04, ATOMIC = 0x08,
+                              FIRST = 0x10, WIDE0 = 0x20, WIDE1 = 0x40;    //  image_header::flagsの値
+    struct image_header {
+        uint32_t nodes, sets, pattern, graph, succ, pred, high0, high1, literal, what, refs;
+        int32_t  head;                          //  先頭ノードの序数(-1は無し)
+        int32_t  group_cnt, loop_cnt, run_cnt;
+        int32_t  graph_head, graph_end;
+        int64_t  min_len, max_len;
+        uint32_t flags;
+        nfa_node::char_set first_low;
+        simd::ranges       first_range[2];
+    };
+    struct image_node {
+        int32_t n1, n2, set, type;              //  遷移先とビット表の序数(-1は無し)、ノードタイプ
+        int64_t val, len;                       //  valはパターン文字列の先頭からの位置(-1は無し)
+        int32_t min, max, flag, reserved;
+    };
+    static_assert(std::is_trivially_copyable<image_header>::value && std::is_trivially_copyable<image_node>::value,
+                  "image records must be trivially copyable");
+
+    //---------------------------------------------------------------------
+    //  バイナリ形式の読み出し(並びを置き換えずにその場で参照する)
+    //---------------------------------------------------------------------
+    struct image_reader {
+        const char* p;
+        const char* end;
+
+        template<typename T>
+        const T* take(const size_t n)
+        {
+            if (p == nullptr || n > static_cast<size_t>(end - p) / sizeof(T)) {
+                p = nullptr;
+                return nullptr;
+            }
+            auto ret = reinterpret_cast<const T*>(p);
+            p += std::min(static_cast<size_t>(end - p), (n * sizeof(T) + 7) & ~size_t(7));
+            return ret;
+        }
+    };
+
+    //---------------------------------------------------------------------
+    //  バイナリ形式からのコンストラクタ(regex_bundleが使う)
+    //  image  :  save関数で書き出した並び(8バイト境界に置くこと)
+    //  壊れていればエラーメッセージを設定する(get関数はnullptrを返す)
+    //---------------------------------------------------------------------
+    regex_compiled(const char* image, const size_t size, std::pmr::memory_resource* resource)
+        : arena_(image_arena(image, size), resource ? resource : std::pmr::get_default_resource())
+    {
+        scratch_ = arena_.upstream_resource();
+        if (!load(image, size)) {
+            re_ = nullptr;
+            what_ = L"broken image.";
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  バイナリ形式から構築する時のarena_の初期容量
+    //---------------------------------------------------------------------
+    static size_t image_arena(const char* image, const size_t size)
+    {
+        image_reader in{ image, image + size };
+        auto h = in.take<image_header>(1);
+        if (h == nullptr || in.take<wchar_t>(h->pattern) == nullptr || in.take<image_node>(h->nodes) == nullptr ||
+            in.take<nfa_node::char_set>(h->sets) == nullptr)
+            return 64;                      //  壊れている(load関数が失敗する)
+        return std::max<size_t>(sizeof(nfa_node) * h->nodes + (sizeof(nfa_node::char_set) + 16) * h->sets, 64);
+    }
+
+    //---------------------------------------------------------------------
+    //  バイナリ形式のパターン文字列(その場で参照する。壊れていれば空)
+    //---------------------------------------------------------------------
+    static std::wstring_view image_pattern(const char* image, const size_t size)
+    {
+        image_reader in{ image, image + size };
+        auto h = in.take<image_header>(1);
+        auto pattern = h ? in.take<wchar_t>(h->pattern) : nullptr;
+        return pattern ? std::wstring_view(pattern, h->pattern) : std::wstring_view();
+    }
+
+    //---------------------------------------------------------------------
+    //  バイナリ形式で書き出す
+    //  out     :  書き出し先(末尾に加える。outの先頭から8バイト境界に揃えて置く)
+    //  戻り値  :  書き出せればtrue
+    //---------------------------------------------------------------------
+    bool save(std::string& out) const
+    {
+        auto list = const_cast<regex_compiled*>(this)->nfa_list(re_);
+        std::unordered_map<const nfa_node*, int32_t> id;
+        for (auto node : list)
+            id.emplace(node, static_cast<int32_t>(id.size()));
+        std::unordered_map<const nfa_node::char_set*, int32_t> set_id;
+        for (auto& set : sets_)
+            set_id.emplace(&set, static_cast<int32_t>(set_id.size()));
+        bool ok = true;                     //  リストの外のノードやビット表を指していれば書き出さない
+        auto index = [&id, &ok](const nfa_node* n) {
+            auto it = id.find(n);
+            ok = ok && (n == nullptr || it != id.end());
+            return n && it != id.end() ? it->second : -1;
+        };
+        auto set_index = [&set_id, &ok](const nfa_node::char_set* set) {
+            auto it = set_id.find(set);
+            ok = ok && (set == nullptr || it != set_id.end());
+            return set && it != set_id.end() ? it->second : -1;
+        };
+
+        std::vector<image_node> nodes;
+        for (auto node : list) {
+            const intptr_t val = node->val ? node->val - pattern_.c_str() : -1;
+            if (node->val && (val < 0 || val + std::max<intptr_t>(node->len, 0) > static_cast<intptr_t>(pattern_.size())))
+                return false;
+            nodes.push_back({ index(node->n1), index(node->n2), set_index(node->set), static_cast<int32_t>(node->type),
+                              val, node->len, node->min, node->max, node->flag, 0 });
+        }
+        std::vector<int32_t> graph, succ, pred;
+        std::vector<uint32_t> succ_at(1, 0), pred_at(1, 0);
+        for (size_t i = 0; i < graph_.node.size(); i++) {
+            graph.push_back(index(graph_.node[i]));
+            succ.insert(succ.end(), graph_.succ[i].begin(), graph_.succ[i].end());
+            pred.insert(pred.end(), graph_.pred[i].begin(), graph_.pred[i].end());
+            succ_at.push_back(static_cast<uint32_t>(succ.size()));
+            pred_at.push_back(static_cast<uint32_t>(pred.size()));
+        }
+
+        if (!ok)
+            return false;
+
+        image_header h = {};
+        h.nodes = static_cast<uint32_t>(nodes.size());
+        h.sets = static_cast<uint32_t>(sets_.size());
+        h.pattern = static_cast<uint32_t>(pattern_.size());
+        h.graph = static_cast<uint32_t>(graph.size());
+        h.succ = static_cast<uint32_t>(succ.size());
+        h.pred = static_cast<uint32_t>(pred.size());
+        h.high0 = static_cast<uint32_t>(first_.high[0].size());
+        h.high1 = static_cast<uint32_t>(first_.high[1].size());
+        h.literal = static_cast<uint32_t>(literal_.size());
+        h.what = static_cast<uint32_t>(what_.size());
+        h.refs = static_cast<uint32_t>(refs_.size());
+        h.head = index(re_);
+        h.group_cnt = group_cnt_;
+        h.loop_cnt = loop_cnt_;
+        h.run_cnt = run_cnt_;
+        h.graph_head = graph_.head;
+        h.graph_end = graph_.end;
+        h.min_len = min_len_;
+        h.max_len = max_len_;
+        h.flags = (anchored_ ? ANCHORED : 0) | (end_anchored_ ? END_ANCHORED : 0) | (has_backref_ ? BACKREF : 0) |
+                  (atomic_ ? ATOMIC : 0) | (has_first_ ? FIRST : 0) | (first_.wide[0] ? WIDE0 : 0) | (first_.wide[1] ? WIDE1 : 0);
+        h.first_low = first_.low;
+        h.first_range[0] = first_.range[0];
+        h.first_range[1] = first_.range[1];
+
+        auto put = [&out](const auto* p, const size_t n) {
+            out.append(reinterpret_cast<const char*>(p), n * sizeof(*p));
+            out.append((8 - out.size() % 8) % 8, '\0');
+        };
+        std::vector<nfa_node::char_set> sets(sets_.begin(), sets_.end());
+        std::vector<int32_t> refs(refs_.begin(), refs_.end());
+        put(&h, 1);
+        put(pattern_.data(), pattern_.size());
+        put(nodes.data(), nodes.size());
+        put(sets.data(), sets.size());
+        put(graph.data(), graph.size());
+        put(succ_at.data(), succ_at.size());
+        put(succ.data(), succ.size());
+        put(pred_at.data(), pred_at.size());
+        put(pred.data(), pred.size());
+        put(first_.high[0].data(), first_.high[0].size());
+        put(first_.high[1].data(), first_.high[1].size());
+        put(literal_.data(), literal_.size());
+        put(what_.data(), what_.size());
+        put(refs.data(), refs.size());
+        return true;
+    }
+
+    //---------------------------------------------------------------------
+    //  バイナリ形式から構築する
+    //  序数と位置を範囲の中か確かめてからポインタに置き換える(構文解析と解析はしない)
+    //---------------------------------------------------------------------
+    //  壊れた(または細工された)並びでも範囲外を読み書きしないように、照合が添字や
+    //  ポインタとして使う値は全て確かめる。グループ、ループ、一文字の繰り返しの数は
+    //  ノード数を超えず(構文エラーのパターンはノードが無いので、パターンの文字数まで)、
+    //  ノードの序数(len)はその数より小さい。後方参照はグループの番号を指し、
+    //  文字を消費するノードのビット表と繰り返しの本体はコンパイルした時と同じ形をしている。
+    //  一文字の繰り返しの回数が大きいかは、ヘッダのフラグを信じずにノードから求め直す
+    //---------------------------------------------------------------------
+    bool load(const char* image, const size_t size)
+    {
+        image_reader in{ image, image + size };
+        auto h = in.take<image_header>(1);
+        if (h == nullptr)
+            return false;
+        auto pattern = in.take<wchar_t>(h->pattern);
+        auto nodes = in.take<image_node>(h->nodes);
+        auto sets = in.take<nfa_node::char_set>(h->sets);
+        auto graph = in.take<int32_t>(h->graph);
+        auto succ_at = in.take<uint32_t>(h->graph + size_t(1));
+        auto succ = in.take<int32_t>(h->succ);
+        auto pred_at = in.take<uint32_t>(h->graph + size_t(1));
+        auto pred = in.take<int32_t>(h->pred);
+        auto high0 = in.take<char_range>(h->high0);
+        auto high1 = in.take<char_range>(h->high1);
+        auto literal = in.take<wchar_t>(h->literal);
+        auto what = in.take<wchar_t>(h->what);
+        auto refs = in.take<int32_t>(h->refs);
+        if (in.p == nullptr)
+            return false;
+
+        if (h->nodes > static_cast<uint32_t>(INT32_MAX))
+            return false;
+        const int32_t n = static_cast<int32_t>(h->nodes);
+        auto node_ok = [n](const int32_t i) { return -1 <= i && i < n; };
+        auto graph_ok = [h](const int32_t i) { return 0 <= i && static_cast<uint32_t>(i) < h->graph; };
+        auto count_ok = [n, h](const int32_t c) { return 0 <= c && (c <= n || static_cast<uint32_t>(c) <= h->pattern); };
+        auto ranges_ok = [](const simd::ranges& r) {
+            if (r.n < -1 || r.n > simd::ranges::MAX)
+                return false;
+            for (int k = 0; k < r.n; k++) {
+                if (r.lo[k] < 1 || r.lo[k] > r.hi[k])
+                    return false;       //  L'\0'は範囲に入れない
+            }
+            return true;
+        };
+        if (!count_ok(h->group_cnt) || !count_ok(h->loop_cnt) || !count_ok(h->run_cnt))
+            return false;
+        for (uint32_t i = 0; i < h->nodes; i++) {
+            const image_node& r = nodes[i];
+            if (!node_ok(r.n1) || !node_ok(r.n2) || r.set < -1 || r.set >= static_cast<int32_t>(h->sets) ||
+                r.type < 0 || r.type > static_cast<int32_t>(node_type::RUN) ||
+                r.val < -1 || (r.val >= 0 && (r.len < 0 || r.val > static_cast<int64_t>(h->pattern) || r.len > static_cast<int64_t>(h->pattern) - r.val)))
+                return false;
+            switch (static_cast<node_type>(r.type)) {
+            case node_type::GROUP:
+            case node_type::ENDGROUP:
+                if (r.len < 1 || r.len > h->group_cnt)
+                    return false;
+                break;
+            case node_type::LOOP:
+            case node_type::ENDLOOP:
+                if (r.len < 0 || r.len >= h->loop_cnt || (r.type == static_cast<int32_t>(node_type::ENDLOOP) && r.n2 < 0))
+                    return false;
+                break;
+            case node_type::RUN:
+                if (r.len < 0 || r.len >= h->run_cnt || r.n2 < 0 || r.min < 0 || r.max < -1 || (r.max >= 0 && r.max < r.min))
+                    return false;
+                break;
+            case node_type::CLASS:
+            case node_type::ESCAPE:
+                if (r.val < 0 || (r.type == static_cast<int32_t>(node_type::ESCAPE) && r.len < 2))
+                    return false;
+                break;
+            default:
+                break;
+            }
+        }
+        for (uint32_t i = 0; i < h->sets; i++) {
+            if (!ranges_ok(sets[i].range[0]) || !ranges_ok(sets[i].range[1]))
+                return false;
+        }
+        for (uint32_t i = 0; i < h->refs; i++) {
+            if (refs[i] < 1 || refs[i] > h->group_cnt || (i > 0 && refs[i] <= refs[i - 1]))
+                return false;
+        }
+        for (uint32_t i = 0; i < h->graph; i++) {
+            if (graph[i] < 0 || graph[i] >= n || succ_at[i] > succ_at[i + 1] || pred_at[i] > pred_at[i + 1])
+                return false;
+        }
+        if (!node_ok(h->head) || succ_at[0] != 0 || pred_at[0] != 0 || succ_at[h->graph] != h->succ || pred_at[h->graph] != h->pred ||
+            !std::all_of(succ, succ + h->succ, graph_ok) || !std::all_of(pred, pred + h->pred, graph_ok) ||
+            (h->graph && (!graph_ok(h->graph_head) || !graph_ok(h->graph_end))) || (h->head >= 0 && h->graph == 0) ||
+            ((h->flags & BACKREF) != 0) != (h->refs != 0) || !ranges_ok(h->first_range[0]) || !ranges_ok(h->first_range[1]) ||
+            h->min_len < 0 || h->max_len < -1 || (h->max_len >= 0 && h->max_len < h->min_len))
+            return false;
+
+        pattern_.assign(pattern, h->pattern);
+        for (uint32_t i = 0; i < h->sets; i++)
+            sets_.push_back(sets[i]);
+        std::vector<const nfa_node::char_set*> set(h->sets);
+        for (uint32_t i = 0; i < h->sets; i++)
+            set[i] = &sets_[i];
+        auto base = static_cast<nfa_node*>(arena_.allocate(sizeof(nfa_node) * (h->nodes ? h->nodes : 1), alignof(nfa_node)));
+        for (uint32_t i = 0; i < h->nodes; i++) {
+            const image_node& r = nodes[i];
+            auto node = new (base + i) nfa_node();
+            node->n1 = r.n1 < 0 ? nullptr : base + r.n1;
+            node->n2 = r.n2 < 0 ? nullptr : base + r.n2;
+            node->val = r.val < 0 ? nullptr : pattern_.c_str() + r.val;
+            node->len = static_cast<intptr_t>(r.len);
+            node->type = static_cast<node_type>(r.type);
+            node->min = r.min;
+            node->max = r.max;
+            node->flag = r.flag;
+            node->set = r.set < 0 ? nullptr : set[r.set];
+        }
+        //  ビット表は一文字を消費するノードにだけある。繰り返しの本体は一文字を消費するノード
+        long_run_ = false;
+        for (uint32_t i = 0; i < h->nodes; i++) {
+            const nfa_node* node = base + i;
+            if ((node->set != nullptr) != single(node) || (node->type == node_type::RUN && !single(node->n2)))
+                return false;
+            if (node->type == node_type::RUN && (node->min > RUN_MAX || node->max > RUN_MAX))
+                long_run_ = true;
+        }
+        node_cnt_ = h->nodes;
+        re_ = h->head < 0 ? nullptr : base + h->head;
+
+        group_cnt_ = h->group_cnt;
+        loop_cnt_ = h->loop_cnt;
+        run_cnt_ = h->run_cnt;
+        min_len_ = static_cast<intptr_t>(h->min_len);
+        max_len_ = static_cast<intptr_t>(h->max_len);
+        anchored_ = (h->flags & ANCHORED) != 0;
+        end_anchored_ = (h->flags & END_ANCHORED) != 0;
+        has_backref_ = (h->flags & BACKREF) != 0;
+        atomic_ = (h->flags & ATOMIC) != 0;
+        has_first_ = (h->flags & FIRST) != 0;
+        refs_.assign(refs, refs + h->refs);
+
+        graph_.node.resize(h->graph);
+        graph_.succ.resize(h->graph);
+        graph_.pred.resize(h->graph);
+        for (uint32_t i = 0; i < h->graph; i++) {
+            graph_.node[i] = base + graph[i];
+            graph_.succ[i].assign(succ + succ_at[i], succ + succ_at[i + 1]);
+            graph_.pred[i].assign(pred + pred_at[i], pred + pred_at[i + 1]);
+        }
+        graph_.head = h->graph_head;
+        graph_.end = h->graph_end;
+        graph_.number_slots();
+
+        first_.low = h->first_low;
+        first_.range[0] = h->first_range[0];
+        first_.range[1] = h->first_range[1];
+        first_.wide[0] = (h->flags & WIDE0) != 0;
+        first_.wide[1] = (h->flags & WIDE1) != 0;
+        first_.high[0].assign(high0, high0 + h->high0);
+        first_.high[1].assign(high1, high1 + h->high1);
+        literal_.assign(literal, h->literal);
+        what_.assign(what, h->what);
+        return true;
+    }
+
     //---------------------------------------------------------------------
     //  正規表現を内部形式(リンクリスト)にコンパイルする
     //---------------------------------------------------------------------
     //  BNF記法での構文解析ルール(大雑把でアバウトな定義なので、不足分は実装で対処する)
     //  <E> ::= <T> / <E>'|'<T>
-    //  <T> ::= <F> / <T><F> / <F>'*' / <F>'+' / <F>'?' / <F>"{n[,m]}"
-    //  <F> ::= <C> / <S> / '('<E>')' / '['<C>']'  / '\'<C> / '^' / '$'
+    //  <T> ::= <F> / <T><F> / <F>'*' / <F>'+' / <F>'?' / <F>"{n[,m]}" / (量指定子の後に'+'で強欲)
+    //  <F> ::= <C> / <S> / '('<E>')' / "(?>"<E>')' / '['<C>']'  / '\'<C> / '^' / '$'
     //  <C> ::= 任意の文字
     //  <S> ::= ホワイトスペース
     //---------------------------------------------------------------------
@@ -123,62 +1009,895 @@ private:
         }
 
         //  NFAリンクリストの作成
-        auto ret = E(new nfa_node());
-        ret = cat(ret, new nfa_node({ nullptr, nullptr, nullptr, 0, node_type::END }));    //  「終了状態」
+        auto ret = E(make_node());
+        ret = cat(ret, make_node({ nullptr, nullptr, nullptr, 0, node_type::END }));       //  「終了状態」
 
         if (*work_ != L'\0') {
             //  正規表現文字列が最後まで解析されなかった(構文エラー)
             what_ = syntaxerror(head, work_);
-            clear(ret);
             return nullptr;
         }
+        loop_guard(ret);    //  ε遷移無限ループ対策が必要なループだけに監視を付ける
+        possessify(ret);    //  一文字の繰り返しに序数を振り、バックトラックしても無駄なものは強欲にする
+        measure(ret);       //  マッチ長の下限と上限を求める
+        anchored_ = starts_with_bol(ret);
+        build_graph(ret);   //  状態集合による探索に使うノードの序数と遷移の表を作る
+        build_sets(ret);    //  一文字の一致判定に使うビット表と、一致の先頭になり得る文字を求める
+        build_literal();    //  一致が必ず含む文字列を求める
         return ret;
     }
 
     //---------------------------------------------------------------------
-    //  リンクリストのコピー
+    //  ノードが後方参照するグループの番号をrefsに加える
     //---------------------------------------------------------------------
-    nfa_node* copy(const nfa_node* node)
+    static void backref(const nfa_node* n, std::vector<int>& refs)
     {
-        //
-        //  再帰的にコピーを行う(ラムダ式(無名関数)を使用)
-        //  「０回以上の繰り返し」の遷移先が「前のノード」に戻る為、
-        //  単純にリンクをたどっての再帰では無限ループになる。
-        //  unordered_map(mapでも可)を使って「オリジナルnfa_node」と「コピーしたnfa_node」
-        //  のペアを持たせて、ループ対策を行っている
-        //
-        std::unordered_map<const nfa_node*, nfa_node*> hash;
-        auto fnc = [&hash](auto f, const nfa_node* n) -> nfa_node* {
-            if (!n)
-                return nullptr;
-            if (hash.count(n))              //  訪問(コピー)済みであるかを確認する
-                return hash[n];             //  既に訪問(コピー)済みなので、その時の値を戻す
-
-            auto ret = new nfa_node(*n);    //  コピー作成
-            hash[n] = ret;                  //  オリジナルとコピーのペアで登録する。ループチェックに使用する
-            ret->n1 = f(f, n->n1);          //  n1遷移側を再帰的にコピーする
-            ret->n2 = f(f, n->n2);          //  n2遷移側を再帰的にコピーする
-            return ret;                     //  コピーを返す
-        };
-        return fnc(fnc, node);
+        if (n->type == node_type::ESCAPE && iswdigit(n->val[1]))
+            refs.push_back(_wtoi(n->val + 1));
+        if (n->type == node_type::CLASS) {
+            for (intptr_t i = 0; i < n->len; i++) {
+                if (n->val[i] == L'\\' && iswdigit(n->val[++i]))
+                    refs.push_back(_wtoi(n->val + i));
+            }
+        }
     }
 
     //---------------------------------------------------------------------
-    //  リンクリストの末尾ノードを返す
+    //  状態集合による探索用に、ノードの序数と遷移の表を作る
     //---------------------------------------------------------------------
-    nfa_node* last(nfa_node* n)
+    //  各ノードに序数を振り、ノード毎に遷移先と「そのノードへ遷移してくるノード」
+    //  (逆向きの遷移)を記録する。後方参照を含むパターンは、キャプチャに依存するので
+    //  状態集合では探索できない。回数がRUN_MAXを超える一文字の繰り返しを含むパターンも同じ。
+    //  また、終了状態へ至る全ての経路が、文字を消費せずに行末「$」を通るパターン
+    //  (「\.(log|gz)$」など)は、テキスト末尾にしか一致しないことが分かる
+    //---------------------------------------------------------------------
+    void build_graph(nfa_node* n)
     {
-        //  「nfa_complied::copy」同様、ループ対策でunordered_setを使う
-        std::unordered_set<nfa_node*> hash;
-        hash.insert(nullptr);
-        //  n1/n2の両方がnullptr(==末尾)になるまでリンクをたどる
-        while (n && (n->n1 || n->n2))
-            n = hash.insert(n->n1).second ? n->n1 : (hash.insert(n->n2).second ? n->n2 : nullptr);
-        return n;
+        std::pmr::unordered_map<const nfa_node*, int> id(scratch_);
+        for (auto node : nfa_list(n)) {
+            id[node] = static_cast<int>(graph_.node.size());
+            graph_.node.push_back(node);
+            if (node->type == node_type::END)
+                graph_.end = id[node];
+        }
+        graph_.head = id[n];
+        graph_.succ.resize(graph_.node.size());
+        graph_.pred.resize(graph_.node.size());
+        graph_.number_slots();
+
+        for (auto node : graph_.node) {
+            auto nx = next(node);
+            for (auto to : { nx.first, nx.second }) {
+                if (to) {
+                    graph_.succ[id[node]].push_back(id[to]);
+                    graph_.pred[id[to]].push_back(id[node]);
+                }
+            }
+            backref(node, refs_);
+            if (node->type == node_type::RUN && (node->min > RUN_MAX || node->max > RUN_MAX))
+                long_run_ = true;
+        }
+        //  無いグループへの後方参照は常に一致しないだけで、キャプチャには依存しない
+        refs_.erase(std::remove_if(refs_.begin(), refs_.end(), [this](const int r) { return r < 1 || r > group_cnt_; }), refs_.end());
+        std::sort(refs_.begin(), refs_.end());
+        refs_.erase(std::unique(refs_.begin(), refs_.end()), refs_.end());
+        has_backref_ = !refs_.empty();
+
+        //  終了状態から逆向きにたどり、「$」より前に文字を消費するノードか先頭に着いたら末尾固定ではない
+        std::vector<int> work = { graph_.end };
+        std::vector<bool> seen(graph_.node.size());
+        end_anchored_ = true;
+        while (!work.empty() && end_anchored_) {
+            auto x = work.back();
+            work.pop_back();
+            for (auto y : graph_.pred[x]) {
+                if (seen[y])
+                    continue;
+                seen[y] = true;
+                auto node = graph_.node[y];
+                if (node->type == node_type::EOL)
+                    continue;
+                if (y == graph_.head || width(node) != std::pair<intptr_t, intptr_t>(0, 0)) {
+                    end_anchored_ = false;
+                    break;
+                }
+                work.push_back(y);
+            }
+        }
     }
 
     //---------------------------------------------------------------------
-    //  二つのノードを結合する
+    //  一致が必ず含む文字列を求める
+    //---------------------------------------------------------------------
+    //  先頭から終了状態への全ての経路が通るノード(支配ノード)のうち、大文字小文字を区別して
+    //  一文字だけに一致するものを経路の順に並べる。隣り合う二つの間に文字を消費するノードが
+    //  無ければ、テキスト上でも隣り合うので連ねられる。そうして連ねた中で最も長いものを採る。
+    //  「(foo|bar)baz」は「baz」、「a\.b+c」は「a.b」になる(regex_setが照合するパターンを絞り込むのに使う)
+    //---------------------------------------------------------------------
+    void build_literal()
+    {
+        constexpr size_t MAX_NODES = 256;   //  これより大きいグラフでは求めない(ノード数の二乗に比例する)
+        const auto& g = graph_;
+        const int n = static_cast<int>(g.node.size());
+        if (g.node.size() > MAX_NODES || g.head < 0 || g.end < 0)
+            return;
+
+        //  from(の遷移先)からavoidを通らずに到達できるノード
+        auto reach = [&g, n](const int from, const int avoid, const bool self) {
+            std::vector<char> seen(n);
+            std::vector<int> work;
+            if (self)
+                work.push_back(from);
+            else
+                work.insert(work.end(), g.succ[from].begin(), g.succ[from].end());
+            while (!work.empty()) {
+                auto x = work.back();
+                work.pop_back();
+                if (x == avoid || seen[x])
+                    continue;
+                seen[x] = 1;
+                work.insert(work.end(), g.succ[x].begin(), g.succ[x].end());
+            }
+            return seen;
+        };
+
+        //  支配ノードと、それより前にある支配ノードの数(経路の順に並べるのに使う)
+        std::vector<std::pair<int, int>> dom;
+        std::vector<std::vector<char>> seen;
+        for (int x = 0; x < n; x++) {
+            if (x == g.end)
+                continue;
+            auto s = reach(g.head, x, true);
+            if (!s[g.end]) {
+                dom.push_back({ 0, x });
+                seen.push_back(std::move(s));
+            }
+        }
+        for (size_t i = 0; i < dom.size(); i++) {
+            for (size_t j = 0; j < dom.size(); j++)
+                dom[i].first += i != j && !seen[j][dom[i].second];
+        }
+        std::sort(dom.begin(), dom.end());
+
+        std::wstring cur;
+        int prev = -1;
+        for (auto& d : dom) {
+            const int x = d.second;
+            std::vector<char_range> cand;
+            const bool lit = single(g.node[x]) && members(g.node[x], cand, false) && !cand.empty() &&
+                             std::all_of(cand.begin(), cand.end(), [&cand](const char_range& r) { return r.lo == cand[0].lo && r.hi == r.lo; });
+            if (!lit) {
+                if (width(g.node[x]) != std::pair<intptr_t, intptr_t>(0, 0))
+                    prev = -1;      //  文字を消費するノードで途切れる
+                continue;
+            }
+            if (prev >= 0) {
+                //  前の文字から、この文字を通らずに到達できるノードが文字を消費するなら、隣り合わない
+                auto s = reach(prev, x, false);
+                for (int y = 0; y < n && prev >= 0; y++) {
+                    if (s[y] && width(g.node[y]) != std::pair<intptr_t, intptr_t>(0, 0))
+                        prev = -1;
+                }
+            }
+            if (prev < 0)
+                cur.clear();
+            cur += cand[0].lo;
+            prev = x;
+            if (cur.size() > literal_.size())
+                literal_ = cur;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  先頭からの全ての経路が、文字を消費する前に行頭「^」を通るかを調べる
+    //  「^abc」「^(a|b)」「(^a|^b)」などが該当する
+    //---------------------------------------------------------------------
+    static bool starts_with_bol(const nfa_node* head)
+    {
+        std::unordered_set<const nfa_node*> hash;
+        auto fnc = [&hash](auto f, const nfa_node* n) -> bool {
+            if (!n || !hash.insert(n).second)
+                return true;                        //  経路が無いか、別の経路で確認済み
+            switch (n->type) {
+            case node_type::BOL:
+                return true;
+            case node_type::ESCAPE:
+                if (n->val[1] == L'b' || n->val[1] == L'B')
+                    break;                          //  単語境界は文字を消費しない
+                return false;
+            case node_type::DEFAULT:
+                if (n->len == 1 && n->val)
+                    return false;                   //  通常文字
+                break;
+            case node_type::GROUP:
+            case node_type::ENDGROUP:
+            case node_type::ENDLOOP:
+            case node_type::ENDATOMIC:
+                break;
+            case node_type::LOOP:
+            case node_type::ATOMIC:
+                return f(f, n->n1);                 //  n2は終端ノードへの参照であり遷移先ではない
+            default:
+                return false;                       //  終了状態、文字クラス、一文字の繰り返しなど
+            }
+            return f(f, n->n1) && f(f, n->n2);
+        };
+        return fnc(fnc, head);
+    }
+
+    //---------------------------------------------------------------------
+    //  ノードが消費する文字数の範囲(上限-1は無制限)
+    //---------------------------------------------------------------------
+    static std::pair<intptr_t, intptr_t> width(const nfa_node* n)
+    {
+        switch (n->type) {
+        case node_type::CLASS:
+            return { 1, 1 };
+        case node_type::ESCAPE:
+            if (n->val[1] == L'b' || n->val[1] == L'B')
+                return { 0, 0 };                //  単語境界
+            if (iswdigit(n->val[1]))
+                return { 0, -1 };               //  後方参照
+            return { 1, 1 };
+        case node_type::RUN:
+            return { n->min, n->max };
+        case node_type::DEFAULT:
+            if (n->len == 1 && n->val)
+                return { 1, 1 };                //  通常文字
+            return { 0, 0 };
+        default:
+            return { 0, 0 };
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  遷移先を列挙する(LOOP、ATOMIC、RUNのn2は参照であり遷移先ではない)
+    //---------------------------------------------------------------------
+    static std::pair<const nfa_node*, const nfa_node*> next(const nfa_node* n)
+    {
+        bool ref = n->type == node_type::LOOP || n->type == node_type::ATOMIC || n->type == node_type::RUN;
+        return { n->n1, ref ? nullptr : n->n2 };
+    }
+
+    //---------------------------------------------------------------------
+    //  マッチ長の下限と上限を求める
+    //---------------------------------------------------------------------
+    //  下限は、消費する文字数を重みにした終了状態までの最短経路(ダイクストラ法)。
+    //  上限は、経路上にループ(閉路)、上限の無い繰り返し、後方参照があれば無制限で、
+    //  それ以外は終了状態までの最長経路になる
+    //---------------------------------------------------------------------
+    void measure(const nfa_node* n)
+    {
+        using item = std::pair<intptr_t, const nfa_node*>;
+        std::priority_queue<item, std::vector<item>, std::greater<item>> queue;
+        std::unordered_map<const nfa_node*, intptr_t> dist;
+        queue.push({ 0, n });
+        dist[n] = 0;
+        while (!queue.empty()) {
+            auto d = queue.top().first;
+            auto node = queue.top().second;
+            queue.pop();
+            if (dist[node] < d)
+                continue;                       //  既により短い経路で処理済み
+            if (node->type == node_type::END) {
+                min_len_ = d;
+                break;
+            }
+            auto w = width(node).first;
+            auto nx = next(node);
+            for (auto to : { nx.first, nx.second }) {
+                if (!to)
+                    continue;
+                auto it = dist.find(to);
+                if (it == dist.end() || d + w < it->second) {
+                    dist[to] = d + w;
+                    queue.push({ d + w, to });
+                }
+            }
+        }
+
+        //  最長経路(-1は無制限、-2は終了状態に到達しない)
+        std::unordered_map<const nfa_node*, intptr_t> memo;
+        auto longest = [&memo](auto f, const nfa_node* node) -> intptr_t {
+            if (node->type == node_type::END)
+                return 0;
+            auto it = memo.find(node);
+            if (it != memo.end())
+                return it->second == -3 ? -1 : it->second;  //  探索中のノードに戻った(閉路)
+            memo[node] = -3;
+            auto w = width(node).second;
+            intptr_t ret = -2;
+            auto nx = next(node);
+            for (auto to : { nx.first, nx.second }) {
+                if (!to)
+                    continue;
+                auto r = f(f, to);
+                if (r == -1 || (r >= 0 && w < 0)) {
+                    ret = -1;
+                    break;
+                }
+                if (r >= 0)
+                    ret = std::max(ret, r + w);
+            }
+            return memo[node] = ret;
+        };
+        max_len_ = std::max<intptr_t>(longest(longest, n), -1);
+    }
+
+    //---------------------------------------------------------------------
+    //  ループ本体(LOOP - ENDLOOP間)がテキストを消費せずに通過できるかを調べる
+    //  「(.??)*」「(a|)*」の様にε遷移だけで一周できるループが該当する
+    //---------------------------------------------------------------------
+    bool nullable(const nfa_node* head, const nfa_node* tail)
+    {
+        std::unordered_set<const nfa_node*> hash;
+        auto fnc = [&hash, tail](auto f, const nfa_node* n) -> bool {
+            if (!n || !hash.insert(n).second)
+                return false;
+            if (n == tail)
+                return true;                        //  テキストを消費せずにENDLOOPへ到達した
+            switch (n->type) {
+            case node_type::CLASS:
+                return false;                       //  一文字消費する
+            case node_type::ESCAPE:
+                if (n->val[1] != L'b' && n->val[1] != L'B' && !iswdigit(n->val[1]))
+                    return false;                   //  単語境界と後方参照(空文字列の場合がある)以外は一文字消費する
+                break;
+            case node_type::DEFAULT:
+                if (n->len == 1 && n->val)
+                    return false;                   //  通常文字
+                break;
+            case node_type::RUN:
+                if (n->min > 0)
+                    return false;                   //  一文字以上消費する
+                return f(f, n->n1);
+            case node_type::LOOP:
+            case node_type::ATOMIC:
+                return f(f, n->n1);                 //  n2は終端ノードへの参照であり遷移先ではない
+            default:
+                break;
+            }
+            return f(f, n->n1) || f(f, n->n2);
+        };
+        return fnc(fnc, head);
+    }
+
+    //---------------------------------------------------------------------
+    //  ε遷移無限ループ対策の要否をループ毎に決める
+    //---------------------------------------------------------------------
+    //  本体が必ずテキストを消費するループ(「a*」「[0-9]+」「(ab)*」など)では、
+    //  ENDLOOPでの位置比較は常に成立しないので、LOOP/ENDLOOPを分岐ノードに降格する。
+    //  監視が必要なループには通し番号を振り、regex_ptt側はその番号の位置で監視を行う
+    //  (コンパイル済みのリンクリストを書き換えずに済むので、複数の探索で共有できる)
+    //---------------------------------------------------------------------
+    void loop_guard(nfa_node* n)
+    {
+        for (auto node : nfa_list(n)) {
+            if (node->type != node_type::LOOP)
+                continue;
+            auto end = node->n2;                    //  ENDLOOPノード
+            if (nullable(node->n1, end)) {
+                node->len = end->len = loop_cnt_++; //  監視位置の序数(nfa_node::lenメンバ変数を代用している)
+            } else {
+                node->type = end->type = node_type::DEFAULT;
+                node->n2 = nullptr;                 //  分岐しないε遷移になる
+            }
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  一文字の繰り返し(RUN)の序数付けと自動強欲化
+    //---------------------------------------------------------------------
+    //  「\d+[a-z]」「[^"]*"」「\w+\s」の様に、ループ本体(一文字)と後続の先頭文字が
+    //  共通の文字を持たない場合、ループ本体が一致する位置でループを抜けても
+    //  後続は一致しない。そのような最長一致の繰り返しを強欲にして、
+    //  バックトラックを省く
+    //---------------------------------------------------------------------
+    void possessify(nfa_node* n)
+    {
+        //  候補の範囲の並びa、bに重なる範囲があるか
+        auto overlap = [](std::vector<char_range>& a, std::vector<char_range>& b) {
+            auto less = [](const char_range& x, const char_range& y) { return x.lo < y.lo; };
+            std::sort(a.begin(), a.end(), less);
+            std::sort(b.begin(), b.end(), less);
+            for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+                if (a[i].lo <= b[j].hi && b[j].lo <= a[i].hi)
+                    return true;
+                (a[i].hi < b[j].hi) ? i++ : j++;
+            }
+            return false;
+        };
+
+        //  ループ本体vと後続の先頭ノードfollowに共通する文字が無いかを調べる
+        //  両方の候補を列挙できれば範囲が重なるかを比べる。一方だけなら、256未満はビット表を比べ、
+        //  256以上は列挙できる側の候補を一文字ずつもう一方に照らす(多すぎれば共通する文字があるとみなす)
+        auto disjoint = [&overlap](const nfa_node* v, const std::vector<const nfa_node*>& follow, const bool nocase) {
+            nfa_node::char_set vs;
+            fill(v, vs);
+            std::vector<char_range> vc, fc;
+            const bool ve = members(v, vc, nocase);
+            for (auto f : follow) {
+                fc.clear();
+                const bool fe = members(f, fc, nocase);
+                if (ve && fe) {
+                    if (overlap(vc, fc))
+                        return false;
+                    continue;
+                }
+                if (!ve && !fe)
+                    return false;   //  どちらの候補も列挙できない
+                nfa_node::char_set fs;
+                fill(f, fs);
+                for (int w = 0; w < 8; w++) {
+                    if (vs.bits[nocase][w] & fs.bits[nocase][w])
+                        return false;
+                }
+                size_t count = 0;
+                for (auto& r : ve ? vc : fc) {
+                    if (r.hi < 256)
+                        continue;
+                    const wchar_t lo = std::max<wchar_t>(r.lo, 256);
+                    count += static_cast<size_t>(r.hi - lo) + 1;
+                    if (count > 0x400)
+                        return false;
+                    for (wchar_t c = lo;; c++) {
+                        if (contains(ve ? f : v, c, nocase))
+                            return false;
+                        if (c == r.hi)
+                            break;
+                    }
+                }
+            }
+            return true;
+        };
+
+        for (auto node : nfa_list(n)) {
+            if (node->type != node_type::RUN)
+                continue;
+            node->len = run_cnt_++;     //  regex_ptt側の作業領域の序数(nfa_node::lenメンバ変数を代用している)
+            if ((node->flag & (nfa_node::LAZY | nfa_node::EXACT | nfa_node::ICASE)) || node->min == node->max)
+                continue;               //  最短一致、強欲指定済み、回数固定は対象外
+
+            std::vector<const nfa_node*> next;
+            if (!follow(node->n1, next))
+                continue;
+            node->flag |= disjoint(node->n2, next, false) ? nfa_node::EXACT : 0;
+            node->flag |= disjoint(node->n2, next, true) ? nfa_node::ICASE : 0;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  一文字を消費するノードのビット表と、一致の先頭になり得る文字の集合を作る
+    //---------------------------------------------------------------------
+    //  regex_ptt::NOCASEは探索時に指定するので、大文字小文字を区別する/しない両方の表を
+    //  コンパイル時に作っておき、探索時は指定に合う方を引くだけにする。
+    //  一致の先頭になり得る文字は、マッチ長の下限が1以上で、先頭のノードが全て
+    //  列挙できる場合だけ求める(regex_ptt::SEARCH指示で開始位置を読み飛ばすのに使う)
+    //---------------------------------------------------------------------
+    void build_sets(nfa_node* n)
+    {
+        //  一文字を消費するノード(RUNのループ本体を含む)のビット表
+        for (auto node : nfa_list(n)) {
+            if (!single(node))
+                continue;       //  単語境界、後方参照など、文字だけでは決まらないノード
+            nfa_node::char_set set;
+            fill(node, set);
+            std::vector<char_range> wide;       //  大文字小文字を区別する場合の候補(どちらの場合も一致する)
+            const bool listed = members(node, wide, false);
+            std::sort(wide.begin(), wide.end(), [](const char_range& a, const char_range& b) { return a.lo < b.lo; });
+            for (const bool nocase : { false, true }) {
+                auto& r = set.range[nocase];
+                if (node->type == node_type::DEFAULT && node->val[0] == L'.') {
+                    r.n = 2;        //  改行とL'\0'以外の全て
+                    r.lo[0] = 1;
+                    r.hi[0] = L'\n' - 1;
+                    r.lo[1] = L'\n' + 1;
+                    r.hi[1] = WCHAR_MAX;
+                    continue;
+                }
+                r = simd::from_bits(set.bits[nocase]);
+                for (auto& w : wide) {
+                    if (!listed || r.n < 0)
+                        break;
+                    if (w.hi < 256)
+                        continue;
+                    simd::ranges wider = r;
+                    simd::add(wider, std::max<wchar_t>(w.lo, 256), w.hi);
+                    if (wider.n < 0)
+                        break;      //  入りきらない文字はカーネルが止まった位置で判定する
+                    r = wider;
+                }
+            }
+            sets_.push_back(set);
+            node->set = &sets_.back();
+        }
+
+        //  一致の先頭になり得る文字
+        std::vector<const nfa_node*> head;
+        if (min_len_ < 1 || !follow(n, head))
+            return;
+        for (const bool nocase : { false, true }) {
+            std::vector<char_range> cand;
+            for (auto node : head) {
+                if (!members(node, cand, nocase))
+                    return;     //  「.」「\w」など、列挙しきれない
+                for (int w = 0; w < 8; w++)
+                    first_.low.bits[nocase][w] |= node->set->bits[nocase][w];
+            }
+            for (auto& r : cand) {
+                if (r.hi >= 256)
+                    first_.high[nocase].push_back({ std::max<wchar_t>(r.lo, 256), r.hi });
+            }
+        }
+        first_.finish();
+        has_first_ = true;
+    }
+
+    //---------------------------------------------------------------------
+    //  状態(キャプチャや前後の文字)に依存せず、必ず一文字を消費するノードか？
+    //---------------------------------------------------------------------
+    static bool single(const nfa_node* n)
+    {
+        auto stateless = [](const wchar_t e) { return e != L'b' && e != L'B' && !iswdigit(e); };
+        if (!n)
+            return false;
+        switch (n->type) {
+        case node_type::CLASS:
+            for (intptr_t i = 0; i < n->len; i++) {
+                if (n->val[i] == L'\\' && !stateless(n->val[++i]))
+                    return false;
+            }
+            return true;
+        case node_type::ESCAPE:
+            return stateless(n->val[1]);
+        case node_type::DEFAULT:
+            return n->len == 1 && n->val;
+        default:
+            return false;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  ノードの後に続く「一文字を消費するノード」を集める
+    //  戻り値  :  後続の先頭文字が特定できない(終了状態、後方参照など)場合はfalse
+    //---------------------------------------------------------------------
+    bool follow(const nfa_node* n, std::vector<const nfa_node*>& out)
+    {
+        std::unordered_set<const nfa_node*> hash;
+        auto fnc = [&hash, &out](auto f, const nfa_node* node) -> bool {
+            if (!node || !hash.insert(node).second)
+                return true;
+            switch (node->type) {
+            case node_type::END:
+                return false;                       //  部分一致では何が続いても一致する
+            case node_type::EOL:
+                return true;                        //  テキスト末尾にしか一致しない
+            case node_type::ESCAPE:
+                if (node->val[1] == L'b' || node->val[1] == L'B')
+                    break;                          //  単語境界は文字を消費しない
+                if (!single(node))
+                    return false;                   //  後方参照
+                out.push_back(node);
+                return true;
+            case node_type::CLASS:
+            case node_type::DEFAULT:
+                if (node->type == node_type::DEFAULT && !(node->len == 1 && node->val))
+                    break;                          //  ε遷移
+                if (!single(node))
+                    return false;
+                out.push_back(node);
+                return true;
+            case node_type::RUN:
+                out.push_back(node->n2);            //  ループ本体
+                return node->min > 0 || f(f, node->n1);
+            case node_type::LOOP:
+            case node_type::ATOMIC:
+                return f(f, node->n1);
+            default:
+                break;
+            }
+            return f(f, node->n1) && f(f, node->n2);
+        };
+        return fnc(fnc, n);
+    }
+
+    //---------------------------------------------------------------------
+    //  一文字を消費するノードに一致し得る文字を、範囲の並びで列挙する
+    //  nocaseがtrueなら、大文字小文字を区別しない場合の候補(大文字小文字の環の文字)も含める。
+    //  候補は多めでも構わない(「\d」「\s」は表の範囲をそのまま加え、一文字ずつには広げない)
+    //  戻り値  :  候補を列挙しきれない(「.」「\w」「[^a]」など)場合はfalse
+    //---------------------------------------------------------------------
+    static bool members(const nfa_node* n, std::vector<char_range>& out, const bool nocase = true)
+    {
+        auto push = [&out](const uint32_t lo, const uint32_t hi) {
+            if (lo <= static_cast<uint32_t>(WCHAR_MAX))
+                out.push_back({ static_cast<wchar_t>(lo), static_cast<wchar_t>(std::min(hi, static_cast<uint32_t>(WCHAR_MAX))) });
+        };
+        auto orbit = [&push](const uint32_t c) {
+            for (uint32_t o = unicode::orbit(c); o != c; o = unicode::orbit(o))
+                push(o, o);
+        };
+        auto literal = [&push, &orbit, nocase](const wchar_t c) {
+            push(static_cast<uint32_t>(c), static_cast<uint32_t>(c));
+            if (nocase)
+                orbit(static_cast<uint32_t>(c));
+        };
+        auto escape = [&push, &literal](const wchar_t e) -> bool {
+            switch (e) {
+            case L't':  push(L'\t', L'\t');   return true;
+            case L'n':  push(L'\n', L'\n');   return true;
+            case L'r':  push(L'\r', L'\r');   return true;
+            case L'.':  push(L'.', L'.');     return true;
+            case L'd':
+                for (auto& r : unicode::digit_range)
+                    push(r[0], r[1]);
+                return true;
+            case L's':
+                for (auto c : unicode::space_char)
+                    push(c, c);
+                return true;
+            case L'D': case L'S': case L'w': case L'W':
+                return false;
+            }
+            literal(e);
+            return true;
+        };
+
+        switch (n->type) {
+        case node_type::DEFAULT:
+            if (n->val[0] == L'.')
+                return false;
+            literal(n->val[0]);
+            return true;
+        case node_type::ESCAPE:
+            return escape(n->val[1]);
+        case node_type::CLASS: {
+            const wchar_t* s = n->val;
+            if (s[0] == L'^')
+                return false;
+            for (intptr_t i = 0; i < n->len; i++) {
+                if (s[i] == L'\\') {
+                    if (!escape(s[++i]))
+                        return false;
+                } else if (s[i + 1] == L'-' && s[i + 2] != L']') {
+                    const uint32_t lo = static_cast<uint32_t>(s[i]), hi = static_cast<uint32_t>(s[i + 2]);
+                    if (lo <= hi)
+                        push(lo, hi);
+                    if (nocase) {
+                        if (hi - lo > 0x100)
+                            return false;   //  環の文字を求めきれない
+                        for (uint32_t c = lo; c <= hi; c++)
+                            orbit(c);
+                    }
+                    i += 2;
+                } else if (s[i] == L'.') {
+                    push(L'.', L'.');
+                } else {
+                    literal(s[i]);
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  一文字を消費するノードが一致する0～255の文字をビット表に設定する
+    //  (regex_ptt::acceptと同じ判定を、文字クラスの範囲とエスケープの表から直接求める)
+    //---------------------------------------------------------------------
+    static void fill(const nfa_node* n, nfa_node::char_set& set)
+    {
+        auto both = [&set](const uint32_t c) {
+            if (c >= 1 && c < 256) {
+                set.set(static_cast<wchar_t>(c), false);
+                set.set(static_cast<wchar_t>(c), true);
+            }
+        };
+        //  大文字小文字を区別しない場合は、大文字小文字の環でつながっている文字にも一致する
+        auto orbit = [&set](const uint32_t c) {
+            for (uint32_t o = unicode::orbit(c); o != c; o = unicode::orbit(o)) {
+                if (o < 256)
+                    set.set(static_cast<wchar_t>(o), true);
+            }
+        };
+        auto literal = [&both, &orbit](const wchar_t c) {
+            both(static_cast<uint32_t>(c));
+            orbit(static_cast<uint32_t>(c));
+        };
+        auto range = [&set, &both, &orbit](const uint32_t lo, const uint32_t hi) {
+            for (uint32_t c = std::max(lo, 1u); c <= hi && c < 256; c++)
+                both(c);
+            if (lo <= hi && hi - lo < 0x100) {
+                for (uint32_t c = lo; c <= hi; c++)
+                    orbit(c);
+                return;
+            }
+            for (uint32_t c = 1; c < 256; c++) {
+                for (uint32_t o = unicode::orbit(c); o != c; o = unicode::orbit(o)) {
+                    if (lo <= o && o <= hi)
+                        set.set(static_cast<wchar_t>(c), true);
+                }
+            }
+        };
+        auto property = [&both](const uint8_t mask, const bool negate) {
+            for (uint32_t c = 1; c < 256; c++) {
+                if (((unicode::property(c) & mask) != 0) != negate)
+                    both(c);
+            }
+        };
+        auto escape = [&both, &literal, &property](const wchar_t e) {
+            switch (e) {
+            case L't':  both(L'\t');                        break;
+            case L'n':  both(L'\n');                        break;
+            case L'r':  both(L'\r');                        break;
+            case L'.':  both(L'.');                         break;
+            case L'd':  property(unicode::DIGIT, false);    break;
+            case L'D':  property(unicode::DIGIT, true);     break;
+            case L's':  property(unicode::SPACE, false);    break;
+            case L'S':  property(unicode::SPACE, true);     break;
+            case L'w':  property(unicode::WORD, false);     break;
+            case L'W':  property(unicode::WORD, true);      break;
+            default:    literal(e);                         break;
+            }
+        };
+
+        switch (n->type) {
+        case node_type::DEFAULT:
+            if (n->val[0] == L'.') {
+                for (uint32_t c = 1; c < 256; c++) {
+                    if (c != L'\n')
+                        both(c);
+                }
+            } else {
+                literal(n->val[0]);
+            }
+            break;
+        case node_type::ESCAPE:
+            escape(n->val[1]);
+            break;
+        case node_type::CLASS: {
+            const wchar_t* s = n->val;
+            const int r = (s[0] == L'^');
+            for (intptr_t i = r; i < n->len; i++) {
+                if (s[i] == L'\\') {
+                    escape(s[++i]);
+                } else if (s[i + 1] == L'-' && s[i + 2] != L']') {
+                    range(static_cast<uint32_t>(s[i]), static_cast<uint32_t>(s[i + 2]));
+                    i += 2;
+                } else if (s[i] == L'.') {
+                    both(L'.');
+                } else {
+                    literal(s[i]);
+                }
+            }
+            if (r) {
+                for (auto& bits : set.bits) {
+                    for (auto& w : bits)
+                        w = ~w;
+                    bits[0] &= ~1u;     //  L'\0'には一致しない
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  一文字を消費するノードが文字cに一致するか(regex_ptt::acceptと同じ判定)
+    //  ビット表の無い256以上の文字を、コンパイル時に一文字ずつ調べるのに使う
+    //---------------------------------------------------------------------
+    static bool contains(const nfa_node* n, const wchar_t c, const bool nocase)
+    {
+        const uint32_t u = static_cast<uint32_t>(c);
+        const uint8_t prop = unicode::property(u);
+        //  大文字小文字を区別しない場合は、cと大文字小文字の環でつながっている文字も比べる
+        auto range = [u, prop, nocase](const uint32_t lo, const uint32_t hi) {
+            if (lo <= u && u <= hi)
+                return true;
+            if (!nocase || !(prop & unicode::CASED))
+                return false;
+            for (uint32_t o = unicode::orbit(u); o != u; o = unicode::orbit(o)) {
+                if (lo <= o && o <= hi)
+                    return true;
+            }
+            return false;
+        };
+        auto escape = [c, prop, &range](const wchar_t e) {
+            switch (e) {
+            case L't':  return c == L'\t';
+            case L'n':  return c == L'\n';
+            case L'r':  return c == L'\r';
+            case L'.':  return c == L'.';
+            case L'd':  return (prop & unicode::DIGIT) != 0;
+            case L'D':  return (prop & unicode::DIGIT) == 0;
+            case L's':  return (prop & unicode::SPACE) != 0;
+            case L'S':  return (prop & unicode::SPACE) == 0;
+            case L'w':  return (prop & unicode::WORD) != 0;
+            case L'W':  return (prop & unicode::WORD) == 0;
+            default:    return range(static_cast<uint32_t>(e), static_cast<uint32_t>(e));
+            }
+        };
+
+        switch (n->type) {
+        case node_type::DEFAULT:
+            if (n->val[0] == L'.')
+                return c != L'\n';
+            return range(static_cast<uint32_t>(n->val[0]), static_cast<uint32_t>(n->val[0]));
+        case node_type::ESCAPE:
+            return escape(n->val[1]);
+        case node_type::CLASS: {
+            const wchar_t* s = n->val;
+            const bool r = (s[0] == L'^');
+            for (intptr_t i = r; i < n->len; i++) {
+                if (s[i] == L'\\') {
+                    if (escape(s[++i]))
+                        return !r;
+                } else if (s[i + 1] == L'-' && s[i + 2] != L']') {
+                    if (range(static_cast<uint32_t>(s[i]), static_cast<uint32_t>(s[i + 2])))
+                        return !r;
+                    i += 2;
+                } else if (s[i] == L'.') {
+                    if (c == L'.')
+                        return !r;
+                } else if (range(static_cast<uint32_t>(s[i]), static_cast<uint32_t>(s[i]))) {
+                    return !r;
+                }
+            }
+            return r;
+        }
+        default:
+            return false;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  リンクリストのコピー
+    //---------------------------------------------------------------------
+    nfa_node* copy(const nfa_node* node)
+    {
+        //
+        //  再帰的にコピーを行う(ラムダ式(無名関数)を使用)
+        //  「０回以上の繰り返し」の遷移先が「前のノード」に戻る為、
+        //  単純にリンクをたどっての再帰では無限ループになる。
+        //  unordered_map(mapでも可)を使って「オリジナルnfa_node」と「コピーしたnfa_node」
+        //  のペアを持たせて、ループ対策を行っている
+        //
+        std::pmr::unordered_map<const nfa_node*, nfa_node*> hash(scratch_);
+        auto fnc = [this, &hash](auto f, const nfa_node* n) -> nfa_node* {
+            if (!n)
+                return nullptr;
+            if (hash.count(n))              //  訪問(コピー)済みであるかを確認する
+                return hash[n];             //  既に訪問(コピー)済みなので、その時の値を戻す
+
+            auto ret = make_node(*n);       //  コピー作成
+            hash[n] = ret;                  //  オリジナルとコピーのペアで登録する。ループチェックに使用する
+            ret->n1 = f(f, n->n1);          //  n1遷移側を再帰的にコピーする
+            ret->n2 = f(f, n->n2);          //  n2遷移側を再帰的にコピーする
+            return ret;                     //  コピーを返す
+        };
+        return fnc(fnc, node);
+    }
+
+    //---------------------------------------------------------------------
+    //  リンクリストの末尾ノードを返す
+    //---------------------------------------------------------------------
+    nfa_node* last(nfa_node* n)
+    {
+        //  「nfa_complied::copy」同様、ループ対策でunordered_setを使う
+        std::pmr::unordered_set<nfa_node*> hash(scratch_);
+        hash.insert(nullptr);
+        //  n1/n2の両方がnullptr(==末尾)になるまでリンクをたどる
+        while (n && (n->n1 || n->n2))
+            n = hash.insert(n->n1).second ? n->n1 : (hash.insert(n->n2).second ? n->n2 : nullptr);
+        return n;
+    }
+
+    //---------------------------------------------------------------------
+    //  二つのノードを結合する
     //---------------------------------------------------------------------
     nfa_node* cat(nfa_node* n1, nfa_node* n2)
     {
@@ -190,12 +1909,12 @@ private:
     //---------------------------------------------------------------------
     //  nfaリンクリストのノードをvectorに入れて返す
     //---------------------------------------------------------------------
-    std::vector<nfa_node*> nfa_list(nfa_node* n)
+    std::pmr::vector<nfa_node*> nfa_list(nfa_node* n)
     {
         //  「nfa_compiled::copy」と同じような処理。ただし、コピーではなく
         //  vectorへ値を格納する
-        std::vector<nfa_node*> ret;
-        std::unordered_set<nfa_node*> hash;
+        std::pmr::vector<nfa_node*> ret(scratch_);
+        std::pmr::unordered_set<nfa_node*> hash(scratch_);
         auto fnc = [&ret, &hash](auto f, nfa_node* node) -> void {
             if (node && hash.insert(node).second) {
                 ret.push_back(node);
@@ -208,18 +1927,14 @@ private:
     }
 
     //---------------------------------------------------------------------
-    //  nfaリンクリストのメモリを開放する
+    //  ノードをarena_に作る
+    //  ノードは個別には解放せず、regex_compiledと共にarena_ごと解放する
+    //  (ループや分岐合流するリンクがあっても、解放済みの領域をたどる心配がない)
     //---------------------------------------------------------------------
-    void clear(nfa_node* n)
+    nfa_node* make_node(const nfa_node& n = nfa_node())
     {
-        //  ループや分岐合流するリンクがあるため、リンクをたどりながら
-        //  メモリ解放を行えば、解放済みの不正な領域をアクセスする可能性が
-        //  あるため、一旦全ノードを取得してから、メモリ解放をする
-        auto list = nfa_list(n);
-        for (size_t i = 0; i < list.size(); i++) {
-            delete list[i];
-            list[i] = nullptr;
-        }
+        node_cnt_++;
+        return new (arena_.allocate(sizeof(nfa_node), alignof(nfa_node))) nfa_node(n);
     }
 
     //---------------------------------------------------------------------
@@ -229,8 +1944,8 @@ private:
     //----------------------------------------------------------------------
     nfa_node* char1(const wchar_t* v)
     {
-        auto end = new nfa_node();
-        return new nfa_node({ end, nullptr, v, 1 });
+        auto end = make_node();
+        return make_node({ end, nullptr, v, 1 });
     }
 
     //---------------------------------------------------------------------
@@ -243,11 +1958,11 @@ private:
     //---------------------------------------------------------------------
     nfa_node* select1(nfa_node* regex1, nfa_node* regex2)
     {
-        auto end = new nfa_node();
+        auto end = make_node();
         cat(regex1, end);
         cat(regex2, end);
 
-        return new nfa_node({ regex1, regex2 });
+        return make_node({ regex1, regex2 });
     }
 
     //---------------------------------------------------------------------
@@ -268,10 +1983,13 @@ private:
     //---------------------------------------------------------------------
     nfa_node* star(nfa_node* v, bool is_lazy = false)
     {
-        auto end = new nfa_node();
-        auto n1 = new nfa_node({ v,nullptr,nullptr,0,node_type::LOOP });
-        auto n2 = new nfa_node({ nullptr,nullptr,nullptr,0,node_type::ENDLOOP });
-        auto node = new nfa_node();
+        if (auto u = unit(v))
+            return run(u, 0, -1, is_lazy);
+
+        auto end = make_node();
+        auto n1 = make_node({ v,nullptr,nullptr,0,node_type::LOOP });
+        auto n2 = make_node({ nullptr,nullptr,nullptr,0,node_type::ENDLOOP });
+        auto node = make_node();
         if (is_lazy) {  //  最短一致
             n2->n1 = end;
             n2->n2 = n1;
@@ -290,6 +2008,7 @@ private:
         //  なるという問題がある。それを回避するには「ループ間」のテキスト消費を
         //  チェックする。その為にはループ(<n1> - <n2>)範囲を知る必要があるため、
         //  <n1>ノードの「遷移先2」にENDLOOP(<n2>ノード)を設定する
+        //  (チェックが不要なループは、コンパイルの最後にloop_guardで取り除く)
         n1->n2 = n2;
 
         return node;
@@ -301,6 +2020,9 @@ private:
     //---------------------------------------------------------------------
     nfa_node* plus(nfa_node* v, bool is_lazy = false)
     {
+        if (auto u = unit(v))
+            return run(u, 1, -1, is_lazy);
+
         auto t = copy(v);
         auto s = star(v, is_lazy);
         return cat(t, s);
@@ -313,7 +2035,10 @@ private:
     //---------------------------------------------------------------------
     nfa_node* optional(nfa_node* v, bool is_lazy = false)
     {
-        auto e = new nfa_node();    //  ε
+        if (auto u = unit(v))
+            return run(u, 0, 1, is_lazy);
+
+        auto e = make_node();       //  ε
         return is_lazy ? select1(e, v) : select1(v, e);
     }
 
@@ -324,12 +2049,14 @@ private:
     //---------------------------------------------------------------------
     nfa_node* range(nfa_node* v, int n, int m, bool is_lazy = false)
     {
-        auto t = !n ? new nfa_node() : copy(v); //  nが0の場合はε遷移NFAノードを設定する
+        if (auto u = unit(v))
+            return run(u, n, !m ? n : m, is_lazy);
+
+        auto t = !n ? make_node() : copy(v);    //  nが0の場合はε遷移NFAノードを設定する
         for (int i = 0; i < n - 1; i++) {
             cat(t, copy(v));                    //  v + v + ...(n-1)
         }
         if (!m) {               //  v{n}構文
-            clear(v);
             return t;
         } else if (m < 0) {     //  v{n,}構文
             return cat(t, star(v, is_lazy));
@@ -345,19 +2072,63 @@ private:
         //            |        +---------+                       +-(v)-<sw>---+
         //            +------------------+                              +-(v)-+
         //  
-        auto F = new nfa_node();
-        nfa_node** c = is_lazy ? &(last(t)->n2) : &(last(t)->n1);
+        auto F = make_node();
+        nfa_node** c = &(last(t)->n1);          //  末尾がENDGROUP(n1しか遷移しない)の場合もあるので、n1で繋ぐ
         for (int i = n + 1; i <= m; i++) {
-            auto sw = is_lazy ? new nfa_node({ F, copy(v) }) :
-                new nfa_node({ copy(v),F });
+            auto sw = is_lazy ? make_node({ F, copy(v) }) :
+                make_node({ copy(v),F });
             *c = sw;
-            c = is_lazy ? &(last(sw->n2)->n2) : &(last(sw->n1)->n1);
+            c = &(last(is_lazy ? sw->n2 : sw->n1)->n1);
         }
         *c = F;
-        clear(v);
         return t;
     }
 
+    //---------------------------------------------------------------------
+    //  一文字の繰り返し(v*, v+, v?, v{n,m})
+    //  <node>---><end>
+    //    :
+    //   <v>    (<node>の「遷移先2」はループ本体への参照であり、遷移先ではない)
+    //
+    //  LOOP/ENDLOOPを使わずに、regex_ptt側で一致する限り一度に読み進める。
+    //  バックトラックは、位置を一文字ずつ戻して後続を試すだけで済む
+    //---------------------------------------------------------------------
+    nfa_node* run(nfa_node* v, int n, int m, bool is_lazy)
+    {
+        auto end = make_node();
+        return make_node({ end, v, nullptr, 0, node_type::RUN, n, m, is_lazy ? nfa_node::LAZY : 0 });
+    }
+
+    //---------------------------------------------------------------------
+    //  繰り返しの対象が一文字のノード(通常文字、文字クラス、エスケープシーケンス)なら
+    //  そのノードを返す。それ以外はnullptrを返す
+    //---------------------------------------------------------------------
+    nfa_node* unit(nfa_node* v)
+    {
+        if (!single(v))
+            return nullptr;
+        v->n1 = nullptr;            //  通常文字(char1)の終端ノードは不要になる(arena_と共に解放される)
+        return v;
+    }
+
+    //---------------------------------------------------------------------
+    //  アトミックグループ((?>v))、強欲な量指定子(v*+, v++, v?+, v{n,m}+)
+    //  <open>---><v>---><close>--->
+    //  <v>の中で<close>に到達した時点で<v>内の分岐は全て捨てられ、
+    //  後続が失敗しても<v>内へはバックトラックしない
+    //  (<open>の「遷移先2」は<close>への参照であり、遷移先ではない)
+    //---------------------------------------------------------------------
+    nfa_node* atomic(nfa_node* v, bool has_group)
+    {
+        auto open  = make_node({ v,       nullptr, nullptr, 0, node_type::ATOMIC });
+        auto close = make_node({ nullptr, nullptr, nullptr, 0, node_type::ENDATOMIC });
+        cat(open, close);
+        open->n2 = close;
+        open->flag = has_group ? nfa_node::GROUPS : 0;  //  キャプチャのロールバックが必要か
+        atomic_ = true;
+        return open;
+    }
+
     //---------------------------------------------------------------------
     //  <C> ::= 任意の文字
     //  (Unicodeのサロゲートペアなどの処理は複雑になるので実装しない)
@@ -380,7 +2151,7 @@ private:
     }
 
     //---------------------------------------------------------------------
-    //  <F> ::= <C> / <S> / '('<E>')' / '['<C>']'  / '\'<C> / '^' / '$'
+    //  <F> ::= <C> / <S> / '('<E>')' / "(?>"<E>')' / '['<C>']'  / '\'<C> / '^' / '$'
     //---------------------------------------------------------------------
     nfa_node* F()
     {
@@ -399,22 +2170,28 @@ private:
             node_type op = node_type::GROUP;
             node_type ed = node_type::ENDGROUP;
             int cnt = 0;
+            int before = this->group_cnt_;
+            bool is_atomic = false;
             if (!wcsncmp(work_, L"(?:", 3)) {   //  キャプチャしない指定
                 op = ed = node_type::DEFAULT;
                 work_ += 2;
+            } else if (!wcsncmp(work_, L"(?>", 3)) {    //  アトミックグループ(キャプチャしない)
+                is_atomic = true;
+                work_ += 2;
             } else {                            //  キャプチャ。簡素化の為「名前付きキャプチャ」は対応しない
                 cnt = ++this->group_cnt_;       //  キャプチャの序数
             }
             ++work_;
-            auto e = E(new nfa_node());         //  「'('<E>')'」の「<E>」を得る
+            auto e = E(make_node());            //  「'('<E>')'」の「<E>」を得る
             if (work_[0] != L')') {
                 --work_;
-                clear(e);
                 return nullptr;
             }
             ++work_;    // ')'分
-            auto group = new nfa_node({ e,       nullptr, nullptr, 0, op });    //  '(' <E>
-            auto close = new nfa_node({ nullptr, nullptr, nullptr, 0, ed });    //  ')'
+            if (is_atomic)
+                return atomic(e, this->group_cnt_ != before);
+            auto group = make_node({ e,       nullptr, nullptr, 0, op });       //  '(' <E>
+            auto close = make_node({ nullptr, nullptr, nullptr, 0, ed });       //  ')'
             group->len = close->len = cnt;      //  キャプチャの序数(nfa_node::lenメンバ変数を代用している)
 
             return cat(group, close);           // 「'('<E>」+「')'」
@@ -432,7 +2209,7 @@ private:
             }
             if (len == 1 || work_[len] != L']')
                 return nullptr;    //  構文エラー
-            auto ret = new nfa_node({ nullptr, nullptr, work_ + 1, len - 1, node_type::CLASS });
+            auto ret = make_node({ nullptr, nullptr, work_ + 1, len - 1, node_type::CLASS });
             work_ += (len + 1);
             return ret;
         }
@@ -442,15 +2219,15 @@ private:
             if (work_[1] == L'\0')
                 return nullptr;
             work_ += 2;
-            return new nfa_node({ nullptr, nullptr, work_ - 2, 2, node_type::ESCAPE });
+            return make_node({ nullptr, nullptr, work_ - 2, 2, node_type::ESCAPE });
         case L'^':
             //  行頭
             ++work_;
-            return new nfa_node({ nullptr, nullptr, nullptr, 0, node_type::BOL });
+            return make_node({ nullptr, nullptr, nullptr, 0, node_type::BOL });
         case L'$':
             //  行末
             ++work_;
-            return new nfa_node({ nullptr, nullptr, nullptr, 0, node_type::EOL });
+            return make_node({ nullptr, nullptr, nullptr, 0, node_type::EOL });
         }   //  switch - case 文の終わり
 
         //  <C> / <S>
@@ -459,7 +2236,18 @@ private:
         return S();
     }
     //---------------------------------------------------------------------
+    //  量指定子の回数を読む(COUNT_MAXを超えればCOUNT_MAX + 1にする)
+    //---------------------------------------------------------------------
+    static int count(const wchar_t* r)
+    {
+        int n = 0;
+        for (; iswdigit(*r) && n <= COUNT_MAX; ++r)
+            n = n * 10 + (*r - L'0');
+        return std::min(n, COUNT_MAX + 1);
+    }
+    //---------------------------------------------------------------------
     //  <T> ::= <F> / <T><F> / <F>'*'  / <F>'+' / <F>'?' / <F>"{n[,m]}"
+    //  (量指定子の直後の'?'は最短一致、'+'は強欲)
     //---------------------------------------------------------------------
     nfa_node* T(nfa_node* base)
     {
@@ -467,11 +2255,13 @@ private:
             return base;
 
         //  <F>
+        int before = this->group_cnt_;
         auto f = F();
         if (f == nullptr)
             return base;
 
         bool is_lazy = false;
+        bool is_quantified = true;
         switch (*work_++) {
             //  <F>'*' / <F>'+' / <F>'?'
         case L'*':  f = star(f, (is_lazy = *work_ == L'?'));        break;
@@ -483,19 +2273,20 @@ private:
             int n = -1, m = -1;
             const wchar_t* r = work_;
             if (iswdigit(*r)) {
-                n = _wtoi(r);
+                n = count(r);
                 while (iswdigit(*r))
                     ++r;
                 if (*r == L'}') {
                     m = 0;  //  <F>{n}
                 } else if (*r == L',' && *(r + 1) == L'}') {
                     m = -1; //  <F>{n,}
-                } else if (*r != L',' || ((m = _wtoi(r + 1)) < n)) {
+                } else if (*r != L',' || ((m = count(r + 1)) < n)) {
                     n = m = -1;
                 }
+                if (n > COUNT_MAX || m > COUNT_MAX)
+                    n = m = -1;     //  回数が大きすぎる
             }
             if (n == -1) {
-                clear(f);
                 return base;
             }
             while (*work_++ != L'}');
@@ -504,9 +2295,19 @@ private:
         }
         default:
             --work_;
+            is_quantified = false;
         }
-        if (is_lazy)
+        if (is_lazy) {
             ++work_;    //  '?'分
+        } else if (is_quantified && *work_ == L'+') {
+            ++work_;    //  '+'分。強欲な量指定子
+            if (f->type == node_type::RUN) {
+                f->flag |= nfa_node::EXACT | nfa_node::ICASE;   //  一文字の繰り返しはフラグだけで済む
+                atomic_ = true;
+            } else {
+                f = atomic(f, this->group_cnt_ != before);
+            }
+        }
         //  <T><F>
         return T(cat(base, f));
     }
@@ -518,12 +2319,12 @@ private:
         auto e = T(base);                   //  <E> ::= <T>
         while (*work_ == L'|') {
             ++work_;
-            auto t = T(new nfa_node());     //  <T>
+            auto t = T(make_node());        //  <T>
             e = select1(e, t);              //  <E> ::= <E>'|'<T>
         }
 
         if (e)
-            return cat(e, new nfa_node());  //  終端を追加する
+            return cat(e, make_node());     //  終端を追加する
         return nullptr;
     }
 
@@ -548,14 +2349,251 @@ private:
     }
 
 private:
+    std::pmr::monotonic_buffer_resource arena_;     //  ノードとビット表の領域(regex_compiledと共に一度に解放する)
+    std::pmr::memory_resource* scratch_ = nullptr; //  一時的な表の確保元(コンパイル中は作業用のプール)
     std::wstring   pattern_;                //  正規表現文字列のコピーを保持する(ポインタを使用するためクラス生存期間中は必要)
     const wchar_t* work_      = nullptr;    //  構文解析時に「パターン文字列(pattern_)」を参照する為に使用する
     nfa_node*      re_        = nullptr;    //  リンクリストの先頭ノード
+    size_t         node_cnt_  = 0;          //  arena_に作ったノードの数
     int            group_cnt_ = 0;          //  グループの数。regex_pttクラスでデータを格納する変数のサイズ計算に必要
+    int            loop_cnt_  = 0;          //  監視が必要なループの数。同上
+    int            run_cnt_   = 0;          //  一文字の繰り返しの数。同上
+    intptr_t       min_len_   = 0;          //  マッチ長の下限。同上
+    intptr_t       max_len_   = -1;         //  マッチ長の上限。同上
+    bool           anchored_  = false;      //  行頭から始まるパターンか。同上
+    bool           end_anchored_ = false;   //  行末で終わるパターンか。同上
+    bool           has_backref_  = false;   //  後方参照を含むか。同上
+    bool           long_run_  = false;      //  回数がRUN_MAXを超える一文字の繰り返しを含むか。同上
+    std::vector<int> refs_;                 //  後方参照されるグループの番号。同上
+    bool           atomic_    = false;      //  アトミックグループか強欲な量指定子を含むか。同上
+    nfa_graph      graph_;                  //  序数を振ったノードと遷移
+    std::pmr::deque<nfa_node::char_set> sets_{ &arena_ };  //  ノードのビット表(nfa_node::setが指す)
+    first_set      first_;                  //  一致の先頭になり得る文字
+    bool           has_first_ = false;      //  first_を求められたか
+    std::wstring   literal_;                //  一致が必ず含む文字列
     std::wstring   what_;                   //  エラーメッセージ
 
 };
 
+/**************************************************************************
+ *                                                                        *
+ *  複数の正規表現をまとめて管理するクラス                                *
+ *                                                                        *
+ **************************************************************************/
+//  パターン毎の状態集合を一つのグラフに結合しておき、regex_ptt::test/matchの
+//  regex_set版が、テキストを一度だけ読んで全てのパターンを調べる。
+//  また、各パターンが必ず含む文字列(regex_compiled::literal)をまとめて
+//  Aho-Corasick法で探す前処理を持ち、その文字列がテキストに無いパターンは照合しない
+//---------------------------------------------------------------------
+class regex_set
+{
+    friend class regex_ptt;
+
+public:
+    //---------------------------------------------------------------------
+    //  コンストラクタ
+    //  patterns  :  正規表現パターン文字列の並び(番号は並びの順)
+    //---------------------------------------------------------------------
+    regex_set(const std::vector<std::wstring>& patterns)
+    {
+        for (auto& p : patterns) {
+            list_.emplace_back(p.c_str());
+            if (what_.empty() && !list_.back().err_msg().empty())
+                what_ = L"pattern " + std::to_wstring(list_.size() - 1) + L": " + list_.back().err_msg();
+        }
+        if (what_.empty()) {
+            build_graph();
+            build_literals();
+        }
+    }
+
+    size_t size() const { return list_.size(); }           //  パターン数
+    const regex_compiled& operator[](const size_t i) const { return list_[i]; }    //  i番目のパターン
+    const std::wstring& err_msg() const { return what_; }   //  最初にコンパイルできなかったパターンのエラーメッセージ
+
+    //---------------------------------------------------------------------
+    //  テキストに含まれる文字列から、照合が必要なパターンに印を付ける
+    //  cand    :  パターン毎の印(必ず含む文字列がテキストにあるか、その文字列が無いパターンなら1)
+    //---------------------------------------------------------------------
+    void prefilter(const wchar_t* text, const intptr_t size, std::vector<char>& cand) const
+    {
+        cand.assign(list_.size(), 0);
+        for (auto k : always_)
+            cand[k] = 1;
+        if (trie_.size() <= 1)
+            return;
+
+        std::vector<char> hit(users_.size());
+        size_t rest = users_.size();
+        int s = 0;
+        for (intptr_t p = 0; p < size && rest; p++) {
+            if (s == 0 && root_.n > 0) {
+                //  どの文字列の先頭にもならない文字は読み飛ばす
+                p += simd::find(text + p, size - p, root_);
+                if (p >= size)
+                    break;
+            }
+            s = step(s, text[p]);
+            for (int o = trie_[s].out >= 0 ? s : trie_[s].link; o > 0; o = trie_[o].link) {
+                if (!hit[trie_[o].out]) {
+                    hit[trie_[o].out] = 1;
+                    rest--;
+                    for (auto k : users_[trie_[o].out])
+                        cand[k] = 1;
+                }
+            }
+        }
+    }
+
+private:
+    regex_set() = delete;
+    regex_set(const regex_set&) = delete;
+    regex_set& operator=(const regex_set&) = delete;
+
+    //---------------------------------------------------------------------
+    //  各パターンの状態集合用のグラフを一つに結合する
+    //---------------------------------------------------------------------
+    //  後方参照、アトミックグループ、強欲な量指定子、回数がRUN_MAXを超える一文字の繰り返しを
+    //  含むパターンは状態集合で判定できないので結合せず、パターン毎に照合する(others_)
+    //---------------------------------------------------------------------
+    void build_graph()
+    {
+        bool first = true;
+        head_.assign(list_.size(), -1);
+        for (size_t k = 0; k < list_.size(); k++) {
+            auto& re = list_[k];
+            if (!re.graph() || re.atomic()) {
+                others_.push_back(static_cast<int>(k));
+                continue;
+            }
+            const auto& g = *re.graph();
+            const int base = static_cast<int>(graph_.node.size());
+            head_[k] = base + g.head;
+            for (size_t x = 0; x < g.node.size(); x++) {
+                graph_.node.push_back(g.node[x]);
+                graph_.succ.push_back(g.succ[x]);
+                for (auto& y : graph_.succ.back())
+                    y += base;
+                owner_.push_back(static_cast<int>(k));
+            }
+
+            //  一致の先頭になり得る文字は、結合した全てのパターンの和集合にする
+            if (!re.first()) {
+                first = false;
+            } else if (first) {
+                for (const bool nocase : { false, true }) {
+                    for (int w = 0; w < 8; w++)
+                        first_.low.bits[nocase][w] |= re.first()->low.bits[nocase][w];
+                    auto& high = first_.high[nocase];
+                    high.insert(high.end(), re.first()->high[nocase].begin(), re.first()->high[nocase].end());
+                }
+            }
+        }
+        graph_.number_slots();
+        has_first_ = first && !graph_.node.empty();
+        if (has_first_)
+            first_.finish();
+    }
+
+    //---------------------------------------------------------------------
+    //  必ず含む文字列のAho-Corasick法のオートマトンを作る
+    //---------------------------------------------------------------------
+    void build_literals()
+    {
+        std::unordered_map<std::wstring, int> id;   //  同じ文字列は一つにまとめる
+        trie_.resize(1);
+        for (size_t k = 0; k < list_.size(); k++) {
+            const auto& lit = list_[k].literal();
+            if (lit.empty()) {
+                always_.push_back(static_cast<int>(k));
+                continue;
+            }
+            auto it = id.find(lit);
+            if (it == id.end()) {
+                it = id.emplace(lit, static_cast<int>(users_.size())).first;
+                users_.emplace_back();
+                int s = 0;
+                for (auto c : lit) {
+                    int t = child(s, c);
+                    if (t < 0) {
+                        t = static_cast<int>(trie_.size());
+                        auto& next = trie_[s].next;
+                        next.insert(std::lower_bound(next.begin(), next.end(), std::make_pair(c, 0)), { c, t });
+                        trie_.emplace_back();
+                    }
+                    s = t;
+                }
+                trie_[s].out = it->second;
+            }
+            users_[it->second].push_back(static_cast<int>(k));
+        }
+
+        //  失敗遷移と、出力を持つ最も近い失敗遷移先(幅優先で求める)
+        std::queue<int> work;
+        root_.n = 0;
+        for (auto& e : trie_[0].next) {
+            work.push(e.second);
+            simd::add(root_, e.first);
+        }
+        while (!work.empty()) {
+            const int s = work.front();
+            work.pop();
+            for (auto& e : trie_[s].next) {
+                int f = trie_[s].fail;
+                while (f && child(f, e.first) < 0)
+                    f = trie_[f].fail;
+                const int t = child(f, e.first);
+                trie_[e.second].fail = (t >= 0 && t != e.second) ? t : 0;
+                const int fs = trie_[e.second].fail;
+                trie_[e.second].link = trie_[fs].out >= 0 ? fs : trie_[fs].link;
+                work.push(e.second);
+            }
+        }
+    }
+
+    int child(const int s, const wchar_t c) const
+    {
+        auto& next = trie_[s].next;
+        auto it = std::lower_bound(next.begin(), next.end(), std::make_pair(c, 0));
+        return (it != next.end() && it->first == c) ? it->second : -1;
+    }
+
+    int step(int s, const wchar_t c) const
+    {
+        for (;;) {
+            const int t = child(s, c);
+            if (t >= 0)
+                return t;
+            if (s == 0)
+                return 0;
+            s = trie_[s].fail;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  メンバ変数
+    //---------------------------------------------------------------------
+    struct trie_node {
+        std::vector<std::pair<wchar_t, int>> next;  //  遷移(文字の昇順)
+        int fail = 0;                               //  失敗遷移先
+        int out  = -1;                              //  ここで終わる文字列の番号
+        int link = 0;                               //  出力を持つ最も近い失敗遷移先(無ければ0)
+    };
+
+    std::deque<regex_compiled>  list_;      //  コンパイルされたパターン
+    regex_compiled::nfa_graph   graph_;     //  結合したグラフ(predは作らない)
+    std::vector<int>            head_;      //  パターン毎の先頭ノードの序数(結合していなければ-1)
+    std::vector<int>            owner_;     //  ノード毎のパターン番号
+    std::vector<int>            others_;    //  結合できず、パターン毎に照合するパターン
+    regex_compiled::first_set   first_;     //  結合したパターンの一致の先頭になり得る文字
+    bool                        has_first_ = false;
+    std::vector<trie_node>      trie_;      //  必ず含む文字列のオートマトン
+    std::vector<std::vector<int>> users_;   //  文字列毎の、その文字列を必ず含むパターン
+    std::vector<int>            always_;    //  必ず含む文字列が無いパターン
+    simd::ranges                root_;      //  いずれかの文字列の先頭になる文字
+    std::wstring                what_;      //  エラーメッセージ
+};
+
 /**************************************************************************
  *                                                                        *
  *  正規表現パターンマッチ結果を管理するクラス                            *
@@ -564,36 +2602,76 @@ private:
 class regex_result
 {
 public:
+    static constexpr size_t INLINE = 8;     //  オブジェクトの中に持つキャプチャの数(これを超えるとヒープに置く)
+
+    //  エラーの種類
+    enum struct errc : int {
+        NONE = 0,
+        PATTERN,            //  パターンがコンパイルできていない(regex_set)
+        BUFFER_OVERRUN,     //  探索開始位置がテキストの外
+        BACKTRACK_LIMIT,    //  バックトラックの回数か深さが制限を超えた
+    };
+
     regex_result() {}
-    explicit operator bool() const { return match_.size() != 0; }
+    explicit operator bool() const { return size_ != 0; }
+    void set(const std::pair<intptr_t, size_t>* v, const size_t n) {
+        match_.clear();
+        if (n > INLINE)
+            match_.resize(n);
+        size_ = n;
+        auto dst = data();
+        for (size_t i = 0; i < n; i++)
+            dst[i] = v[i].first >= 0 ? v[i] : std::pair<intptr_t, size_t>(0, 0);
+    }
     void set(const std::vector<std::pair<intptr_t, size_t>>& v) {
-        match_.resize(v.size(), std::pair<intptr_t, size_t>(0, 0));
-        for (size_t i = 0; i < v.size(); i++)
-            if (v[i].first >= 0 && v[i].second >= 0)
-                match_[i] = v[i];
+        set(v.data(), v.size());
+    }
+    void set(const errc code) {
+        code_ = code;
+    }
+    void set_partial(const intptr_t pos) {
+        partial_ = pos;
     }
-    void set(const std::wstring& err) {
-        what_ = err;
+    size_t size() const { return size_; }
+    intptr_t position(size_t i) const { return data()[i].first; }
+    size_t length(size_t i) const { return data()[i].second; }
+    bool is_error() const { return code_ != errc::NONE; }
+    errc code() const { return code_; }                         //  エラーの種類
+    const std::wstring& err() const { return message(code_); }
+    bool is_partial() const { return partial_ >= 0; }           //  テキストの末尾で途切れた一致がある(regex_ptt::PARTIAL)
+    intptr_t partial_position() const { return partial_; }      //  途切れた一致の開始位置
+
+    //---------------------------------------------------------------------
+    //  エラーの種類のメッセージ
+    //---------------------------------------------------------------------
+    static const std::wstring& message(const errc code) {
+        static const std::wstring msg[] = {
+            L"", L"pattern is not compiled.", L"buffer overrun detected.", L"backtrack limit error.",
+        };
+        return msg[static_cast<int>(code)];
     }
-    size_t size() const { return match_.size(); }
-    intptr_t position(size_t i) const { return match_[i].first; }
-    size_t length(size_t i) const { return match_[i].second; }
-    bool is_error() const { return what_.length() != 0; }
-    const std::wstring& err() const { return what_; }
 
     //
     //  「範囲for」用
     //
-    using iterator       = std::vector<std::pair<intptr_t, size_t>>::iterator;
-    using const_iterator = std::vector<std::pair<intptr_t, size_t>>::const_iterator;
-    iterator begin() { return match_.begin(); }
-    const_iterator cbegin() const { return match_.begin(); }
-    iterator end() { return match_.end(); }
-    const_iterator cend() const { return match_.cend(); }
+    using iterator       = std::pair<intptr_t, size_t>*;
+    using const_iterator = const std::pair<intptr_t, size_t>*;
+    iterator begin() { return data(); }
+    const_iterator begin() const { return data(); }
+    const_iterator cbegin() const { return data(); }
+    iterator end() { return data() + size_; }
+    const_iterator end() const { return data() + size_; }
+    const_iterator cend() const { return data() + size_; }
 
 private:
-    std::vector<std::pair<intptr_t, size_t>> match_;
-    std::wstring                             what_;
+    std::pair<intptr_t, size_t>* data() { return size_ > INLINE ? match_.data() : inline_; }
+    const std::pair<intptr_t, size_t>* data() const { return size_ > INLINE ? match_.data() : inline_; }
+
+    std::pair<intptr_t, size_t>              inline_[INLINE];   //  INLINE個以下のキャプチャ
+    std::vector<std::pair<intptr_t, size_t>> match_;            //  INLINE個を超えるキャプチャ
+    size_t                                   size_ = 0;         //  キャプチャの数(一致しなければ0)
+    errc                                     code_ = errc::NONE;
+    intptr_t                                 partial_ = -1;
 };
 
 /**************************************************************************
@@ -603,11 +2681,18 @@ private:
  **************************************************************************/
 class regex_ptt
 {
+    friend class regex_pool;        //  区間毎の検索(match_until)を使う
+    friend class regex_stream;      //  一致が確定する位置(settled)とキャプチャを使う
+    friend class regex_incremental; //  状態集合の途中経過(forward_scan)とキャプチャを使う
+    friend class regex_job;         //  探索(search、forward_scan)を途中で止めて再開する
+
 public:
     static constexpr unsigned int SEARCH = 0x01;        //  検索オプション値 - 部分一致
     static constexpr unsigned int SINGLE = 0x02;        //  検索オプション値 - 「^」が改行の次にマッチしない
-    static constexpr unsigned int NOCASE = 0x04;        //  検索オプション値 - 大文字小文字の区別をしない(アルファベットのみ)
+    static constexpr unsigned int NOCASE = 0x04;        //  検索オプション値 - 大文字小文字の区別をしない(Unicodeの単純な大文字小文字の対応)
     static constexpr unsigned int NORMAL = 0x08;        //  検索オプション値 - 従来型NFAエンジンモード
+    static constexpr unsigned int NOCAPTURE = 0x10;     //  検索オプション値 - キャプチャを記録しない(全体の一致位置だけを返す)
+    static constexpr unsigned int PARTIAL = 0x20;       //  検索オプション値 - 一致しなければ、テキストの末尾で途切れた一致を調べる(resumeで続きを照合できる)
 #ifdef _DEBUG
     static constexpr int64_t      MAX_LIMIT = 100000LL; //  関数呼び出し回数の制限値(長考対策)
     static constexpr long         MAX_DEPTH = 3000L;    //  再帰呼び出し深度の制限値(スタックオーバーフロー対策)
@@ -615,6 +2700,20 @@ public:
     static constexpr int64_t      MAX_LIMIT = 100000000LL;  //  関数呼び出し回数の制限値(長考対策)
     static constexpr long         MAX_DEPTH = 10000L;       //  再帰呼び出し深度の制限値(スタックオーバーフロー対策)
 #endif
+    static constexpr size_t       MAX_STATES = 1024;    //  置換表を初期化するキャプチャの状態数(後方参照を含むパターンの置換表容量爆発対策)
+                                                        //  一つの開始位置の照合の中では、これを超えた状態は置換表に登録しない
+
+    //---------------------------------------------------------------------
+    //  コンストラクタ
+    //  resource  :  置換表などの作業領域の確保元(nullptrならstd::pmr::get_default_resource())
+    //---------------------------------------------------------------------
+    //  置換表の要素は照合毎に空にしても解放せず、オブジェクト毎のプール(pool_)に戻して
+    //  使い回す。プールは排他制御をしないので、スレッド毎にregex_pttを用意すること
+    //---------------------------------------------------------------------
+    explicit regex_ptt(std::pmr::memory_resource* resource = nullptr)
+        : pool_(resource ? resource : std::pmr::get_default_resource())
+    {
+    }
 
     //---------------------------------------------------------------------
     //  コンパイルされた正規表現を受け取り、テキスト内の検索を行う
@@ -623,381 +2722,3336 @@ public:
     //  re      :  コンパイルされた正規表現オブジェクト
     //  option  :  探索オプション
     //  seek    :  textの検索開始オフセット値
+    //  size    :  textの文字数(text[size]はL'\0'であること)。負の値ならwcslenで求める
     //  戻り値  :  結果を管理するクラスオブジェクト(regex_result)を返す
     //---------------------------------------------------------------------
-    regex_result match(const wchar_t* text, const regex_compiled& re, const int options = 0, const intptr_t seek = 0)
+    //  同じテキストを位置(seek)を変えながら繰り返し探索する場合は、sizeを指定すれば
+    //  呼び出しのたびにテキスト全体の長さを数え直さずに済む
+    //---------------------------------------------------------------------
+    regex_result match(const wchar_t* text, const regex_compiled& re, const int options = 0, const intptr_t seek = 0, const intptr_t size = -1)
+    {
+        if (re.get() == nullptr)
+            return regex_result();
+        auto ret = locate(text, re, options, seek, size);
+        auto result = make_result(text, ret);
+        if (options & regex_ptt::PARTIAL)
+            suspend(result, re, options, seek);
+        return result;
+    }
+
+    //---------------------------------------------------------------------
+    //  コンパイルされた正規表現を受け取り、テキスト内の検索を行う(結果を呼び出し側の領域に書く)
+    //---------------------------------------------------------------------
+    //  text, re, option, seek, size  :  match関数と同じ(regex_ptt::PARTIALは無視する)
+    //  captures:  キャプチャの書き込み先(count要素)。i番目に{位置, 長さ}を書く。
+    //             一致しなかったグループと、パターンのグループより後の要素は{0, 0}にする
+    //  count   :  capturesの要素数(re.capture()より少なければ、その分だけ書く)
+    //  戻り値  :  一致すればtrue。一致しないかエラーならfalse(エラーはcode関数で確認できる)
+    //---------------------------------------------------------------------
+    //  結果オブジェクトを作らないので、作業領域が大きくなりきった後はメモリを確保しない
+    //---------------------------------------------------------------------
+    bool match(const wchar_t* text, const regex_compiled& re, const int options, const intptr_t seek, const intptr_t size, std::pair<intptr_t, size_t>* captures, const size_t count)
+    {
+        if (re.get() == nullptr)
+            return false;
+        auto ret = locate(text, re, options & ~regex_ptt::PARTIAL, seek, size);
+        if (ret == nullptr || !what_.empty())
+            return false;
+        capture_[0] = { text - input_head_, ret - text };
+        for (size_t i = 0; i < count; i++)
+            captures[i] = (i < capture_.size() && capture_[i].first >= 0) ? capture_[i] : std::pair<intptr_t, size_t>(0, 0);
+        return true;
+    }
+
+    //---------------------------------------------------------------------
+    //  regex_ptt::PARTIAL指示で一致しなかった最後の照合を、続きを加えたテキストで再開する
+    //---------------------------------------------------------------------
+    //  text    :  前の照合のテキストの後に続きを加えた文字列(前の部分は変えないこと)
+    //  size    :  textの文字数(text[size]はL'\0'であること)。負の値ならwcslenで求める
+    //  戻り値  :  前の照合と同じパターン、オプション、探索開始位置でmatchを呼んだ場合と同じ結果。
+    //             再開できる照合が無ければ空の結果
+    //---------------------------------------------------------------------
+    //  前の照合でテキストの末尾に届いていた状態集合を引き継ぎ、続きの部分だけを読み進める。
+    //  一致すれば、状態集合で求めた開始位置からmatchで照合し直してキャプチャを求める。
+    //  アトミックグループを含むパターンは状態集合の一致が実際の一致とは限らないので、
+    //  探索開始位置から照合し直す。
+    //  状態集合で探索できないパターン(後方参照を含むものなど)は、最初から照合し直す
+    //---------------------------------------------------------------------
+    regex_result resume(const wchar_t* text, const intptr_t size = -1)
     {
+        if (resume_.re == nullptr)
+            return regex_result();
+        const regex_compiled& re = *resume_.re;
+        const int options = resume_.options;
+        if (resume_.end.from < 0)
+            return match(text, re, options, resume_.seek, size);
+        const intptr_t len = setup(text, re, options, resume_.end.from, size);
+        if (len < 0) {
+            resume_.re = nullptr;
+            return make_result(text, nullptr);
+        }
+        forward_scan(*re.graph(), len, resume_.seek, len - 1, options, false, &resume_.end);
+        if (resume_.end.found >= 0)
+            return match(text, re, options, re.atomic() ? resume_.seek : resume_.end.found, len);
         regex_result result;
-        const nfa_node* nfa = re.get();
-        if (nfa == nullptr)
-            return result;
+        resume_.end.from = len;
+        set_partial(result, len, options);
+        return result;
+    }
 
-        what_.clear();                  //  エラー出力メッセージの初期化
-        input_head_ = text;             //  検索対象テキストの先頭位置を保存しておく
-        if (wcslen(text) < (size_t)seek) {
-            runtimeerror(L"buffer overrun detected.");
-            return result;
+    //---------------------------------------------------------------------
+    //  複数の文字列(レコード)を同じパターンでまとめて照合する
+    //---------------------------------------------------------------------
+    //  records    :  文字列の並び(L'\0'で終わっていなくてよい)
+    //  count      :  文字列の数
+    //  re, option :  test関数と同じ
+    //  selection  :  一致した文字列のビットを立てる表((count + 63) / 64要素)。
+    //                i番目の文字列はselection[i / 64]の下位からi % 64番目のビット
+    //  戻り値     :  一致した文字列の数。エラーになればそこで止める(error関数で確認できる)
+    //---------------------------------------------------------------------
+    //  作業領域(キャプチャ、置換表など)は文字列毎に作り直さずに使い回し、結果オブジェクトも
+    //  作らない。文字列は作業用のバッファへL'\0'を付けて写してから照合する
+    //---------------------------------------------------------------------
+    size_t test(const std::wstring_view* records, const size_t count, const regex_compiled& re, const int options, uint64_t* selection)
+    {
+        size_t hits = 0;
+        for (size_t i = 0; i < count; i += 64) {
+            uint64_t bits = 0;
+            for (size_t j = i; j < count && j < i + 64 && what_.empty(); j++) {
+                record_.assign(records[j].data(), records[j].size());
+                if (test(record_.c_str(), re, options, 0, record_.size())) {
+                    bits |= uint64_t(1) << (j - i);
+                    hits++;
+                }
+            }
+            selection[i / 64] = bits;   //  一語ずつ書くので、別のスレッドが隣の語を書いても構わない
+        }
+        return hits;
+    }
+
+    //---------------------------------------------------------------------
+    //  複数の文字列(レコード)を同じパターンでまとめて照合し、一致した範囲を返す
+    //---------------------------------------------------------------------
+    //  records, count, re, option  :  test関数(複数の文字列版)と同じ
+    //  offsets    :  文字列毎の一致した位置と長さ(count要素)。一致しなければ位置は-1
+    //  戻り値     :  一致した文字列の数。エラーになればそこで止める(error関数で確認できる)
+    //---------------------------------------------------------------------
+    //  キャプチャは記録しない(全体の一致範囲だけを求める)
+    //---------------------------------------------------------------------
+    size_t match(const std::wstring_view* records, const size_t count, const regex_compiled& re, const int options, std::pair<intptr_t, size_t>* offsets)
+    {
+        size_t hits = 0;
+        for (size_t j = 0; j < count; j++) {
+            offsets[j] = { -1, 0 };
+            if (!what_.empty() || re.get() == nullptr)
+                continue;
+            record_.assign(records[j].data(), records[j].size());
+            const wchar_t* text = record_.c_str();
+            if (auto ret = locate(text, re, options | regex_ptt::NOCAPTURE, 0, record_.size())) {
+                offsets[j] = { text - record_.c_str(), static_cast<size_t>(ret - text) };
+                hits++;
+            }
         }
+        return hits;
+    }
+
+    //---------------------------------------------------------------------
+    //  一致する範囲を求める(match関数の本体。結果オブジェクトは作らない)
+    //  text    :  検索対象の文字列。一致した場合はその開始位置を返す
+    //  bound   :  regex_ptt::SEARCH指示で、一致の開始位置の上限
+    //  戻り値  :  一致した末尾。一致しないかエラーならnullptr
+    //---------------------------------------------------------------------
+    const wchar_t* locate(const wchar_t*& text, const regex_compiled& re, const int options, const intptr_t seek, const intptr_t size, const intptr_t bound = PTRDIFF_MAX)
+    {
+        const nfa_node* nfa = re.get();
+
+        //  regex_ptt::SEARCH指示でキャプチャが必要な場合は二段階で探索する
+        //  まずキャプチャを記録せずに一致する範囲を求め、その範囲だけをキャプチャ付きで照合し直す。
+        //  一致しなかった開始位置でのキャプチャの書き込みとロールバックを省ける
+        //  (後方参照を含むパターンは、キャプチャによって一致が変わるので対象外)
+        //  状態集合で探索できるパターンは、一段階目で開始位置だけを求める
+        const bool scan = (options & regex_ptt::SEARCH) && re.graph() && !re.atomic() &&
+                          !re.anchored() && !re.end_anchored();
+        const bool two_phase = !scan && (options & regex_ptt::SEARCH) && !(options & regex_ptt::NOCAPTURE) &&
+                               re.capture() > 1 && !re.has_backref();
+        const intptr_t len = setup(text, re, two_phase ? options | regex_ptt::NOCAPTURE : options, seek, size);
+        if (len < 0)
+            return nullptr;
         text += seek;
 
-        //  キャプチャの初期化
-        capture_.clear();
-        capture_.resize(re.capture(), std::pair<intptr_t, intptr_t>(-1, -1));
+        //  マッチ長の範囲で判定できる不一致
+        //  regex_ptt::SEARCH指示では、残りが下限より短くなる位置(last)より後は探索しない
+        const intptr_t last = std::min(len - re.min_length(), bound);
+        if (seek > last)
+            return nullptr;
+        if (!(options & regex_ptt::SEARCH) && re.max_length() >= 0 && len - seek > re.max_length())
+            return nullptr;             //  完全一致には長すぎる
 
-        //  置換表のセットアップ
-        if (options & regex_ptt::NORMAL) {
-            table_ = nullptr;       //  nullptrを設定すれば、置換表を使わない従来型NFAエンジンになる
-        } else {
-            table_ = &hash_table_;  //  置換表を設定
+        if (scan) {
+            //  最も前の開始位置を状態集合で求めて、その位置だけをバックトラックで照合する
+            const intptr_t pos = forward_scan(*re.graph(), len, seek, last, options, true);
+            if (pos < 0)
+                return nullptr;
+            text = input_head_ + pos;
+            this->limit_ = regex_ptt::MAX_LIMIT;
+            return reg_find(nfa, text, regex_ptt::MAX_DEPTH, options);
         }
-        table_clear();              //  置換表を初期化する
+        auto ret = search(re, text, len, last, options);
+        if (two_phase && ret && what_.empty()) {
+            //  二段階目。一段階目と同じ開始位置から、同じ末尾で終わる経路だけを探す
+            //  (キャプチャは経路の選択に影響しないので、同じ経路が見つかる)
+            nocapture_ = false;
+            capture_.assign(re.capture(), std::pair<intptr_t, intptr_t>(-1, -1));
+            table_clear();              //  一段階目で一致した経路も置換表に登録されている
+            match_end_ = ret;
+            this->limit_ = regex_ptt::MAX_LIMIT;
+            ret = reg_find(nfa, text, regex_ptt::MAX_DEPTH, options);
+            match_end_ = nullptr;
+        }
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  一致する位置を探す
+    //  text    :  探索開始位置。一致した場合はその開始位置を返す
+    //  budget  :  指定すると、開始位置毎の照合に使った手数(reg_findの呼び出し回数)を差し引き、
+    //             使い切ったら次の開始位置をtextに設定して止める(pending_にtrueを設定する)
+    //  戻り値  :  一致した末尾。一致しなければnullptr
+    //---------------------------------------------------------------------
+    const wchar_t* search(const regex_compiled& re, const wchar_t*& text, const intptr_t size, const intptr_t last, const int options, int64_t* budget = nullptr)
+    {
+        const nfa_node* nfa = re.get();
 
         //  パターンマッチを開始する
         //  regex_ptt::SEARCH指示の場合は、検索対象テキストの位置を動かしながらパターンマッチ処理を行う
         const wchar_t* ret = nullptr;
+        pending_ = false;
+        if ((options & regex_ptt::SEARCH) && re.end_anchored() && re.graph() && !budget) {
+            //  テキスト末尾にしか一致しないパターンは、後方から開始位置の候補を求めて、前から順に照合する
+            std::vector<intptr_t> starts;
+            reverse_scan(*re.graph(), size, text - input_head_, options, [&starts](intptr_t pos) {
+                starts.push_back(pos);
+                return false;
+            });
+            for (auto it = starts.rbegin(); it != starts.rend() && *it <= last && !ret && what_.empty(); ++it) {
+                text = input_head_ + *it;
+                this->limit_ = regex_ptt::MAX_LIMIT;
+                ret = reg_find(nfa, text, regex_ptt::MAX_DEPTH, options);
+            }
+            return ret;
+        }
+        const bool skip = (options & regex_ptt::SEARCH) && first_ && !re.anchored();
         do {
+            if (budget && *budget <= 0) {
+                pending_ = true;
+                break;
+            }
+            if (skip) {
+                //  一致の先頭になり得ない位置は読み飛ばす
+                text = input_head_ + next_start(text - input_head_, last, options);
+                if (text - input_head_ > last)
+                    break;
+            }
             this->limit_ = regex_ptt::MAX_LIMIT;
             ret = reg_find(nfa, text, regex_ptt::MAX_DEPTH, options);
+            if (budget)
+                *budget -= regex_ptt::MAX_LIMIT - limit_;
             if (ret || *text == L'\0' || !what_.empty())
                 break;              //  マッチ or テキスト末尾 or error
+            if (re.anchored()) {
+                //  行頭から始まるパターンは、次の行頭(改行の直後)にしか一致しない
+                //  regex_ptt::SINGLE指示では行頭はテキストの先頭だけなので、これ以上探さない
+                if (options & regex_ptt::SINGLE)
+                    break;
+                const intptr_t rest = size - (text - input_head_);
+                const intptr_t nl = simd::find(text, rest, simd::single(L'\n'));
+                if (nl == rest)
+                    break;
+                text += nl;
+                table_clear();      //  置換表容量爆発対策
+                ++text;
+                continue;
+            }
             ++text;
-            if (*text == L'\n') {
+            if ((text < input_end_ && *text == L'\n') || states_.size() >= MAX_STATES) {
                 table_clear();      //  置換表容量爆発対策
             }
-        } while (options & regex_ptt::SEARCH);
+        } while ((options & regex_ptt::SEARCH) && text - input_head_ <= last);
 
-        if (what_.empty() == false) {
-            //  エラーメッセージを設定する
-            result.set(what_);
-        } else if (ret) {
-            //  キャプチャ変数の0番目にマッチした全体を登録する
-            capture_[0].first = (text - input_head_);       //  マッチ位置
-            capture_[0].second = (ret - input_head_);       //  マッチ末尾
-            capture_[0].second -= capture_[0].first;        //  文字列長
-            result.set(capture_);
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  一致するかどうかだけを調べる
+    //---------------------------------------------------------------------
+    //  text    :  検索対象の文字列
+    //  re      :  コンパイルされた正規表現オブジェクト
+    //  option  :  探索オプション
+    //  seek    :  textの検索開始オフセット値
+    //  size    :  textの文字数(text[size]はL'\0'であること)。負の値ならwcslenで求める
+    //  戻り値  :  一致すればtrue。一致しないかエラーならfalse(エラーはerror関数で確認できる)
+    //---------------------------------------------------------------------
+    //  キャプチャを記録せず、結果オブジェクトも作らない。状態集合で探索できて(graph関数)、
+    //  アトミックグループ、強欲な量指定子を含まないパターンは、バックトラックせずにNFAの
+    //  状態集合を前方へ進めて判定する(テキスト長×ノード数に比例する時間で終わる)
+    //---------------------------------------------------------------------
+    bool test(const wchar_t* text, const regex_compiled& re, const int options = 0, const intptr_t seek = 0, const intptr_t size = -1)
+    {
+        if (re.get() == nullptr)
+            return false;
+        if (re.graph() && !re.atomic()) {
+            const intptr_t len = setup(text, re, options | regex_ptt::NOCAPTURE, seek, size);
+            if (len < 0 || seek > len - re.min_length())
+                return false;
+            if (!(options & regex_ptt::SEARCH) && re.max_length() >= 0 && len - seek > re.max_length())
+                return false;
+            return forward_scan(*re.graph(), len, seek, len - re.min_length(), options) >= 0;
         }
-        return result;
+        return static_cast<bool>(match(text, re, options | regex_ptt::NOCAPTURE, seek, size));
     }
 
     //---------------------------------------------------------------------
-    //  エラーメッセージを返す
+    //  Latin-1(一バイトが一文字)のテキストが一致するかどうかだけを調べる
     //---------------------------------------------------------------------
-    const std::wstring& error() const
+    //  text    :  検索対象の文字列(各バイトをU+0000～U+00FFの文字とみなす)
+    //  size    :  textのバイト数。負の値ならstrlenで求める(指定すればtext[size]は'\0'でなくてよい)
+    //  re, options, seek、戻り値はwchar_t版のtestと同じ
+    //---------------------------------------------------------------------
+    //  状態集合で探索できるパターンは、テキストを広げずに一バイトずつ読んで判定する。
+    //  Latin-1の文字は全て、コンパイル時に作ったノードのビット表で一致を引ける
+    //  (wchar_tのテキストの四分の一(Windowsでは半分)の大きさを読めば済む)。
+    //  それ以外のパターンは、作業領域にwchar_tのテキストを作ってから照合する
+    //---------------------------------------------------------------------
+    bool test(const char* text, const regex_compiled& re, const int options = 0, const intptr_t seek = 0, intptr_t size = -1)
     {
-        return what_;
+        if (re.get() == nullptr)
+            return false;
+        if (size < 0)
+            size = static_cast<intptr_t>(std::strlen(text));
+        if (seek < 0 || size < seek || !narrow(re))
+            return test(widen(text, 0, size), re, options, seek, size);
+        what_.clear();
+        code_ = regex_result::errc::NONE;
+        if (seek > size - re.min_length())
+            return false;
+        if (!(options & regex_ptt::SEARCH) && re.max_length() >= 0 && size - seek > re.max_length())
+            return false;
+        auto in = reinterpret_cast<const unsigned char*>(text);
+        first_ = re.first();
+        return forward_scan(in, *re.graph(), size, seek, size - re.min_length(), options, false, nullptr) >= 0;
     }
 
-private:
     //---------------------------------------------------------------------
-    //  std::unordered_setの第三パラメータに必要なハッシュ関数オブジェクト
+    //  Latin-1(一バイトが一文字)のテキストの検索を行う
     //---------------------------------------------------------------------
-    struct hash {
-        std::size_t operator()(const std::pair<const nfa_node*, const wchar_t*>& key) const {
-            return static_cast<size_t>(rand(reinterpret_cast<intptr_t>(key.first), reinterpret_cast<intptr_t>(key.second)));
+    //  text, size  :  Latin-1版のtestと同じ
+    //  re, options, seek  :  wchar_t版のmatchと同じ(regex_ptt::PARTIALは無視する)
+    //  戻り値  :  結果を管理するクラスオブジェクト。位置と長さはtextのバイト単位
+    //---------------------------------------------------------------------
+    //  状態集合で探索できるパターンは、まず一致の開始位置をLatin-1のまま求め、一致した場合だけ
+    //  その位置(単語境界と行頭の判定用に一文字前を含める)から後を広げてキャプチャを求める。
+    //  一致しないテキストは広げずに済む
+    //---------------------------------------------------------------------
+    regex_result match(const char* text, const regex_compiled& re, int options = 0, const intptr_t seek = 0, intptr_t size = -1)
+    {
+        if (re.get() == nullptr)
+            return regex_result();
+        options &= ~regex_ptt::PARTIAL;
+        if (size < 0)
+            size = static_cast<intptr_t>(std::strlen(text));
+        intptr_t from = 0;              //  広げる範囲の先頭
+        if (seek >= 0 && seek <= size && narrow(re)) {
+            what_.clear();
+            code_ = regex_result::errc::NONE;
+            if (seek > size - re.min_length())
+                return regex_result();
+            if (!(options & regex_ptt::SEARCH) && re.max_length() >= 0 && size - seek > re.max_length())
+                return regex_result();
+            auto in = reinterpret_cast<const unsigned char*>(text);
+            first_ = re.first();
+            const intptr_t pos = forward_scan(in, *re.graph(), size, seek, size - re.min_length(), options, true, nullptr);
+            if (pos < 0)
+                return regex_result();
+            from = pos > 0 ? pos - 1 : 0;
         }
-        //  xorshift疑似乱数生成アルゴリズム
-        uint32_t rand(intptr_t a, intptr_t b) const {
-#if defined(_WIN64) || defined(__x86_64__)
-            uint32_t x = (uint32_t)((a >> 31) ^ a);
-            uint32_t w = (uint32_t)((b >> 31) ^ b);
-            uint32_t t = x ^ (x << 11);
-            return (w ^ (w >> 19)) ^ (t ^ (t >> 8));
-#else
-            uint32_t t = a ^ (a << 11);
-            return (b ^ (b >> 19)) ^ (t ^ (t >> 8));
-#endif
+        const intptr_t start = from ? from + 1 : seek;
+        auto result = match(widen(text, from, size), re, options, start - from, size - from);
+        if (from > 0) {
+            for (auto& m : result) {
+                if (m.first > 0)        //  一致しなかったグループは{0, 0}のまま
+                    m.first += from;
+            }
         }
-    };
+        return result;
+    }
 
     //---------------------------------------------------------------------
-    //  メンバ変数
+    //  テキストの後方から検索し、開始位置が最も後ろの一致を返す
     //---------------------------------------------------------------------
-    using Capture  = std::vector<std::pair<intptr_t, size_t>>;      //  キャプチャ
-    using hash_key = std::pair<const nfa_node*, const wchar_t*>;    //  キー
-    using Table    = std::unordered_set<hash_key, hash>;            //  置換表
+    //  text    :  検索対象の文字列
+    //  re      :  コンパイルされた正規表現オブジェクト
+    //  option  :  探索オプション(regex_ptt::SEARCHを指定しなくても部分一致で探す)
+    //  size    :  textの文字数(text[size]はL'\0'であること)。負の値ならwcslenで求める
+    //  戻り値  :  結果を管理するクラスオブジェクト(regex_result)を返す
+    //---------------------------------------------------------------------
+    //  ログの末尾から探す用途を想定している。開始位置を後ろから一つずつ戻しながら照合し、
+    //  最初に一致したところで終わる。末尾「$」で終わるパターンは逆向きの遷移で
+    //  開始位置の候補を後ろから求めるので、テキストの後方しか読まずに済む
+    //---------------------------------------------------------------------
+    regex_result find_last(const wchar_t* text, const regex_compiled& re, int options = 0, const intptr_t size = -1)
+    {
+        regex_result result;
+        const nfa_node* nfa = re.get();
+        if (nfa == nullptr)
+            return result;
 
-    const wchar_t* input_head_ = nullptr;   //  対象文字列の開始アドレス
-    long long      limit_;                  //  バックトラック回数制限用
-    std::wstring   what_;                   //  エラーメッセージ
-    Capture        capture_;                //  キャプチャ
-    Table          hash_table_;             //  置換表
-    Table*         table_ = nullptr;        //  置換表(On = &hash_table, Off = nullptr)
+        options |= regex_ptt::SEARCH;
+        const intptr_t len = setup(text, re, options, 0, size);
+        if (len < 0)
+            return result;
+
+        const wchar_t* ret = nullptr;
+        auto attempt = [&](intptr_t pos) {
+            text = input_head_ + pos;
+            this->limit_ = regex_ptt::MAX_LIMIT;
+            ret = reg_find(nfa, text, regex_ptt::MAX_DEPTH, options);
+            return ret || !what_.empty();
+        };
+        if (re.end_anchored() && re.graph()) {
+            reverse_scan(*re.graph(), len, 0, options, attempt);
+        } else {
+            intptr_t pos = len - re.min_length();
+            if (re.anchored() && (options & regex_ptt::SINGLE))
+                pos = std::min<intptr_t>(pos, 0);   //  行頭はテキストの先頭だけ
+            for (; pos >= 0; pos--) {
+                if (re.anchored() && pos && input_head_[pos - 1] != L'\n')
+                    continue;                       //  行頭から始まるパターンは、行頭でしか照合しない
+                if (attempt(pos))
+                    break;
+                if (input_head_[pos] == L'\n')
+                    table_clear();                  //  置換表容量爆発対策
+            }
+        }
+        return make_result(text, ret);
+    }
 
-private:
     //---------------------------------------------------------------------
-    //  再帰的にパターンマッチを行う
+    //  複数のパターンをまとめて照合し、一致したパターンの番号を返す
     //---------------------------------------------------------------------
-    //  node    :  NFAリンクリスト
-    //  text    :  検索対象文字列
-    //  depth   :  探索深度(スタックオーバーフロー対策)
+    //  text    :  検索対象の文字列
+    //  set     :  まとめてコンパイルされた正規表現オブジェクト
     //  option  :  探索オプション
-    //             SEARCH  -  部分一致探索指示
-    //             SINGLE  -  「^」が改行の次にはマッチしない
-    //             NOCASE  -  大文字小文字の区別をしない(アルファベットのみ)
-    //             NORMAL  -  置換表を使用しない(従来型NFAエンジンモード)
-    //  戻り値  :  失敗時はnullptrを返す。成功時はマッチした末尾の位置を返す
+    //  size    :  textの文字数(text[size]はL'\0'であること)。負の値ならwcslenで求める
+    //  戻り値  :  一致したパターンの番号(昇順)。エラーはerror関数で確認できる
     //---------------------------------------------------------------------
-    const wchar_t* reg_find(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    //  必ず含む文字列がテキストに無いパターンは照合しない(regex_ptt::NOCASE指示では絞り込まない)。
+    //  残りのうち状態集合で判定できるパターンは、結合したグラフでテキストを一度だけ読んで判定し、
+    //  それ以外のパターンだけを一つずつ照合する
+    //---------------------------------------------------------------------
+    std::vector<int> test(const wchar_t* text, const regex_set& set, const int options = 0, const intptr_t size = -1)
     {
-        if (limit_-- < 0LL || depth < 0L) {
-            runtimeerror(L"backtrack limit error.");
-            return nullptr;
+        std::vector<int> ret;
+        std::vector<char> cand;
+        const intptr_t len = setup(text, set, options, size, cand);
+        if (len < 0)
+            return ret;
+        const auto start = set_scan(set, cand, len, options, false);
+        for (size_t k = 0; k < set.size() && what_.empty(); k++) {
+            if (set.head_[k] >= 0 ? start[k] >= 0 : (cand[k] && test(text, set[k], options, 0, len)))
+                ret.push_back(static_cast<int>(k));
         }
+        return ret;
+    }
 
-        if (node == nullptr)
-            return nullptr;
+    //---------------------------------------------------------------------
+    //  複数のパターンをまとめて照合し、一致したパターンの番号と結果を返す
+    //---------------------------------------------------------------------
+    //  引数はtest関数と同じ。戻り値は一致したパターンの番号(昇順)と、そのパターンを
+    //  match関数で照合した結果の組。エラーになった場合は、そのパターンの結果(エラー)で終わる
+    //---------------------------------------------------------------------
+    //  結合したグラフでパターン毎に最も前の開始位置を求め、一致したパターンだけを
+    //  その位置から照合し直してキャプチャを求める
+    //---------------------------------------------------------------------
+    std::vector<std::pair<int, regex_result>> match(const wchar_t* text, const regex_set& set, const int options = 0, const intptr_t size = -1)
+    {
+        std::vector<std::pair<int, regex_result>> ret;
+        std::vector<char> cand;
+        const intptr_t len = setup(text, set, options, size, cand);
+        if (len < 0)
+            return ret;
+        const auto start = set_scan(set, cand, len, options, true);
+        for (size_t k = 0; k < set.size(); k++) {
+            if (set.head_[k] >= 0 ? start[k] < 0 : !cand[k])
+                continue;
+            auto result = match(text, set[k], options, std::max<intptr_t>(start[k], 0), len);
+            if (result || result.is_error())
+                ret.emplace_back(static_cast<int>(k), std::move(result));
+            if (!what_.empty())
+                break;
+        }
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  エラーメッセージを返す
+    //---------------------------------------------------------------------
+    const std::wstring& error() const
+    {
+        return what_;
+    }
+    regex_result::errc code() const { return code_; }   //  エラーの種類
+
+private:
+    struct scan_end;
+
+    //---------------------------------------------------------------------
+    //  探索の前準備(作業領域の初期化)
+    //  戻り値  :  textの文字数。エラーなら-1を返す
+    //---------------------------------------------------------------------
+    intptr_t setup(const wchar_t* text, const regex_compiled& re, const int options, const intptr_t seek, intptr_t size = -1)
+    {
+        what_.clear();                  //  エラー出力メッセージの初期化
+        code_ = regex_result::errc::NONE;
+        input_head_ = text;             //  検索対象テキストの先頭位置を保存しておく
+        if (size < 0)
+            size = wcslen(text);
+        input_end_ = text + size;
+        if (size < seek) {
+            runtimeerror(regex_result::errc::BUFFER_OVERRUN);
+            return -1;
+        }
+
+        //  キャプチャの初期化
+        //  regex_ptt::NOCAPTURE指示でも、後方参照を含むパターンではキャプチャが必要になる
+        nocapture_ = (options & regex_ptt::NOCAPTURE) && !re.has_backref();
+        capture_.clear();
+        capture_.resize(nocapture_ ? 1 : re.capture(), std::pair<intptr_t, intptr_t>(-1, -1));
+        refs_ = re.has_backref() ? &re.backrefs() : nullptr;
+        first_ = re.first();
+
+        //  ループ監視位置の初期化
+        loop_.clear();
+        loop_.resize(re.loops(), nullptr);
+        run_.clear();
+        run_.resize(re.runs());
+
+        //  置換表のセットアップ
+        if (options & regex_ptt::NORMAL) {
+            table_ = nullptr;       //  nullptrを設定すれば、置換表を使わない従来型NFAエンジンになる
+        } else {
+            table_ = &hash_table_;  //  置換表を設定
+        }
+        table_clear();              //  置換表を初期化する
+        return size;
+    }
+
+    //---------------------------------------------------------------------
+    //  Latin-1のテキストのfrom～sizeの範囲を、作業領域(wide_)にwchar_tで写す
+    //---------------------------------------------------------------------
+    const wchar_t* widen(const char* text, const intptr_t from, const intptr_t size)
+    {
+        wide_.resize(static_cast<size_t>(size - from));
+        for (intptr_t i = from; i < size; i++)
+            wide_[i - from] = static_cast<unsigned char>(text[i]);
+        return wide_.c_str();
+    }
+
+    //---------------------------------------------------------------------
+    //  Latin-1のテキストを広げずに状態集合で探索できるか
+    //  (アトミックグループなどを含まず、文字を消費するノードが全てビット表を持つ)
+    //---------------------------------------------------------------------
+    static bool narrow(const regex_compiled& re)
+    {
+        if (!re.graph() || re.atomic())
+            return false;
+        for (auto node : re.graph()->node) {
+            const nfa_node* v = node->type == node_type::RUN ? node->n2 : node;
+            const bool consume = v->type == node_type::CLASS || (v->type == node_type::DEFAULT && v->len == 1 && v->val) ||
+                                 (v->type == node_type::ESCAPE && v->val[1] != L'b' && v->val[1] != L'B');
+            if (consume && v->set == nullptr)
+                return false;
+        }
+        return true;
+    }
+
+    //---------------------------------------------------------------------
+    //  開始位置がbound以前の一致だけを探す(regex_poolが区間毎に検索するのに使う)
+    //  引数はmatch関数と同じ
+    //---------------------------------------------------------------------
+    regex_result match_until(const wchar_t* text, const regex_compiled& re, const int options, const intptr_t seek, const intptr_t size, const intptr_t bound)
+    {
+        if (re.get() == nullptr)
+            return regex_result();
+        auto ret = locate(text, re, options, seek, size, bound);
+        return make_result(text, ret);
+    }
+
+    //---------------------------------------------------------------------
+    //  regex_ptt::PARTIAL指示の照合が一致しなかった場合に、テキストの末尾での状態集合を
+    //  求めて、途切れた一致を結果に設定する(resumeで再開できるように状態集合を残す)
+    //---------------------------------------------------------------------
+    //  状態集合で探索できないパターン(後方参照や、回数の大きい一文字の繰り返しを含むもの)は、
+    //  マッチ長の上限から末尾に届き得る最も前の開始位置を求めて、途切れた一致とする。
+    //  続きで一致しないものも含む控えめな見積もりで、上限が無ければ探索開始位置になる
+    //---------------------------------------------------------------------
+    void suspend(regex_result& result, const regex_compiled& re, const int options, const intptr_t seek)
+    {
+        resume_.re = nullptr;
+        if (result || result.is_error())
+            return;
+        resume_.re = &re;
+        resume_.options = options;
+        resume_.seek = seek;
+        resume_.end.from = -1;
+        const intptr_t size = input_end_ - input_head_;
+        if (!re.graph()) {
+            intptr_t hit = re.max_length() < 0 ? seek : std::max(size - re.max_length(), seek);
+            if (hit > seek && !(options & regex_ptt::SEARCH))
+                hit = size + 1;         //  探索開始位置からの照合は末尾に届かない
+            resume_.end.hit = hit;
+            set_partial(result, size, options);
+            return;                     //  再開時に照合し直す
+        }
+        forward_scan(*re.graph(), size, seek, size - 1, options, false, &resume_.end);
+        resume_.end.from = size;
+        set_partial(result, size, options);
+    }
+
+    //---------------------------------------------------------------------
+    //  末尾で入力が足りなくなった要素があれば、途切れた一致として結果に設定する
+    //  regex_ptt::SEARCH指示では、末尾から始まる(一文字も読んでいない)ものは除く
+    //---------------------------------------------------------------------
+    void set_partial(regex_result& result, const intptr_t size, const int options) const
+    {
+        const intptr_t hit = resume_.end.hit;
+        if (hit < size || (hit == size && !(options & regex_ptt::SEARCH)))
+            result.set_partial(hit);
+    }
+
+    //---------------------------------------------------------------------
+    //  テキストの後に入力が続く場合に、探索の結果が確定している開始位置の範囲を求める
+    //  (regex_streamが使う)
+    //  戻り値  :  これより前(seek以降)から始まる一致の有無と範囲は、後に続く入力で変わらない。
+    //             エラーなら-1
+    //---------------------------------------------------------------------
+    //  後に続く入力で変わるのは、照合がテキストの末尾で入力を待つ開始位置だけ。状態集合で
+    //  探索できるパターンは末尾で入力が足りなくなった要素の開始位置から、それ以外の
+    //  パターンはマッチ長の上限(単語境界の判定に一文字先まで読む)から求める。
+    //  上限が無ければseekより先へは進まない。末尾から始まる一致は常に確定しないものとする
+    //  carryを指定すると、末尾に届いた要素をcarryに残す。次の呼び出しのcarry->fromが0以上なら
+    //  (同じseekで、テキストが後ろへ延びただけの場合に限る)、そこから続きを進める
+    //---------------------------------------------------------------------
+    intptr_t settled(const wchar_t* text, const regex_compiled& re, const int options, const intptr_t seek, const intptr_t size, scan_end* carry = nullptr)
+    {
+        if (setup(text, re, options, seek, size) < 0)
+            return -1;
+        if (re.graph()) {
+            scan_end local;
+            scan_end& end = carry ? *carry : local;
+            forward_scan(*re.graph(), size, seek, size - 1, options | regex_ptt::SEARCH, false, &end);
+            end.from = size;
+            return std::min(std::max(end.hit, seek), size);
+        }
+        if (re.max_length() >= 0)
+            return std::max(size - re.max_length(), seek);
+        return seek;
+    }
+
+    //---------------------------------------------------------------------
+    //  複数のパターンの探索の前準備
+    //  cand    :  照合が必要なパターンに1を設定する
+    //  戻り値  :  textの文字数。エラーなら-1を返す
+    //---------------------------------------------------------------------
+    intptr_t setup(const wchar_t* text, const regex_set& set, const int options, intptr_t size, std::vector<char>& cand)
+    {
+        what_ = set.err_msg();
+        code_ = what_.empty() ? regex_result::errc::NONE : regex_result::errc::PATTERN;
+        if (!what_.empty())
+            return -1;
+        if (size < 0)
+            size = wcslen(text);
+        input_head_ = text;
+        input_end_ = text + size;
+        first_ = set.has_first_ ? &set.first_ : nullptr;
+        if (options & regex_ptt::NOCASE)
+            cand.assign(set.size(), 1);
+        else
+            set.prefilter(text, size, cand);
+        return size;
+    }
+
+    //---------------------------------------------------------------------
+    //  探索結果を作る
+    //  text    :  一致した開始位置
+    //  ret     :  一致した末尾(一致しなかった場合はnullptr)
+    //---------------------------------------------------------------------
+    regex_result make_result(const wchar_t* text, const wchar_t* ret)
+    {
+        regex_result result;
+        if (what_.empty() == false) {
+            //  エラーの種類を設定する
+            result.set(code_);
+        } else if (ret) {
+            //  キャプチャ変数の0番目にマッチした全体を登録する
+            capture_[0].first = (text - input_head_);       //  マッチ位置
+            capture_[0].second = (ret - text);              //  文字列長
+            result.set(capture_);
+        }
+        return result;
+    }
+
+    //---------------------------------------------------------------------
+    //  位置p以降で、一致の先頭になり得る文字(first_)がある位置を探す
+    //  戻り値  :  見つかった位置。last以前に無ければlast + 1
+    //---------------------------------------------------------------------
+    intptr_t next_start(intptr_t p, const intptr_t last, const int option) const
+    {
+        const bool nocase = (option & regex_ptt::NOCASE) != 0;
+        const simd::ranges& r = first_->range[nocase];
+        const bool w = first_->wide[nocase];
+        if (r.n < 0) {
+            for (; p <= last; p++) {
+                if (first_->test(input_head_[p], nocase))
+                    break;
+            }
+            return p;
+        }
+        while (p <= last) {
+            p += simd::find(input_head_ + p, last - p + 1, r, w);
+            if (p > last || !w || simd::member(input_head_[p], r) || first_->test(input_head_[p], nocase))
+                break;
+            ++p;        //  範囲で表せない文字で止まったが、候補ではなかった
+        }
+        return std::min(p, last + 1);
+    }
+
+    //---------------------------------------------------------------------
+    //  Latin-1のテキストで、位置p以降の一致の先頭になり得る文字がある位置を探す
+    //  (候補が一文字ならmemchrで探す)
+    //---------------------------------------------------------------------
+    intptr_t next_start(const unsigned char* in, intptr_t p, const intptr_t last, const int option) const
+    {
+        const bool nocase = (option & regex_ptt::NOCASE) != 0;
+        const simd::ranges& r = first_->range[nocase];
+        if (r.n == 1 && r.lo[0] == r.hi[0] && static_cast<uint32_t>(r.lo[0]) < 256 && p <= last) {
+            auto hit = static_cast<const unsigned char*>(std::memchr(in + p, r.lo[0], static_cast<size_t>(last - p + 1)));
+            return hit ? hit - in : last + 1;
+        }
+        while (p <= last && !first_->low.test(in[p], nocase))
+            p++;
+        return p;
+    }
+    intptr_t next_start(const wchar_t*, const intptr_t p, const intptr_t last, const int option) const
+    {
+        return next_start(p, last, option);
+    }
+
+    //---------------------------------------------------------------------
+    //  状態集合による探索での、位置pの文字の一致と単語境界の判定(テキストの文字型毎)
+    //---------------------------------------------------------------------
+    //  Latin-1のテキストは、コンパイル時に作ったノードのビット表だけで引く。
+    //  inはsizeバイトまでしか読まない(in[size]は'\0'でなくてよい)
+    //---------------------------------------------------------------------
+    bool take(const nfa_node* node, const wchar_t* in, const intptr_t p, const intptr_t, const int option)
+    {
+        return accept(node, in + p, option) != 0;
+    }
+    bool take(const nfa_node* node, const unsigned char* in, const intptr_t p, const intptr_t size, const int option) const
+    {
+        return p < size && node->set->test(in[p], (option & regex_ptt::NOCASE) != 0);
+    }
+    bool boundary(const nfa_node* node, const wchar_t* in, const intptr_t p, const intptr_t, const int option)
+    {
+        return escape(node->val + 1, in + p, option) != -1;
+    }
+    static bool boundary(const nfa_node* node, const unsigned char* in, const intptr_t p, const intptr_t size, const int)
+    {
+        auto word = [in](const intptr_t q) { return (unicode::property(in[q]) & unicode::WORD) != 0; };
+        const bool before = p > 0 && word(p - 1);
+        const bool after = p < size && word(p);
+        return (before != after) == (node->val[1] == L'b');
+    }
+
+    //---------------------------------------------------------------------
+    //  状態集合による前方への探索
+    //---------------------------------------------------------------------
+    //  各位置で「そこまでの文字列で到達できるノード」の集合を求めながら一文字ずつ進み、
+    //  終了状態が集合に入ったら一致とする。regex_ptt::SEARCH指示では、last以前の
+    //  各位置で先頭ノードを集合に加える。最短一致はε遷移と同じ扱いになるが、
+    //  一致の有無は変わらない(アトミックグループなどを含むパターンには使えない)
+    //  集合の要素は開始位置の順に並べて処理し、同じノードには開始位置の最も前のものだけを残す。
+    //  leftmostがtrueなら、それより前から始まる要素がなくなるまで進めて、最も前の開始位置を求める
+    //  endを指定すると途中で止めずに末尾(size)まで進め、テキストが続く場合に必要な情報を
+    //  endに設定する(scan_endを参照)。regex_ptt::SEARCH指示では末尾でも先頭ノードを加える。
+    //  end->fromが0以上なら、前の探索で末尾に届いた要素(end->threads)を引き継いでそこから進める
+    //  end->stopが0以上なら末尾までは進めず、endを指定しない場合と同じ探索をend->stopで止める。
+    //  止めた場合はend->fromにend->stopを、end->threadsとend->foundにその時点の状態を設定する
+    //  戻り値  :  一致の開始位置。一致しなければ-1(endを指定した場合と、止めた場合は常に-1)
+    //---------------------------------------------------------------------
+    intptr_t forward_scan(const regex_compiled::nfa_graph& g, const intptr_t size, const intptr_t seek, const intptr_t last, const int option, const bool leftmost = false, scan_end* end = nullptr)
+    {
+        return forward_scan(input_head_, g, size, seek, last, option, leftmost, end);
+    }
+
+    //---------------------------------------------------------------------
+    //  inを先頭とするテキストの状態集合による前方への探索(上のforward_scanの本体)
+    //---------------------------------------------------------------------
+    //  Charがunsigned charならLatin-1のテキストを広げずに読む(narrow関数がtrueのパターンに使う)
+    //---------------------------------------------------------------------
+    template<typename Char>
+    intptr_t forward_scan(const Char* in, const regex_compiled::nfa_graph& g, const intptr_t size, const intptr_t seek, const intptr_t last, const int option, const bool leftmost, scan_end* end)
+    {
+        auto& mark = scan_.mark;        //  集合に入っている位置
+        auto& rmark = scan_.rmark;      //  一文字の繰り返しの途中の要素が集合に入っている位置
+        auto& cur = scan_.cur;
+        auto& nxt = scan_.nxt;
+        auto& work = scan_.work;
+        scan_.reset(g.node.size(), g.slots);
+        intptr_t start = -1;            //  処理中の要素の開始位置
+        intptr_t found = -1;            //  一致した開始位置
+
+        intptr_t p = seek;
+        scan_end* const pause = (end && end->stop >= 0) ? end : nullptr;   //  途中で止める探索
+        if (pause) {
+            end = nullptr;
+            if (pause->from >= 0) {
+                p = pause->from;        //  止めた探索の続き
+                found = pause->found;
+                nxt.swap(pause->threads);
+            }
+        }
+        if (end) {
+            end->found = -1;
+            end->hit = size + 1;
+            if (end->from >= 0) {
+                p = end->from;          //  前の探索の続き
+                nxt.swap(end->threads);
+            }
+        }
+        auto add = [&](int y) {
+            if (mark[y] != p) {
+                mark[y] = p;
+                work.push_back(y);
+            }
+        };
+        auto add_next = [&](int x) {
+            for (auto y : g.succ[x])
+                add(y);
+        };
+        auto shift = [&](int x) {
+            for (auto y : g.succ[x])
+                nxt.push_back({ start, y, -1 });
+        };
+        //  endを指定した場合の末尾では、文字を読むノード(と単語境界、行末)に届いた要素を記録する
+        bool at_end = false;
+        auto hit = [&]() {
+            end->hit = std::min(end->hit, start);
+        };
+        auto add_run = [&](int x, int c) {
+            auto node = g.node[x];
+            const int max = node->max;  //  上限が無ければ最小回数で数えるのをやめる(回数はslotの数より小さい)
+            if (c >= node->min)
+                add_next(x);            //  繰り返しを抜けられる
+            if (max < 0 || c < max) {
+                if (at_end)
+                    hit();
+                else if (take(node->n2, in, p, size, option))
+                    nxt.push_back({ start, x, max < 0 ? std::min(c + 1, node->min) : c + 1 });
+            }
+        };
+        auto closure = [&]() {
+            while (!work.empty()) {
+                auto x = work.back();
+                work.pop_back();
+                auto node = g.node[x];
+                switch (node->type) {
+                case node_type::END:
+                    if (((option & regex_ptt::SEARCH) || p == size)) {
+                        if (end) {
+                            if (end->found < 0 || start < end->found)
+                                end->found = start;
+                        } else if (found < 0 || start < found) {
+                            found = start;
+                        }
+                    }
+                    break;
+                case node_type::RUN:
+                    add_run(x, 0);
+                    break;
+                case node_type::BOL:
+                    if (p == 0 || (!(option & regex_ptt::SINGLE) && in[p - 1] == L'\n'))
+                        add_next(x);
+                    break;
+                case node_type::EOL:
+                    if (at_end)
+                        hit();                  //  テキストが続けば行末ではなくなる
+                    if (p == size)
+                        add_next(x);
+                    break;
+                case node_type::ESCAPE:
+                    if (node->val[1] == L'b' || node->val[1] == L'B') {
+                        if (at_end)
+                            hit();              //  テキストが続けば変わり得る
+                        if (boundary(node, in, p, size, option))
+                            add_next(x);
+                    } else if (at_end) {
+                        hit();
+                    } else if (take(node, in, p, size, option)) {
+                        shift(x);
+                    }
+                    break;
+                case node_type::CLASS:
+                    if (at_end)
+                        hit();
+                    else if (take(node, in, p, size, option))
+                        shift(x);
+                    break;
+                case node_type::DEFAULT:
+                    if (node->len == 1 && node->val) {     //  通常文字
+                        if (at_end)
+                            hit();
+                        else if (take(node, in, p, size, option))
+                            shift(x);
+                        break;
+                    }
+                    add_next(x);
+                    break;
+                default:
+                    add_next(x);                //  グループ、ループなど文字を消費しないノード
+                    break;
+                }
+            }
+        };
+
+        for (;; p++) {
+            std::swap(cur, nxt);
+            nxt.clear();
+            at_end = end && p == size;
+            if (cur.empty() && found < 0 && first_ && (option & regex_ptt::SEARCH) && !at_end) {
+                //  続く要素がなければ、一致の先頭になり得る位置まで読み飛ばす
+                const intptr_t skip = pause ? std::min(last, pause->stop - 1) : last;
+                p = next_start(in, p, skip, option);
+                if (p > last) {
+                    if (!end)
+                        return -1;
+                    p = size;           //  末尾の先頭ノードだけを調べる
+                    at_end = true;
+                }
+            }
+            if (pause && p >= pause->stop && p < size) {
+                p = pause->stop;
+                pause->from = p;
+                pause->found = found;
+                pause->threads.assign(cur.begin(), cur.end());
+                return -1;
+            }
+            //  前の位置から続く要素(開始位置の順に並んでいる)
+            for (auto& t : cur) {
+                if (found >= 0 && t.start >= found)
+                    break;              //  一致より後から始まる要素は調べなくてよい
+                start = t.start;
+                if (t.count < 0) {
+                    add(t.node);
+                } else {
+                    //  一文字の繰り返しの途中は、ノードと回数の組で集合に入れる
+                    auto idx = static_cast<size_t>(g.slot[t.node]) + t.count;
+                    if (rmark[idx] == p)
+                        continue;
+                    rmark[idx] = p;
+                    add_run(t.node, t.count);
+                }
+                closure();
+            }
+            //  この位置から始まる要素
+            if (found < 0 && (p == seek || ((option & regex_ptt::SEARCH) && (p <= last || at_end)))) {
+                start = p;
+                add(g.head);
+                closure();
+            }
+
+            if (at_end) {
+                end->threads.assign(cur.begin(), cur.end());
+                return -1;
+            }
+            if (found >= 0 && (!leftmost || nxt.empty() || nxt.front().start >= found))
+                return found;
+            if (p >= size)
+                return found;
+            if (nxt.empty() && !((option & regex_ptt::SEARCH) && p < last)) {
+                if (!end)
+                    return found;
+                p = size - 1;           //  末尾まで進める
+            }
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  結合したグラフ(regex_set)の状態集合による前方への探索
+    //---------------------------------------------------------------------
+    //  forward_scanと同じ手順で、照合が必要なパターン(cand)の先頭ノードを各位置で集合に加える。
+    //  パターン毎のノードは重ならないので、要素の開始位置の順序はパターン毎に保たれる。
+    //  leftmostがtrueならパターン毎に最も前の開始位置を求め、falseなら一致したパターンの
+    //  要素はすぐに捨てる
+    //  戻り値  :  パターン毎の一致の開始位置(一致しないか、結合していないパターンは-1)
+    //---------------------------------------------------------------------
+    std::vector<intptr_t> set_scan(const regex_set& set, const std::vector<char>& cand, const intptr_t size, const int option, const bool leftmost)
+    {
+        const auto& g = set.graph_;
+        const bool nocase = (option & regex_ptt::NOCASE) != 0;
+        std::vector<intptr_t> found(set.size(), -1);        //  パターン毎の一致した開始位置
+        std::vector<int> heads;                             //  照合するパターン
+        intptr_t last = -1;                                 //  どれかのパターンが一致し得る最後の開始位置
+        for (size_t k = 0; k < set.size(); k++) {
+            if (set.head_[k] >= 0 && cand[k]) {
+                heads.push_back(static_cast<int>(k));
+                last = std::max(last, size - set[k].min_length());
+            }
+        }
+        if (heads.empty() || last < 0)
+            return found;
+
+        auto& mark = scan_.mark;        //  集合に入っている位置
+        auto& rmark = scan_.rmark;      //  一文字の繰り返しの途中の要素が集合に入っている位置
+        auto& cur = scan_.cur;
+        auto& nxt = scan_.nxt;
+        auto& work = scan_.work;
+        scan_.reset(g.node.size(), g.slots);
+        intptr_t start = -1;            //  処理中の要素の開始位置
+        size_t rest = heads.size();     //  まだ一致していないパターンの数
+
+        intptr_t p = 0;
+        auto add = [&](int y) {
+            if (mark[y] != p) {
+                mark[y] = p;
+                work.push_back(y);
+            }
+        };
+        auto add_next = [&](int x) {
+            for (auto y : g.succ[x])
+                add(y);
+        };
+        auto shift = [&](int x) {
+            for (auto y : g.succ[x])
+                nxt.push_back({ start, y, -1 });
+        };
+        auto add_run = [&](int x, int c) {
+            auto node = g.node[x];
+            const int max = node->max;
+            if (c >= node->min)
+                add_next(x);            //  繰り返しを抜けられる
+            if ((max < 0 || c < max) && accept(node->n2, input_head_ + p, option))
+                nxt.push_back({ start, x, max < 0 ? std::min(c + 1, node->min) : c + 1 });
+        };
+        auto done = [&](const thread& t) {
+            const intptr_t f = found[set.owner_[t.node]];
+            return f >= 0 && (!leftmost || t.start >= f);
+        };
+        auto closure = [&]() {
+            const wchar_t* text = input_head_ + p;
+            while (!work.empty()) {
+                auto x = work.back();
+                work.pop_back();
+                auto node = g.node[x];
+                switch (node->type) {
+                case node_type::END: {
+                    auto& f = found[set.owner_[x]];
+                    if (((option & regex_ptt::SEARCH) || p == size) && (f < 0 || start < f)) {
+                        rest -= f < 0;
+                        f = start;
+                    }
+                    break;
+                }
+                case node_type::RUN:
+                    add_run(x, 0);
+                    break;
+                case node_type::BOL:
+                    if (p == 0 || (!(option & regex_ptt::SINGLE) && text[-1] == L'\n'))
+                        add_next(x);
+                    break;
+                case node_type::EOL:
+                    if (p == size)
+                        add_next(x);
+                    break;
+                case node_type::ESCAPE:
+                    if (node->val[1] == L'b' || node->val[1] == L'B') {
+                        if (escape(node->val + 1, text, option) != -1)
+                            add_next(x);
+                    } else if (accept(node, text, option)) {
+                        shift(x);
+                    }
+                    break;
+                case node_type::CLASS:
+                    if (accept(node, text, option))
+                        shift(x);
+                    break;
+                case node_type::DEFAULT:
+                    if (node->len == 1 && node->val) {     //  通常文字
+                        if (accept(node, text, option))
+                            shift(x);
+                        break;
+                    }
+                    add_next(x);
+                    break;
+                default:
+                    add_next(x);                //  グループ、ループなど文字を消費しないノード
+                    break;
+                }
+            }
+        };
+
+        for (;; p++) {
+            std::swap(cur, nxt);
+            nxt.clear();
+            if (cur.empty() && first_ && (option & regex_ptt::SEARCH)) {
+                //  続く要素がなければ、いずれかのパターンの先頭になり得る位置まで読み飛ばす
+                p = next_start(p, last, option);
+                if (p > last)
+                    return found;
+            }
+            //  前の位置から続く要素(パターン毎に開始位置の順に並んでいる)
+            for (auto& t : cur) {
+                if (done(t))
+                    continue;           //  そのパターンの一致より後から始まる要素は調べなくてよい
+                start = t.start;
+                if (t.count < 0) {
+                    add(t.node);
+                } else {
+                    //  一文字の繰り返しの途中は、ノードと回数の組で集合に入れる
+                    auto idx = static_cast<size_t>(g.slot[t.node]) + t.count;
+                    if (rmark[idx] == p)
+                        continue;
+                    rmark[idx] = p;
+                    add_run(t.node, t.count);
+                }
+                closure();
+            }
+            //  この位置から始まる要素
+            if (rest && (p == 0 || ((option & regex_ptt::SEARCH) && p <= last))) {
+                start = p;
+                for (auto k : heads) {
+                    if (found[k] >= 0 || p > size - set[k].min_length())
+                        continue;
+                    auto f = set[k].first();
+                    if (f && (option & regex_ptt::SEARCH) && (p == size || !f->test(input_head_[p], nocase)))
+                        continue;       //  このパターンの先頭になり得ない
+                    add(set.head_[k]);
+                    closure();
+                }
+            }
+
+            nxt.erase(std::remove_if(nxt.begin(), nxt.end(), done), nxt.end());
+            if (p >= size || (nxt.empty() && (!rest || !((option & regex_ptt::SEARCH) && p < last))))
+                return found;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  逆向きの遷移による後方からの探索
+    //---------------------------------------------------------------------
+    //  テキスト末尾の終了状態から先頭へ向かって一文字ずつ戻りながら、各位置で
+    //  「そのノードから末尾まで一致し得るノード」の集合を求める(NFAの状態集合の逆向きシミュレーション)。
+    //  先頭ノードが集合に入った位置が開始位置の候補で、見つかった順(後ろから)にfncへ渡す。
+    //  fncがtrueを返すか、集合が空になるか、位置がlowerに着いたら終わる。
+    //  アトミックグループ、強欲な量指定子、最短一致は考慮しない(ε遷移と同じ扱い)ので、
+    //  候補は実際の開始位置を必ず含むが、前方からの照合で確かめる必要がある
+    //---------------------------------------------------------------------
+    template<typename F>
+    void reverse_scan(const regex_compiled::nfa_graph& rp, const intptr_t size, const intptr_t lower, const int option, F&& fnc)
+    {
+        std::vector<intptr_t> mark(rp.node.size(), -1);     //  集合に入っている位置
+        std::vector<int> cur = { rp.end }, nxt, work;
+        std::vector<std::pair<int, int>> rcur, rnxt;        //  一文字の繰り返しの途中(ノード、後ろから数えた回数)
+
+        intptr_t p = size;
+        auto add = [&](int y) {
+            if (mark[y] != p) {
+                mark[y] = p;
+                work.push_back(y);
+            }
+        };
+        auto add_run = [&](int y, int c) {
+            auto node = rp.node[y];
+            const int max = node->max;
+            if (c >= node->min)
+                add(y);                 //  ここから繰り返しを始められる
+            if (p > 0 && (max < 0 || c < max) && accept(node->n2, input_head_ + p - 1, option))
+                rnxt.push_back({ y, max < 0 ? std::min(c + 1, node->min) : c + 1 });
+        };
+
+        for (;; p--) {
+            const wchar_t* text = input_head_ + p;
+            work.clear();
+            nxt.clear();
+            rnxt.clear();
+            for (auto x : cur)
+                add(x);
+            std::sort(rcur.begin(), rcur.end());
+            rcur.erase(std::unique(rcur.begin(), rcur.end()), rcur.end());
+            for (auto& r : rcur)
+                add_run(r.first, r.second);
+
+            while (!work.empty()) {
+                auto x = work.back();
+                work.pop_back();
+                for (auto y : rp.pred[x]) {
+                    auto node = rp.node[y];
+                    switch (node->type) {
+                    case node_type::RUN:
+                        add_run(y, 0);
+                        break;
+                    case node_type::BOL:
+                        if (p == 0 || (!(option & regex_ptt::SINGLE) && text[-1] == L'\n'))
+                            add(y);
+                        break;
+                    case node_type::EOL:
+                        if (p == size)
+                            add(y);
+                        break;
+                    case node_type::ESCAPE:
+                        if (node->val[1] == L'b' || node->val[1] == L'B') {
+                            if (escape(node->val + 1, text, option) != -1)
+                                add(y);
+                        } else if (p > 0 && accept(node, text - 1, option)) {
+                            nxt.push_back(y);
+                        }
+                        break;
+                    case node_type::CLASS:
+                        if (p > 0 && accept(node, text - 1, option))
+                            nxt.push_back(y);
+                        break;
+                    case node_type::DEFAULT:
+                        if (node->len == 1 && node->val) {     //  通常文字
+                            if (p > 0 && accept(node, text - 1, option))
+                                nxt.push_back(y);
+                            break;
+                        }
+                        add(y);
+                        break;
+                    default:
+                        add(y);                 //  グループ、ループなど文字を消費しないノード
+                        break;
+                    }
+                }
+            }
+
+            if (mark[rp.head] == p && p >= lower && fnc(p))
+                return;
+            if (p <= lower || (nxt.empty() && rnxt.empty()))
+                return;
+            std::swap(cur, nxt);
+            std::swap(rcur, rnxt);
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  std::unordered_setの第三パラメータに必要なハッシュ関数オブジェクト
+    //---------------------------------------------------------------------
+    struct hash {
+        template <class A>
+        std::size_t operator()(const std::vector<intptr_t, A>& key) const {
+            uint32_t h = 0;
+            for (auto v : key)
+                h = rand(h, v);
+            return static_cast<size_t>(h);
+        }
+        std::size_t operator()(const std::tuple<const nfa_node*, const wchar_t*, int>& key) const {
+            return static_cast<size_t>(rand(reinterpret_cast<intptr_t>(std::get<0>(key)) + std::get<2>(key),
+                                            reinterpret_cast<intptr_t>(std::get<1>(key))));
+        }
+        //  xorshift疑似乱数生成アルゴリズム
+        uint32_t rand(intptr_t a, intptr_t b) const {
+#if defined(_WIN64) || defined(__x86_64__)
+            uint32_t x = (uint32_t)((a >> 31) ^ a);
+            uint32_t w = (uint32_t)((b >> 31) ^ b);
+            uint32_t t = x ^ (x << 11);
+            return (w ^ (w >> 19)) ^ (t ^ (t >> 8));
+#else
+            uint32_t t = a ^ (a << 11);
+            return (b ^ (b >> 19)) ^ (t ^ (t >> 8));
+#endif
+        }
+    };
+
+    //---------------------------------------------------------------------
+    //  一文字の繰り返し(RUN)毎の作業領域
+    //  位置はいずれも対象文字列の先頭からのオフセット値
+    //---------------------------------------------------------------------
+    struct run_memo {
+        intptr_t from = -1, to = -2;    //  [from, to)の文字はループ本体に一致し、toの文字は一致しない
+        intptr_t lo   = -1, hi = -2;    //  [lo, hi]の位置から後続を探索して、一致しなかった(置換表と同じ扱い。
+                                        //  アトミックグループ内の失敗は本体の成功時に消せないので記録しない)
+        int      state = 0;             //  失敗した時のキャプチャの状態(置換表のキーと同じ)
+
+        bool failed(intptr_t pos, int st) const { return state == st && lo <= pos && pos <= hi; }
+        void fail(intptr_t pos, int st)
+        {
+            if (state == st && lo - 1 <= pos && pos <= hi + 1) {
+                lo = std::min(lo, pos);
+                hi = std::max(hi, pos);
+            } else {
+                lo = hi = pos;          //  隣接していなければ新しい範囲で置き換える
+                state = st;
+            }
+        }
+    };
+
+    //---------------------------------------------------------------------
+    //  状態集合による探索(forward_scan、set_scan)の作業領域
+    //  呼び出し毎に確保し直さないように、メンバ変数として使い回す
+    //---------------------------------------------------------------------
+    struct thread {
+        intptr_t start;                 //  開始位置
+        int      node;
+        int      count;                 //  一文字の繰り返しの途中なら繰り返した回数(それ以外は-1)
+
+        bool operator==(const thread& t) const { return start == t.start && node == t.node && count == t.count; }
+    };
+    struct scan_end {
+        intptr_t            found = -1;     //  一致した最も前の開始位置(一致しなければ-1)
+        intptr_t            hit = -1;       //  末尾で入力が足りなくなった要素(文字を読むノードや単語境界、
+                                            //  行末に届いた要素)の最も前の開始位置。無ければsize + 1
+        intptr_t            from = -1;      //  引き継いで進める位置(-1なら最初から)
+        std::vector<thread> threads;        //  末尾に届いた要素(開始位置の順)
+        intptr_t            stop = -1;      //  0以上なら、この位置まで進めたところで止める(regex_jobが使う)
+    };
+    struct scan_area {
+        std::vector<intptr_t> mark;     //  集合に入っている位置
+        std::vector<intptr_t> rmark;    //  一文字の繰り返しの途中の要素が集合に入っている位置
+        std::vector<thread>   cur, nxt;
+        std::vector<int>      work;
+
+        void reset(const size_t nodes, const size_t slots)
+        {
+            mark.assign(nodes, -1);
+            rmark.assign(slots, -1);
+            cur.clear();
+            nxt.clear();
+            work.clear();
+        }
+    };
+
+    //---------------------------------------------------------------------
+    //  regex_ptt::PARTIAL指示で一致しなかった照合(resumeで再開する)
+    //---------------------------------------------------------------------
+    struct suspended {
+        const regex_compiled* re = nullptr; //  パターン(再開できる照合が無ければnullptr)
+        int                   options = 0;
+        intptr_t              seek = 0;
+        scan_end              end;          //  テキストの末尾での状態集合(end.fromがテキストの文字数。-1なら照合し直す)
+    };
+
+    //---------------------------------------------------------------------
+    //  メンバ変数
+    //---------------------------------------------------------------------
+    using Capture  = std::vector<std::pair<intptr_t, size_t>>;      //  キャプチャ
+    using Guard    = std::vector<const wchar_t*>;                   //  ループ開始時のテキスト位置(ε遷移無限ループ対策)
+    using hash_key = std::tuple<const nfa_node*, const wchar_t*, int>;  //  キー(ノード、テキスト位置、キャプチャの状態)
+    using Table    = std::pmr::unordered_set<hash_key, hash>;       //  置換表
+
+    const wchar_t* input_head_ = nullptr;   //  対象文字列の開始アドレス
+    const wchar_t* input_end_ = nullptr;    //  対象文字列の末尾(L'\0'の位置)
+    long long      limit_;                  //  バックトラック回数制限用
+    std::wstring   what_;                   //  エラーメッセージ
+    regex_result::errc code_ = regex_result::errc::NONE;   //  エラーの種類
+    Capture        capture_;                //  キャプチャ
+    const std::vector<int>* refs_ = nullptr;    //  後方参照されるグループの番号(後方参照がなければnullptr)
+    const regex_compiled::first_set* first_ = nullptr;  //  一致の先頭になり得る文字(求められなければnullptr)
+    std::pmr::unsynchronized_pool_resource pool_;  //  置換表などの作業領域の確保元
+    std::pmr::unordered_map<std::pmr::vector<intptr_t>, int, hash> states_{ &pool_ };  //  後方参照されるグループのキャプチャの値と、その状態番号
+    std::pmr::vector<intptr_t> state_key_{ &pool_ };   //  状態番号を引く時の作業領域
+    int            state_ = 0;              //  現在のキャプチャの状態番号(-1は未計算、NO_STATEは置換表を使わない)
+    bool           nocapture_ = false;      //  キャプチャを記録しない(regex_ptt::NOCAPTURE)
+    const wchar_t* match_end_ = nullptr;    //  二段階の探索で、一段階目に求めた一致の末尾
+    bool           pending_ = false;        //  手数を使い切って探索を途中で止めた(search)
+    std::wstring   record_;                 //  複数の文字列をまとめて照合する時に、一つずつL'\0'を付けて写す作業領域
+    Guard          loop_;                   //  ループ監視位置
+    scan_area      scan_;                   //  状態集合による探索の作業領域
+    suspended      resume_;                 //  regex_ptt::PARTIAL指示で一致しなかった照合(resumeで再開する)
+    std::vector<run_memo> run_;             //  一文字の繰り返しの作業領域
+    Capture        saved_;                  //  アトミックグループ失敗時に戻すキャプチャ(スタックとして使う)
+    std::vector<hash_key> log_;             //  アトミックグループ内で置換表に登録したキー
+    int            nest_ = 0;               //  アトミックグループの入れ子の深さ
+    Table          hash_table_{ &pool_ };   //  置換表
+    Table*         table_ = nullptr;        //  置換表(On = &hash_table, Off = nullptr)
+    std::wstring   wide_;                   //  Latin-1のテキストを広げる作業領域
+
+private:
+    //---------------------------------------------------------------------
+    //  再帰的にパターンマッチを行う
+    //---------------------------------------------------------------------
+    //  node    :  NFAリンクリスト
+    //  text    :  検索対象文字列
+    //  depth   :  探索深度(スタックオーバーフロー対策)
+    //  option  :  探索オプション
+    //             SEARCH  -  部分一致探索指示
+    //             SINGLE  -  「^」が改行の次にはマッチしない
+    //             NOCASE  -  大文字小文字の区別をしない
+    //             NORMAL  -  置換表を使用しない(従来型NFAエンジンモード)
+    //  戻り値  :  失敗時はnullptrを返す。成功時はマッチした末尾の位置を返す
+    //---------------------------------------------------------------------
+    const wchar_t* reg_find(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    {
+        if (limit_-- < 0LL || depth < 0L) {
+            runtimeerror(regex_result::errc::BACKTRACK_LIMIT);
+            return nullptr;
+        }
+
+        if (node == nullptr)
+            return nullptr;
+
+        if (node->type == node_type::END) {                             //  NFAリンクリスト終端
+            if (match_end_ && text != match_end_)
+                return nullptr;                                         //  二段階目の探索は決まった末尾でしか終われない
+            if (option & regex_ptt::SEARCH)
+                return text;                                            //  部分一致
+            return text[0] == L'\0' ? text : nullptr;                   //  完全一致か不一致
+        }
+
+        //  ε遷移無限ループ対策
+        //  「置換表」処理の前に行わなければ、「置換表」が誤判定を起こす原因になる
+        if (node->type == node_type::ENDLOOP && loop_[node->len] == text) { //  ループ間でテキストを消費していない
+            if (node->n2->type == node_type::LOOP)                      //  ループせず次へ遷移する
+                return reg_find(node->n1, text, depth - 1, option);     //  最短一致の場合はn1が次の遷移先
+            return reg_find(node->n2, text, depth - 1, option);         //  最長一致の場合はn2が次の遷移先
+        }
+
+        //  置換表(「壊滅的なバックトラック」を抑制する)
+        if (table_ && node->n2 && capture_state() != NO_STATE) {       //  置換表が"有効" かつ 分岐のあるノード
+            hash_key key(node, text, state_);
+            if (table_->insert(key).second == false)
+                return nullptr;                                         //  既に評価済み(「一致しない」を返す)
+            if (nest_)
+                log_.push_back(key);                                    //  アトミックグループ内の登録を記録する
+        }
+
+        intptr_t seek = 0;
+        switch (node->type) {
+        case node_type::BOL:
+            //  「^」- 行頭
+            if (text != input_head_ && (option & regex_ptt::SINGLE || *(text - 1) != L'\n'))
+                return nullptr;
+            break;
+
+        case node_type::EOL:
+            //  「$」- 行末
+            if (*text != L'\0')
+                return nullptr;
+            break;
+
+        case node_type::GROUP:
+            //  「(」- グループ、キャプチャ
+            return group(node, text, depth, option);
+
+        case node_type::ENDGROUP:
+            //  「)」- 閉じカッコ
+            return end_group(node, text, depth, option);
+
+        case node_type::LOOP:
+            //  「*」- ループ開始ノード
+            return loop(node, text, depth, option);
+
+        case node_type::RUN:
+            //  「*」- 一文字の繰り返し
+            return run(node, text, depth, option);
+
+        case node_type::ATOMIC:
+            //  「(?>」- アトミックグループ
+            return atomic(node, text, depth, option);
+
+        case node_type::ENDATOMIC:
+            //  「)」- アトミックグループ終端。グループ内の探索を終えて、位置をatomicへ返す
+            return text;
+
+        case node_type::CLASS:
+            //  「[] or [^]」- 文字クラス
+            if (*text == L'\0' || (seek = char_class(node, text, option)) == 0)
+                return nullptr;
+            break;
+
+        case node_type::ESCAPE:
+            //  「\」- エスケープシーケンス
+            if ((seek = escape(node->val + 1, text, option)) == -1)
+                return nullptr;
+            break;
+
+        default:
+            if (node->len == 1 && node->type == node_type::DEFAULT) {
+                // 「通常文字」
+                if ((text[0] == L'\0') || (node->val == nullptr) || (seek = cmp_char(node->val, text, option)) == 0)
+                    return nullptr;
+            }
+        }   //  switch-caseの終了
+
+        //  再帰的に次のノードの探索を続ける
+        //  最初にn1遷移を試し、エラー応答でバックトラックしてきたら、(あれば)n2遷移を試す
+        auto ret = reg_find(node->n1, text + seek, depth - 1, option);
+        if (!ret && node->n2)
+            ret = reg_find(node->n2, text + seek, depth - 1, option);
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  キャプチャの開始処理を行う
+    //---------------------------------------------------------------------
+    const wchar_t* group(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    {
+        if (nocapture_)
+            return reg_find(node->n1, text, depth - 1, option);
+
+        auto rollback = capture_[node->len].first;          //  バックトラックしたときに値を戻すために保存する
+        capture_[node->len].first = (text - input_head_);   //  キャプチャ開始インデックス値
+        state_ = -1;
+
+        auto ret = reg_find(node->n1, text, depth - 1, option);
+        if (ret == nullptr) {
+            capture_[node->len].first = rollback;           //  失敗で戻る前にロールバックする
+            state_ = -1;
+        }
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  キャプチャデータを確定する
+    //---------------------------------------------------------------------
+    const wchar_t* end_group(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    {
+        if (nocapture_)
+            return reg_find(node->n1, text, depth - 1, option);
+
+        auto rollback = capture_[node->len].second;     //  バックトラック時に値を戻すために保存する
+        capture_[node->len].second = (text - input_head_) - capture_[node->len].first;  //  文字列長
+        state_ = -1;
+
+        auto ret = reg_find(node->n1, text, depth - 1, option);
+        if (ret == nullptr) {
+            capture_[node->len].second = rollback;      //  失敗で戻る前にロールバックする
+            state_ = -1;
+        }
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  ε遷移無限ループ対策
+    //  LOOP - ENDLOOP間でテキスト消費を監視する
+    //---------------------------------------------------------------------
+    const wchar_t* loop(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    {
+        auto rollback = loop_[node->len];   //  LOOPとENDLOOPは同じ序数を持つ
+        loop_[node->len] = text;            //  ENDLOOP側に現在のテキスト位置を知らせる
+        auto ret = reg_find(node->n1, text, depth - 1, option);
+        loop_[node->len] = rollback;        //  バックトラックにより戻ってきたのでロールバックする
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  アトミックグループ
+    //  グループ内を探索して最初に見つかった終端位置から後続を探索する。後続が
+    //  失敗してもグループ内の別の分岐は試さない
+    //---------------------------------------------------------------------
+    const wchar_t* atomic(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    {
+        auto mark = log_.size();
+        auto save = saved_.size();
+        const bool groups = (node->flag & nfa_node::GROUPS) && !nocapture_;
+        if (groups)                         //  後続が失敗した時にキャプチャを戻すために保存する
+            saved_.insert(saved_.end(), capture_.begin(), capture_.end());
+
+        ++nest_;
+        auto end = reg_find(node->n1, text, depth - 1, option);
+        --nest_;
+
+        //  置換表は「登録済み == 一致しない」として扱うため、グループ内で一致した経路の
+        //  登録が残っていると、別の位置からグループに入った時に誤判定を起こす。
+        //  一致した場合はグループ内で登録したキーを取り除く(不一致の場合はそのまま使える)
+        if (end && table_) {
+            for (auto i = mark; i < log_.size(); i++)
+                table_->erase(log_[i]);
+        }
+        log_.resize(mark);
+
+        auto ret = end ? reg_find(node->n2->n1, end, depth - 1, option) : nullptr;
+        if (!ret && end && groups) {
+            std::copy(saved_.begin() + save, saved_.end(), capture_.begin());   //  ロールバックする
+            state_ = -1;
+        }
+        saved_.resize(save);
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  一文字の繰り返し
+    //  一致する限り一度に読み進めてから、位置を戻しながら後続を試す
+    //  (最短一致は逆に、後続を試しながら一文字ずつ読み進める)
+    //---------------------------------------------------------------------
+    const wchar_t* run(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    {
+        const intptr_t min = node->min;
+        const intptr_t max = node->max < 0 ? PTRDIFF_MAX : node->max;
+        const intptr_t pos = text - input_head_;
+        auto& memo = run_[node->len];
+        const int state = capture_state();
+
+        if (node->flag & nfa_node::LAZY) {
+            for (intptr_t cnt = 0; ; cnt++) {
+                if (cnt >= min && !memo.failed(pos + cnt, state)) {
+                    auto ret = reg_find(node->n1, text + cnt, depth - 1, option);
+                    if (ret || !what_.empty())
+                        return ret;
+                    if (table_ && !nest_ && state != NO_STATE)
+                        memo.fail(pos + cnt, state);
+                }
+                if (cnt >= max || !accept(node->n2, text + cnt, option))
+                    return nullptr;
+            }
+        }
+
+        intptr_t cnt = 0;
+        if (memo.from <= pos && pos <= memo.to) {
+            cnt = memo.to - pos;                //  以前に読み進めた範囲の内側から始まっている
+        } else {
+            cnt = scan(node->n2, text, max, option);
+            if (cnt < max) {
+                memo.from = pos;
+                memo.to = pos + cnt;
+            }
+        }
+        cnt = std::min(cnt, max);
+        if (cnt < min)
+            return nullptr;
+
+        const intptr_t low = (node->flag & mode(option)) ? cnt : min;  //  強欲なら位置を戻さない
+        for (; cnt >= low; cnt--) {
+            if (memo.failed(pos + cnt, state)) {
+                cnt = memo.lo - pos;            //  失敗済みの範囲を飛ばす
+                continue;
+            }
+            auto ret = reg_find(node->n1, text + cnt, depth - 1, option);
+            if (ret || !what_.empty())
+                return ret;
+            if (table_ && !nest_ && state != NO_STATE)
+                memo.fail(pos + cnt, state);
+        }
+        return nullptr;
+    }
+
+    //---------------------------------------------------------------------
+    //  ノードvに連続して一致する文字数を返す(最大max文字)
+    //---------------------------------------------------------------------
+    intptr_t scan(const nfa_node* v, const wchar_t* text, const intptr_t max, const int option)
+    {
+        intptr_t cnt = 0;
+        const simd::ranges* r = v->set ? &v->set->range[(option & regex_ptt::NOCASE) != 0] : nullptr;
+        if (r && r->n > 0) {
+            //  範囲に入る文字をまとめて読み進め、範囲で表せない文字は一文字ずつ判定する
+            const intptr_t n = std::min(max, static_cast<intptr_t>(input_end_ - text));
+            for (;;) {
+                cnt += simd::span(text + cnt, n - cnt, *r);
+                if (cnt >= n || !accept(v, text + cnt, option))
+                    break;
+                ++cnt;
+            }
+        } else if (v->type == node_type::DEFAULT && v->val[0] == L'.') {
+            while (cnt < max && text[cnt] != L'\0' && text[cnt] != L'\n')
+                ++cnt;
+        } else if (v->type == node_type::DEFAULT && !(option & regex_ptt::NOCASE)) {
+            while (cnt < max && text[cnt] == v->val[0])
+                ++cnt;
+        } else {
+            while (cnt < max && accept(v, text + cnt, option))
+                ++cnt;
+        }
+        return cnt;
+    }
+
+    //---------------------------------------------------------------------
+    //  強欲フラグの判定に使う値(探索オプションで変わる)
+    //---------------------------------------------------------------------
+    static int mode(const int option)
+    {
+        return (option & regex_ptt::NOCASE) ? nfa_node::ICASE : nfa_node::EXACT;
+    }
+
+    //---------------------------------------------------------------------
+    //  一文字を消費するノード(通常文字、文字クラス、エスケープシーケンス)の一致処理
+    //  一致した場合は1を返す。不一致なら0を返す
+    //---------------------------------------------------------------------
+    int accept(const nfa_node* node, const wchar_t* text, const int option)
+    {
+        if (*text == L'\0')
+            return 0;
+        if (node->set && static_cast<uint32_t>(*text) < 256)
+            return node->set->test(*text, (option & regex_ptt::NOCASE) != 0);   //  コンパイル時に作ったビット表を引く
+        switch (node->type) {
+        case node_type::CLASS:  return char_class(node, text, option);
+        case node_type::ESCAPE: return escape(node->val + 1, text, option) != -1;
+        default:                return cmp_char(node->val, text, option);
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  「通常文字」の一致処理
+    //  複雑になるのでUnicodeのサロゲートペアなどは考慮しない
+    //---------------------------------------------------------------------
+    int cmp_char(const wchar_t* pattern, const wchar_t* text, const int option) const
+    {
+        if (*pattern == L'.' && *text != L'\n') {
+            return 1;
+        }
+        if (*pattern == *text)
+            return 1;
+        if (option & regex_ptt::NOCASE)
+            return cmp_nocase(*text, *pattern);
+        return 0;
+    }
+
+    //---------------------------------------------------------------------
+    //  文字の種類(unicode::DIGIT、SPACE、WORD、CASEDの組み合わせ)
+    //  ロケールに依存しないように、unicode_table.hの表を引く
+    //---------------------------------------------------------------------
+    static uint8_t ctype(const wchar_t c)
+    {
+        return unicode::property(static_cast<uint32_t>(c));
+    }
+
+    //---------------------------------------------------------------------
+    //  「通常文字」の一致処理を大文字小文字の区別なく行う
+    //  tと大文字小文字の環でつながっている文字(k、K、K(ケルビン)など)を同じとみなす
+    //---------------------------------------------------------------------
+    int cmp_nocase(const wchar_t t, const wchar_t ch) const
+    {
+        if (!(ctype(t) & unicode::CASED))
+            return 0;
+        const uint32_t c = static_cast<uint32_t>(t);
+        for (uint32_t o = unicode::orbit(c); o != c; o = unicode::orbit(o)) {
+            if (o == static_cast<uint32_t>(ch))
+                return 1;
+        }
+        return 0;
+    }
+
+    //---------------------------------------------------------------------
+    //  文字クラスの範囲指定(「[a-z]など」)の一致処理を
+    //  大文字小文字の区別なく行う
+    //  targetと大文字小文字の環でつながっている文字が範囲に入っていれば一致とする
+    //---------------------------------------------------------------------
+    int cmp_nocase(const wchar_t start, const wchar_t end, const wchar_t target) const
+    {
+        if (!(ctype(target) & unicode::CASED))
+            return 0;
+        const uint32_t c = static_cast<uint32_t>(target);
+        for (uint32_t o = unicode::orbit(c); o != c; o = unicode::orbit(o)) {
+            if (static_cast<uint32_t>(start) <= o && o <= static_cast<uint32_t>(end))
+                return 1;
+        }
+        return 0;
+    }
+
+    //---------------------------------------------------------------------
+    //  文字クラス([], [^])内にある文字と比較する
+    //  一致した場合は1を返す。不一致なら0を返す
+    //---------------------------------------------------------------------
+    int char_class(const nfa_node* node, const wchar_t* text, const int option)
+    {
+        const wchar_t* s = node->val;
+        const int r = (s[0] == L'^');
+        for (intptr_t i = r; i < node->len; i++) {
+            if (s[i] == L'\\') {
+                if (escape(s + (++i), text, option) != -1)
+                    return 1 ^ r;
+            } else {
+                if (s[i + 1] == L'-' && s[i + 2] != L']') {
+                    wchar_t start = s[i];
+                    wchar_t end = s[i + 2];
+                    if (start <= *text && *text <= end)
+                        return 1 ^ r;
+                    if (option & regex_ptt::NOCASE && cmp_nocase(start, end, *text))
+                        return 1 ^ r;
+                    i += 2;
+                } else if (s[i] == L'.') {
+                    if (s[i] == *text)
+                        return 1 ^ r;
+                } else if (cmp_char(s + i, text, option)) {
+                    return 1 ^ r;
+                }
+            }
+        }
+        return r;
+    }
+
+    //---------------------------------------------------------------------
+    //  エスケープシーケンス
+    //  戻り値  :  失敗なら-1を返す。成功ならマッチした文字数を返す
+    //---------------------------------------------------------------------
+    intptr_t escape(const wchar_t* pattern, const wchar_t* text, const int option)
+    {
+        intptr_t val = -1;
+        switch (pattern[0]) {
+        case L't':  val = (L'\t' == *text);                             break;  //  水平タブ
+        case L'n':  val = (L'\n' == *text);                             break;  //  改行
+        case L'r':  val = (L'\r' == *text);                             break;  //  キャリッジリターン
+        case L'd':  val = (ctype(*text) & unicode::DIGIT) != 0;         break;  //  数字
+        case L'D':  val = *text && !(ctype(*text) & unicode::DIGIT);    break;  //  数字以外
+        case L's':  val = (ctype(*text) & unicode::SPACE) != 0;         break;  //  ホワイトスペース
+        case L'S':  val = *text && !(ctype(*text) & unicode::SPACE);    break;  //  ホワイトスペース以外
+        case L'w':  val = (ctype(*text) & unicode::WORD) != 0;          break;  //  英数字とアンダースコア
+        case L'W':  val = *text && !(ctype(*text) & unicode::WORD);     break;  //  英数字とアンダースコア以外
+        case L'.':  val = (text[0] == L'.');                            break;  //  文字リテラル「.」
+        case L'b':                                                              //  単語境界
+        case L'B': {                                                            //  単語境界以外
+            const bool before = text != input_head_ && (ctype(text[-1]) & unicode::WORD);
+            const bool after = text != input_end_ && (ctype(*text) & unicode::WORD);
+            return ((before != after) == (pattern[0] == L'b')) ? 0 : -1;
+        }
+        }   //  switch-caseの終端
+        if (val != -1)
+            return val == 0 ? -1 : 1;
+
+        if (iswdigit(pattern[0])) {
+            //  パターン内後方参照
+            int p = _wtoi(pattern);
+            if (p >= 1 && p < static_cast<int>(capture_.size()) && capture_[p].first >= 0) {
+                //  テキストの末尾(L'\0')を越えて読み進めないように一文字ずつ比べる
+                //  (置換表のキーにキャプチャの状態を含めているので、失敗しても置換表はそのまま使える)
+                const intptr_t len = static_cast<intptr_t>(capture_[p].second);
+                const wchar_t* ref = input_head_ + capture_[p].first;
+                intptr_t i = 0;
+                while (i < len && text[i] != L'\0' && text[i] == ref[i])
+                    i++;
+                if (i == len)
+                    return len;
+            }
+            return -1;
+        }
+
+        if (int n = cmp_char(pattern, text, option))
+            return n;
+
+        return -1;
+    }
+
+    //---------------------------------------------------------------------
+    //  正規表現探索時エラーメッセージの設定
+    //---------------------------------------------------------------------
+    void runtimeerror(const regex_result::errc code)
+    {
+        code_ = code;
+        what_ = regex_result::message(code);
+    }
+
+    //---------------------------------------------------------------------
+    //  置換表を初期化する
+    //---------------------------------------------------------------------
+    void table_clear()
+    {
+        if (table_ && !table_->empty())
+            table_->clear();        //  空の表をクリアしても、バケット配列の初期化が無駄になる
+        states_.clear();            //  状態番号は置換表のキーにしか使わない
+        state_ = -1;
+        for (auto& m : run_)
+            m.lo = -1, m.hi = -2;   //  失敗済みの範囲も置換表と同じ扱いなので初期化する
+    }
+
+    //---------------------------------------------------------------------
+    //  置換表のキーに含めるキャプチャの状態番号
+    //---------------------------------------------------------------------
+    //  後方参照の一致は、参照されるグループのキャプチャの値で変わる。同じノード、同じテキスト位置でも
+    //  その値が違えば結果が違うので、値の組に番号を振ってキーを分ける。後方参照のないパターンは常に0
+    //  番号を振った組がMAX_STATESに達したら、それ以降の新しい組はNO_STATEにして置換表に登録しない
+    //  (番号を振り直すと、呼び出し元が覚えている番号と食い違うので、表は開始位置を変える時に初期化する)
+    //---------------------------------------------------------------------
+    static constexpr int NO_STATE = -2;
+
+    int capture_state()
+    {
+        if (refs_ == nullptr)
+            return 0;
+        if (state_ < 0) {
+            state_key_.clear();
+            for (auto n : *refs_) {
+                if (n < static_cast<int>(capture_.size())) {
+                    state_key_.push_back(capture_[n].first);
+                    state_key_.push_back(static_cast<intptr_t>(capture_[n].second));
+                }
+            }
+            auto it = states_.find(state_key_);
+            if (it == states_.end()) {
+                if (states_.size() >= MAX_STATES) {
+                    state_ = NO_STATE;
+                    return state_;
+                }
+                it = states_.emplace(state_key_, static_cast<int>(states_.size())).first;
+            }
+            state_ = it->second;
+        }
+        return state_;
+    }
+};
+
+/**************************************************************************
+ *                                                                        *
+ *  複数の文字列や長いテキストをスレッドに分けて照合するクラス            *
+ *                                                                        *
+ **************************************************************************/
+//  文字列の並びをCHUNK個ずつ、長いテキストは区間に分けた塊にして、スレッド毎の待ち行列に配る。
+//  各スレッドは自分の待ち行列の後ろから塊を取り、空になれば他のスレッドの
+//  待ち行列の前から盗む(work stealing)。照合はスレッド毎のregex_pttで行い、
+//  その作業領域は塊をまたいで使い回す。呼び出したスレッドも0番のスレッドとして働く。
+//  スレッドはコンストラクタで作り、デストラクタで止める(呼び出し毎には作らない)。
+//  一つのregex_poolを同時に複数のスレッドから使わないこと
+//---------------------------------------------------------------------
+class regex_pool
+{
+public:
+    static constexpr size_t CHUNK = 1024;   //  塊の文字列数(64の倍数。ビット表の一語を二つのスレッドが書かないため)
+    static constexpr intptr_t TEXT_CHUNK = 1 << 16;     //  一つのテキストを分ける区間の最小の文字数
+
+    //---------------------------------------------------------------------
+    //  コンストラクタ
+    //  threads  :  スレッド数(呼び出したスレッドを含む)。0ならCPUのコア数
+    //---------------------------------------------------------------------
+    explicit regex_pool(unsigned threads = 0)
+    {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < threads; i++)
+            workers_.emplace_back();
+        for (unsigned i = 1; i < threads; i++)
+            workers_[i].thread = std::thread([this, i] { loop(i); });
+    }
+
+    ~regex_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& w : workers_) {
+            if (w.thread.joinable())
+                w.thread.join();
+        }
+    }
+
+    unsigned size() const { return static_cast<unsigned>(workers_.size()); }   //  スレッド数
+    const std::wstring& error() const { return what_; }     //  最初に起きたエラーのメッセージ
+
+    //---------------------------------------------------------------------
+    //  複数の文字列を同じパターンで照合し、一致した文字列のビット表を返す
+    //  引数と戻り値の意味はregex_ptt::test(複数の文字列版)と同じ
+    //---------------------------------------------------------------------
+    std::vector<uint64_t> test(const std::wstring_view* records, const size_t count, const regex_compiled& re, const int options = 0)
+    {
+        std::vector<uint64_t> selection((count + 63) / 64);
+        run((count + CHUNK - 1) / CHUNK, [&](regex_ptt& ptt, const size_t c) {
+            const size_t begin = c * CHUNK;
+            ptt.test(records + begin, std::min(count - begin, CHUNK), re, options, selection.data() + begin / 64);
+        });
+        return selection;
+    }
+
+    //---------------------------------------------------------------------
+    //  複数の文字列を同じパターンで照合し、文字列毎の一致した位置と長さを返す
+    //  引数と戻り値の意味はregex_ptt::match(複数の文字列版)と同じ
+    //---------------------------------------------------------------------
+    std::vector<std::pair<intptr_t, size_t>> match(const std::wstring_view* records, const size_t count, const regex_compiled& re, const int options = 0)
+    {
+        std::vector<std::pair<intptr_t, size_t>> offsets(count);
+        run((count + CHUNK - 1) / CHUNK, [&](regex_ptt& ptt, const size_t c) {
+            const size_t begin = c * CHUNK;
+            ptt.match(records + begin, std::min(count - begin, CHUNK), re, options, offsets.data() + begin);
+        });
+        return offsets;
+    }
+
+    //---------------------------------------------------------------------
+    //  一つの長いテキストを区間に分けて並列に検索し、全ての一致を前から順に返す
+    //---------------------------------------------------------------------
+    //  text    :  検索対象の文字列
+    //  re      :  コンパイルされた正規表現オブジェクト
+    //  option  :  探索オプション(regex_ptt::SEARCHを指定しなくても部分一致で探す)
+    //  size    :  textの文字数(text[size]はL'\0'であること)。負の値ならwcslenで求める
+    //  戻り値  :  一致の結果の並び。regex_ptt::matchを、前の一致の末尾(空の一致なら次の位置)
+    //             から繰り返し呼んだ場合と同じ一致になる。エラーならerror関数で確認できる
+    //---------------------------------------------------------------------
+    //  各スレッドは区間の先頭から、開始位置が区間内にある一致を順に求める(照合はテキスト全体に
+    //  対して行うので、一致は区間の外へはみ出してもよい)。前の区間の最後の一致が区間の先頭を
+    //  またぐと、区間の先頭から始めたスレッドの一致は本来の一致とずれることがある。そこで
+    //  まとめる時に本来の探索位置を前から順にたどり、その位置を含む探索(探索位置～一致の
+    //  開始位置)でスレッドが求めた一致はそのまま採り、そうでなければ照合し直す。
+    //  一致の開始位置が同じなら一致の範囲もキャプチャも同じなので、一度揃えばそれ以降は一致する
+    //---------------------------------------------------------------------
+    std::vector<regex_result> match_all(const wchar_t* text, const regex_compiled& re, int options = 0, intptr_t size = -1)
+    {
+        std::vector<regex_result> ret;
+        what_.clear();
+        if (re.get() == nullptr)
+            return ret;
+        options |= regex_ptt::SEARCH;
+        if (size < 0)
+            size = wcslen(text);
+
+        //  区間[begin, end)。最後の区間はテキスト末尾の空の一致のためにsizeを含める
+        const intptr_t width = std::max<intptr_t>(TEXT_CHUNK, (size + size_t(4) * workers_.size() - 1) / (size_t(4) * workers_.size()));
+        const size_t chunks = static_cast<size_t>(size / width) + 1;
+        auto range = [width, size](const size_t c) {
+            const intptr_t begin = static_cast<intptr_t>(c) * width;
+            return std::make_pair(begin, std::min(begin + width, size + 1));
+        };
+        //  次の探索位置(空の一致は一つ進める)
+        auto next = [](const regex_result& r) {
+            return r.position(0) + static_cast<intptr_t>(r.length(0)) + (r.length(0) == 0);
+        };
+
+        struct piece {
+            std::vector<std::pair<intptr_t, regex_result>> found;   //  探索位置と、そこから求めた一致
+            intptr_t rest = 0;                                      //  これより後には区間内の一致が無い探索位置
+        };
+        std::vector<piece> pieces(chunks);
+        run(chunks, [&](regex_ptt& ptt, const size_t c) {
+            auto r = range(c);
+            auto& pc = pieces[c];
+            intptr_t seek = r.first;
+            while (seek < r.second) {
+                auto res = ptt.match_until(text, re, options, seek, size, r.second - 1);
+                if (!res)
+                    break;
+                const intptr_t to = next(res);
+                pc.found.emplace_back(seek, std::move(res));
+                seek = to;
+            }
+            pc.rest = seek;
+        });
+        if (!what_.empty())
+            return ret;
+
+        //  本来の探索位置(q)をたどりながらまとめる
+        regex_ptt& ptt = workers_[0].ptt;
+        intptr_t q = 0;
+        for (size_t c = 0; c < chunks && q <= size; c++) {
+            auto r = range(c);
+            auto& found = pieces[c].found;
+            size_t k = 0;
+            q = std::max(q, r.first);       //  前の区間の一致の後、この区間の先頭までには一致が無い
+            while (q < r.second) {
+                while (k < found.size() && found[k].second.position(0) < q)
+                    k++;                    //  前の一致と重なる(本来は求めない)一致
+                regex_result res;
+                if (k < found.size() && found[k].first <= q) {
+                    res = std::move(found[k++].second);
+                } else if (k == found.size() && pieces[c].rest <= q) {
+                    break;
+                } else {
+                    res = ptt.match_until(text, re, options, q, size, r.second - 1);
+                    if (!ptt.error().empty()) {
+                        what_ = ptt.error();
+                        return ret;
+                    }
+                    if (!res)
+                        break;
+                }
+                q = next(res);
+                ret.push_back(std::move(res));
+            }
+        }
+        return ret;
+    }
+
+private:
+    regex_pool(const regex_pool&) = delete;
+    regex_pool& operator=(const regex_pool&) = delete;
+
+    struct worker {
+        std::thread        thread;
+        std::mutex         lock;        //  queueを守る
+        std::deque<size_t> queue;       //  塊の番号
+        regex_ptt          ptt;         //  このスレッドの照合器
+        std::wstring       what;        //  このスレッドで起きたエラー
+        std::exception_ptr thrown;      //  このスレッドで投げられた例外(bad_allocなど)
+    };
+
+    //---------------------------------------------------------------------
+    //  chunks個の塊をスレッドに配り、全て終わるまで待つ
+    //  fnc(ptt, c)  :  c番目の塊を照合する
+    //---------------------------------------------------------------------
+    //  照合中に投げられた例外はスレッドの中で捕まえ(そのままではstd::terminateになる)、
+    //  全てのスレッドが終わった後で呼び出したスレッドに投げ直す
+    //---------------------------------------------------------------------
+    template<typename F>
+    void run(const size_t chunks, F&& fnc)
+    {
+        for (size_t c = 0; c < chunks; c++) {
+            auto& w = workers_[c % workers_.size()];
+            std::lock_guard<std::mutex> lock(w.lock);
+            w.queue.push_back(c);
+        }
+        for (auto& w : workers_) {
+            w.what.clear();
+            w.thrown = nullptr;
+        }
+        failed_ = false;
+        job_ = [&fnc, this](worker& w, const size_t c) {
+            if (failed_)
+                return;         //  エラーが起きたら残りの塊は照合しない
+            try {
+                fnc(w.ptt, c);
+            } catch (...) {
+                if (!w.thrown)
+                    w.thrown = std::current_exception();
+                failed_ = true;
+                return;
+            }
+            if (!w.ptt.error().empty() && w.what.empty()) {
+                w.what = w.ptt.error();
+                failed_ = true;
+            }
+        };
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            busy_ = size() - 1;
+            generation_++;
+        }
+        wake_.notify_all();
+        work(0);
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            idle_.wait(lock, [this] { return busy_ == 0; });
+        }
+        what_.clear();
+        for (auto& w : workers_) {
+            if (w.thrown)
+                std::rethrow_exception(w.thrown);
+            if (what_.empty())
+                what_ = w.what;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  0番以外のスレッドの本体。仕事が配られるのを待ち、取れる塊が無くなるまで照合する
+    //---------------------------------------------------------------------
+    void loop(const unsigned i)
+    {
+        size_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_)
+                    return;
+                seen = generation_;
+            }
+            work(i);
+            std::lock_guard<std::mutex> lock(lock_);
+            if (--busy_ == 0)
+                idle_.notify_one();
+        }
+    }
+
+    void work(const unsigned i)
+    {
+        size_t c;
+        while (take(i, c))
+            job_(workers_[i], c);
+    }
+
+    //---------------------------------------------------------------------
+    //  塊を一つ取る。自分の待ち行列は後ろから、他のスレッドの待ち行列は前から取る
+    //---------------------------------------------------------------------
+    bool take(const unsigned i, size_t& c)
+    {
+        for (size_t k = 0; k < workers_.size(); k++) {
+            auto& w = workers_[(i + k) % workers_.size()];
+            std::lock_guard<std::mutex> lock(w.lock);
+            if (w.queue.empty())
+                continue;
+            if (k == 0) {
+                c = w.queue.back();
+                w.queue.pop_back();
+            } else {
+                c = w.queue.front();
+                w.queue.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    std::deque<worker>      workers_;           //  スレッド毎の待ち行列と照合器([0]は呼び出したスレッド)
+    std::function<void(worker&, size_t)> job_;  //  塊を一つ照合する
+    std::mutex              lock_;              //  以下の三つを守る
+    size_t                  generation_ = 0;    //  仕事を配った回数
+    unsigned                busy_ = 0;          //  仕事中の(0番以外の)スレッドの数
+    bool                    stop_ = false;      //  スレッドを止める
+    std::condition_variable wake_;              //  仕事を配ったか、止める
+    std::condition_variable idle_;              //  全てのスレッドが仕事を終えた
+    std::atomic<bool>       failed_{ false };   //  いずれかのスレッドでエラーが起きた
+    std::wstring            what_;              //  エラーメッセージ
+};
+
+/**************************************************************************
+ *                                                                        *
+ *  少しずつ届くテキストを探索するクラス                                  *
+ *                                                                        *
+ **************************************************************************/
+//  ソケットやパイプ、メモリに載らない大きなファイルのように、テキストを塊毎に受け取って
+//  探索する。一致は結果が確定した(後に続く入力で変わらない)ものから順に返し、位置は
+//  ストリームの先頭からの文字数で表す。テキスト全体にregex_ptt::match(regex_ptt::SEARCH)を、
+//  前の一致の末尾(空の一致なら次の位置)から繰り返し呼んだ場合と同じ一致になる。
+//  保持するのは、まだ結果が確定していない開始位置以降と、その直前の一文字(行頭と単語境界の
+//  判定に使う)だけ。ストリームの長さには比例しない。ただし後方参照を含みマッチ長に上限の
+//  無いパターンは、finishまで一致が確定しないので全て保持する
+//---------------------------------------------------------------------
+class regex_stream
+{
+public:
+    //---------------------------------------------------------------------
+    //  コンストラクタ
+    //  re      :  コンパイルされた正規表現オブジェクト(regex_streamより長く生きていること)
+    //  option  :  探索オプション(regex_ptt::SEARCHを指定しなくても部分一致で探す)
+    //---------------------------------------------------------------------
+    explicit regex_stream(const regex_compiled& re, const int options = 0)
+        : re_(re), options_(options | regex_ptt::SEARCH)
+    {
+    }
+
+    //---------------------------------------------------------------------
+    //  パターンが必要とする履歴の文字数
+    //  戻り値  :  一致の途中で保持しておく文字数の上限(直前の一文字を含む)。-1なら上限が無い
+    //---------------------------------------------------------------------
+    //  「.*」のような繰り返しの後に照合が続くパターンは上限が無い。ただし実際に保持するのは
+    //  照合が末尾まで届いている開始位置以降だけなので、「.」が改行に一致しないパターンなら
+    //  一行分に収まる
+    //---------------------------------------------------------------------
+    intptr_t history() const
+    {
+        return re_.max_length() < 0 ? -1 : re_.max_length() + 1;
+    }
+
+    size_t buffered() const { return buffer_.size(); }          //  保持している文字数
+    intptr_t position() const { return base_ + static_cast<intptr_t>(buffer_.size()); }    //  受け取った文字数
+    const std::wstring& error() const { return what_; }         //  エラーメッセージ
+
+    //---------------------------------------------------------------------
+    //  テキストの続きを渡す
+    //  data    :  続きのテキスト(L'\0'で終わっていなくてよい)。呼び出しから戻れば手放してよい
+    //  戻り値  :  新たに確定した一致の並び
+    //---------------------------------------------------------------------
+    //  dataはその場で探索し、写すのは前の続きとの境目だけにする。まず前の続きに残っている
+    //  開始位置がdataの先頭まで確定するよう、dataの先頭を少しずつ(SEAM、その倍、…)
+    //  buffer_へ写して探索する。残りはdataのまま探索し、確定しなかった末尾だけを写しておく。
+    //  その場で探索するのは結果が確定した開始位置だけで、その照合はdataの末尾に届かない
+    //  (末尾の先は読まない)。dataの先頭の直前の文字は見えないので、先頭は境目で確定させる
+    //---------------------------------------------------------------------
+    std::vector<regex_result> feed(const wchar_t* data, const size_t size)
+    {
+        std::vector<regex_result> ret;
+        if (re_.get() == nullptr || !what_.empty())
+            return ret;
+        const intptr_t at = position();         //  dataの先頭のストリームの位置
+        size_t used = 0;                        //  buffer_へ写したdataの文字数
+        if (at > 0) {
+            for (size_t step = SEAM; base_ + seek_ <= at && used < size && what_.empty(); step *= 2) {
+                const size_t n = std::min(step, size - used);
+                buffer_.append(data + used, n);
+                used += n;
+                scan(buffer_.c_str(), static_cast<intptr_t>(buffer_.size()), base_, seek_, false, ret);
+                compact();
+            }
+            if (used == size || !what_.empty())
+                return ret;
+        }
+
+        //  dataのまま探索する
+        intptr_t seek = base_ + seek_ - at;
+        scan(data, static_cast<intptr_t>(size), at, seek, false, ret);
+        const intptr_t keep = std::max<intptr_t>(seek - 1, 0);     //  確定していない部分と直前の一文字
+        buffer_.assign(data + keep, size - keep);
+        base_ = at + keep;
+        seek_ = seek - keep;
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  ストリームの終わりを伝える
+    //  戻り値  :  残りの一致の並び。その後は新しいストリームを受け取れる
+    //---------------------------------------------------------------------
+    std::vector<regex_result> finish()
+    {
+        std::vector<regex_result> ret;
+        if (re_.get() != nullptr && what_.empty())
+            scan(buffer_.c_str(), static_cast<intptr_t>(buffer_.size()), base_, seek_, true, ret);
+        reset();
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  受け取ったテキストを捨てて、新しいストリームを始める
+    //---------------------------------------------------------------------
+    void reset()
+    {
+        buffer_.clear();
+        base_ = 0;
+        seek_ = 0;
+        what_.clear();
+        carry_.from = -1;
+        carry_.threads.clear();
+    }
+
+    //---------------------------------------------------------------------
+    //  分かれた文字列(ロープ、ギャップバッファ、iovecなど)を一つのテキストとして探索する
+    //  segments  :  テキストを前から順に分けた文字列の並び(L'\0'で終わっていなくてよい)
+    //  count     :  segmentsの数
+    //  戻り値    :  一致の結果の並び。位置はテキスト全体の先頭からの文字数
+    //---------------------------------------------------------------------
+    //  つないだテキストにregex_ptt::match(regex_ptt::SEARCH)を繰り返し呼んだ場合と同じ一致になる。
+    //  受け取ったテキストは捨てて始める。写すのはfeedと同じく境目の付近だけ
+    //---------------------------------------------------------------------
+    std::vector<regex_result> match_all(const std::wstring_view* segments, const size_t count)
+    {
+        reset();
+        std::vector<regex_result> ret;
+        for (size_t i = 0; i < count && what_.empty(); i++) {
+            auto v = feed(segments[i].data(), segments[i].size());
+            std::move(v.begin(), v.end(), std::back_inserter(ret));
+        }
+        auto v = finish();
+        std::move(v.begin(), v.end(), std::back_inserter(ret));
+        return ret;
+    }
+
+private:
+    static constexpr size_t SEAM = 64;      //  境目で最初に写す文字数
+
+    regex_stream(const regex_stream&) = delete;
+    regex_stream& operator=(const regex_stream&) = delete;
+
+    //---------------------------------------------------------------------
+    //  head[0, size)で、開始位置がseek以降の確定した一致を求めてretに加える
+    //  base    :  head[0]のストリームの位置
+    //  seek    :  探索位置。次の探索位置(これより前から始まる一致は確定した)を返す
+    //  last    :  headの末尾がストリームの終わり(head[size]はL'\0'であること)
+    //---------------------------------------------------------------------
+    void scan(const wchar_t* head, const intptr_t size, const intptr_t base, intptr_t& seek, const bool last, std::vector<regex_result>& ret)
+    {
+        while (seek <= size) {
+            //  開始位置がbound以前の一致は確定している
+            const intptr_t bound = last ? size : settled(head, size, base, seek) - 1;
+            if (bound < seek)
+                break;
+            if (!last && re_.end_anchored()) {
+                seek = bound + 1;       //  ストリームの終わりでしか一致しない
+                break;
+            }
+            const wchar_t* text = head;
+            const wchar_t* end = ptt_.locate(text, re_, options_, seek, size, bound);
+            if (!ptt_.error().empty()) {
+                what_ = ptt_.error();
+                break;
+            }
+            if (end == nullptr) {
+                seek = bound + 1;       //  bound以前から始まる一致は無い
+                break;
+            }
+            //  キャプチャの位置をストリームの先頭からの位置にする
+            auto capture = ptt_.capture_;
+            capture[0] = { text - head, static_cast<size_t>(end - text) };
+            for (auto& c : capture) {
+                if (c.first >= 0)
+                    c.first += base;
+            }
+            ret.emplace_back();
+            ret.back().set(capture);
+            seek = (end - head) + (end == text);
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  head[0, size)で、結果が確定している開始位置の範囲を求める(regex_ptt::settledを参照)
+    //---------------------------------------------------------------------
+    //  結果が確定しない間は、同じ探索位置で延びていくテキストを何度も調べることになるので、
+    //  前の呼び出しで末尾に届いた要素(carry_)を引き継いで、延びた部分だけを進める。
+    //  carry_の位置はストリームの先頭から数え、探索位置が変わったら捨てる
+    //---------------------------------------------------------------------
+    intptr_t settled(const wchar_t* head, const intptr_t size, const intptr_t base, const intptr_t seek)
+    {
+        if (carry_.from >= 0 && carry_seek_ == base + seek && carry_.from > base && carry_.from <= base + size) {
+            carry_.from -= base;
+            for (auto& t : carry_.threads)
+                t.start -= base;
+        } else {
+            carry_.from = -1;
+            carry_.threads.clear();
+        }
+        const intptr_t ret = ptt_.settled(head, re_, options_, seek, size, &carry_);
+        if (ret < 0 || carry_.from < 0) {
+            carry_.from = -1;
+            return ret;
+        }
+        carry_.from += base;
+        for (auto& t : carry_.threads)
+            t.start += base;
+        carry_seek_ = base + seek;
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  buffer_の、探索位置の直前の一文字より前を捨てる
+    //  残す部分より多く捨てられる時にまとめて詰める
+    //---------------------------------------------------------------------
+    void compact()
+    {
+        const intptr_t drop = std::min<intptr_t>(seek_, buffer_.size()) - 1;
+        if (drop > 0 && drop * 2 >= static_cast<intptr_t>(buffer_.size())) {
+            buffer_.erase(0, drop);
+            base_ += drop;
+            seek_ -= drop;
+        }
+    }
+
+    const regex_compiled& re_;
+    const int             options_;
+    regex_ptt             ptt_;
+    std::wstring          buffer_;          //  結果が確定していない部分(と、その直前の一文字)
+    intptr_t              base_ = 0;        //  buffer_の先頭のストリームの先頭からの位置
+    intptr_t              seek_ = 0;        //  次の探索位置(buffer_の先頭から)
+    regex_ptt::scan_end   carry_;           //  前のsettledで末尾に届いた要素(位置はストリームの先頭から)
+    intptr_t              carry_seek_ = -1; //  carry_を求めた時の探索位置(ストリームの先頭から)
+    std::wstring          what_;            //  エラーメッセージ
+};
+
+/**************************************************************************
+ *                                                                        *
+ *  編集されるテキストの一致を、編集毎に差分だけ照合し直すクラス          *
+ *                                                                        *
+ **************************************************************************/
+//  テキストをおよそCHECKPOINT文字ずつのブロックに分け、ブロック毎に、そこから始まる一致と、
+//  ブロックの先頭での状態集合(regex_ptt::forward_scanの途中の要素)を残しておく。位置は
+//  ブロックの先頭からの相対位置で持つので、編集より後のブロックは先頭をずらすだけでよい。
+//  編集があると
+//  ・編集位置を含むブロックの状態集合から編集位置まで進め、編集位置に届く(結果が変わり得る)
+//    最も前の開始位置を求める。それより前から始まる一致はそのまま残す
+//  ・そこから照合し直し、編集した範囲を過ぎて、探索位置が編集前の一致の途中でなくなった
+//    ところで止める(そこから先は、編集前の一致をずらしたものになる)
+//  ・ブロックの先頭の状態集合を、編集前と同じになるところまで求め直す
+//  一回の編集の手間は、編集の大きさと、その前後で照合し直す範囲(ブロック一つ程度)で決まり、
+//  テキストの長さに比例するのは、後のブロックの先頭をずらす手間だけになる。
+//  状態集合で探索できないパターン(後方参照を含むものなど)は、マッチ長の上限から照合し直す範囲を求める
+//  (上限が無ければ先頭から照合し直す)
+//---------------------------------------------------------------------
+class regex_incremental
+{
+public:
+    static constexpr intptr_t CHECKPOINT = 4096;    //  ブロックの文字数(状態集合を残す間隔)
+
+    //---------------------------------------------------------------------
+    //  コンストラクタ
+    //  re      :  コンパイルされた正規表現オブジェクト(regex_incrementalより長く生きていること)
+    //  option  :  探索オプション(regex_ptt::SEARCHを指定しなくても部分一致で探す)
+    //---------------------------------------------------------------------
+    explicit regex_incremental(const regex_compiled& re, const int options = 0)
+        : re_(re), options_((options | regex_ptt::SEARCH) & ~regex_ptt::PARTIAL),
+          ncap_((options & regex_ptt::NOCAPTURE) && !re.has_backref() ? 1 : static_cast<size_t>(re.capture()))
+    {
+    }
+
+    size_t size() const { return count_; }                      //  一致の数
+    intptr_t length() const { return size_; }                   //  テキストの文字数
+    const std::wstring& error() const { return what_; }         //  エラーメッセージ
+    std::pair<intptr_t, intptr_t> rescanned() const { return rescan_; }    //  直前のassign、editで照合し直した範囲[first, second)
+
+    //---------------------------------------------------------------------
+    //  テキスト全体を照合する
+    //  text    :  検索対象の文字列
+    //  size    :  textの文字数(text[size]はL'\0'であること)。負の値ならwcslenで求める
+    //---------------------------------------------------------------------
+    void assign(const wchar_t* text, intptr_t size = -1)
+    {
+        if (size < 0)
+            size = wcslen(text);
+        clear();
+        what_.clear();
+        if (re_.get() == nullptr)
+            return;
+        std::vector<piece> pieces;
+        for (intptr_t b = 0; b == 0 || b < size; b += CHECKPOINT) {
+            pieces.push_back({ b, {} });
+            if (b > 0)
+                pieces.back().threads = step(text, pieces[pieces.size() - 2], b);
+        }
+        Capture found;
+        for (intptr_t q = 0; q <= size && what_.empty(); )
+            q = find(text, size, q, size, found);
+        if (!what_.empty())
+            return;
+        rebuild(0, 0, pieces, found, 0);
+        size_ = size;
+        rescan_ = { 0, size };
+    }
+
+    //---------------------------------------------------------------------
+    //  テキストの編集を反映する
+    //  text      :  編集後のテキスト全体
+    //  size      :  textの文字数(text[size]はL'\0'であること)。負の値ならwcslenで求める
+    //  pos       :  編集した位置
+    //  removed   :  posから削除した(置き換える前の)文字数
+    //  inserted  :  posに挿入した(置き換えた後の)文字数
+    //---------------------------------------------------------------------
+    void edit(const wchar_t* text, intptr_t size, const intptr_t pos, const intptr_t removed, const intptr_t inserted)
+    {
+        if (size < 0)
+            size = wcslen(text);
+        if (blocks_.empty()) {
+            assign(text, size);
+            return;
+        }
+        what_.clear();
+        const intptr_t delta = inserted - removed;
+        if (pos < 0 || removed < 0 || inserted < 0 || pos + removed > size_ || size != size_ + delta) {
+            what_ = L"edit does not match the text.";
+            clear();
+            return;
+        }
+        const intptr_t old_end = pos + removed;     //  編集前のテキストでの、編集した範囲の末尾
+        const intptr_t new_end = pos + inserted;    //  編集後のテキストでの、編集した範囲の末尾
+
+        //  結果が変わり得る最も前の開始位置(u)を求める
+        const size_t j = block_at(pos);
+        const intptr_t from = blocks_[j].begin;     //  状態集合から進め始める位置
+        intptr_t u = pos;
+        if (re_.graph()) {
+            regex_ptt::scan_end end;
+            end.from = from;
+            end.threads = absolute(blocks_[j]);
+            ptt_.setup(text, re_, options_, end.from, pos);
+            ptt_.forward_scan(*re_.graph(), pos, end.from, pos - 1, options_, false, &end);
+            u = std::min(end.hit, pos);
+        } else {
+            u = re_.max_length() < 0 ? 0 : std::max<intptr_t>(pos - re_.max_length(), 0);
+        }
+
+        //  uより前から始まる一致は残して、そこから照合し直す
+        const size_t first = block_at(u);
+        const block& bf = blocks_[first];
+        Capture found;
+        intptr_t q = bf.begin + bf.carry;
+        for (size_t i = 0; i < bf.capture.size() && bf.begin + bf.capture[i].first < u; i += ncap_) {
+            append(found, bf, i, 0);
+            q = next(found, found.size() - ncap_);
+        }
+        q = std::max(q, u);
+        const intptr_t restart = q;
+
+        //  編集した範囲を過ぎた位置qは、編集前の位置x(q - delta)に当たる。xが編集前の一致の
+        //  途中でなければ(その前の一致の次の探索位置sがx以前)、そこから先は編集前と同じになる
+        size_t tail = blocks_.size();       //  そのまま使う編集前の一致(ブロックと、その中の位置)
+        size_t tail_at = 0;
+        while (q <= size) {
+            intptr_t bound = new_end;
+            if (q > new_end) {
+                const intptr_t x = q - delta;
+                const size_t b = block_at(x);
+                const block& bb = blocks_[b];
+                intptr_t s = bb.begin + bb.carry;
+                size_t i = 0;
+                for (; i < bb.capture.size() && bb.begin + bb.capture[i].first < x; i += ncap_)
+                    s = bb.begin + next(bb.capture, i);
+                if (s <= x) {
+                    tail = b;
+                    tail_at = i;
+                    break;
+                }
+                bound = s + delta - 1;      //  編集前に読み飛ばした範囲
+            }
+            q = find(text, size, q, bound, found);
+            if (!what_.empty()) {
+                clear();
+                return;
+            }
+        }
+        intptr_t reach = std::min(q, size);     //  照合し直した範囲の末尾
+
+        //  ブロックの先頭と状態集合を求め直す
+        //  編集位置を含むブロックまでは先頭の状態集合が変わらない。そこから、編集前のブロックの
+        //  先頭までをCHECKPOINT毎に区切り、その後は編集前のブロックの先頭を使う。
+        //  状態集合が編集前と同じになり、一致も編集前と同じになったブロックからは、そのまま使う
+        std::vector<piece> pieces;
+        for (size_t k = first; k <= j; k++)
+            pieces.push_back({ blocks_[k].begin, absolute(blocks_[k]) });
+        size_t until = j + 1;               //  次に調べる編集前のブロック
+        while (until < blocks_.size() &&
+               (blocks_[until].begin < old_end || blocks_[until].begin + delta < blocks_[j].begin + CHECKPOINT / 2))
+            until++;                        //  削除した範囲や、短くなりすぎたブロックは除く
+        const intptr_t limit = until < blocks_.size() ? blocks_[until].begin + delta - CHECKPOINT / 2 : size;
+        for (intptr_t b = blocks_[j].begin + CHECKPOINT; b < limit; b += CHECKPOINT) {
+            pieces.push_back({ b, step(text, pieces.back(), b) });
+            reach = std::max(reach, b);
+        }
+        bool converged = !re_.graph();
+        for (; until < blocks_.size(); until++) {
+            const block& bk = blocks_[until];
+            const intptr_t b = bk.begin + delta;
+            auto threads = absolute(bk, delta);
+            if (!converged) {
+                auto t = step(text, pieces.back(), b);
+                reach = std::max(reach, b);
+                converged = t == threads;
+                threads.swap(t);
+            }
+            if (converged && q - delta <= bk.begin)
+                break;
+            pieces.push_back({ b, std::move(threads) });
+        }
+
+        //  作り直すブロックに入る、編集前の一致
+        for (size_t b = tail; b < until; b++) {
+            const block& bb = blocks_[b];
+            for (size_t i = (b == tail ? tail_at : 0); i < bb.capture.size(); i += ncap_)
+                append(found, bb, i, delta);
+        }
+        rebuild(first, until, pieces, found, delta);
+        size_ = size;
+        rescan_ = { std::min(restart, from), reach };
+    }
+
+    //---------------------------------------------------------------------
+    //  開始位置が[begin, end)の一致を返す
+    //---------------------------------------------------------------------
+    std::vector<regex_result> matches(const intptr_t begin = 0, const intptr_t end = PTRDIFF_MAX) const
+    {
+        std::vector<regex_result> ret;
+        Capture capture(ncap_);
+        for (size_t b = blocks_.empty() ? 0 : block_at(begin); b < blocks_.size() && blocks_[b].begin < end; b++) {
+            const block& bb = blocks_[b];
+            for (size_t i = 0; i < bb.capture.size(); i += ncap_) {
+                const intptr_t p = bb.begin + bb.capture[i].first;
+                if (p < begin)
+                    continue;
+                if (p >= end)
+                    break;
+                for (size_t k = 0; k < ncap_; k++) {
+                    capture[k] = bb.capture[i + k];
+                    if (capture[k].first >= 0)
+                        capture[k].first += bb.begin;
+                }
+                ret.emplace_back();
+                ret.back().set(capture);
+            }
+        }
+        return ret;
+    }
+
+private:
+    using Capture = std::vector<std::pair<intptr_t, size_t>>;
+    using Threads = std::vector<regex_ptt::thread>;
+
+    regex_incremental(const regex_incremental&) = delete;
+    regex_incremental& operator=(const regex_incremental&) = delete;
+
+    //---------------------------------------------------------------------
+    //  ブロック
+    //---------------------------------------------------------------------
+    struct block {
+        intptr_t begin;                 //  先頭の位置
+        intptr_t carry;                 //  前のブロックまでの一致の次の探索位置が先頭より後なら、その差(それ以外は0)
+        Threads  threads;               //  先頭での状態集合(開始位置はbeginからの相対位置)
+        Capture  capture;               //  開始位置がこのブロックにある一致のキャプチャ(一致毎にncap_個。位置はbeginからの相対位置)
+    };
+    struct piece {                      //  作り直すブロックの先頭と状態集合(開始位置はテキストの先頭から)
+        intptr_t begin;
+        Threads  threads;
+    };
+
+    //---------------------------------------------------------------------
+    //  posを含むブロックの番号
+    //---------------------------------------------------------------------
+    size_t block_at(const intptr_t pos) const
+    {
+        auto it = std::upper_bound(blocks_.begin(), blocks_.end(), pos, [](intptr_t p, const block& b) { return p < b.begin; });
+        return it == blocks_.begin() ? 0 : static_cast<size_t>(it - blocks_.begin()) - 1;
+    }
+
+    //---------------------------------------------------------------------
+    //  capture[i]から始まる一致の次の探索位置
+    //---------------------------------------------------------------------
+    static intptr_t next(const Capture& capture, const size_t i)
+    {
+        return capture[i].first + static_cast<intptr_t>(capture[i].second) + (capture[i].second == 0);
+    }
+
+    //---------------------------------------------------------------------
+    //  ブロックの状態集合の開始位置を、テキストの先頭からの位置(deltaだけずらす)にする
+    //---------------------------------------------------------------------
+    Threads absolute(const block& b, const intptr_t delta = 0) const
+    {
+        Threads ret(b.threads);
+        for (auto& t : ret)
+            t.start += b.begin + delta;
+        return ret;
+    }
+
+    //---------------------------------------------------------------------
+    //  ブロックbのi番目の一致を、テキストの先頭からの位置(deltaだけずらす)にしてcaptureに加える
+    //---------------------------------------------------------------------
+    void append(Capture& capture, const block& b, const size_t i, const intptr_t delta) const
+    {
+        for (size_t k = 0; k < ncap_; k++) {
+            capture.push_back(b.capture[i + k]);
+            if (capture.back().first >= 0)
+                capture.back().first += b.begin + delta;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  fromの状態集合から位置toまで進めて、toでの状態集合を求める
+    //---------------------------------------------------------------------
+    Threads step(const wchar_t* text, const piece& from, const intptr_t to)
+    {
+        regex_ptt::scan_end end;
+        if (!re_.graph())
+            return end.threads;
+        end.from = from.begin;
+        end.threads = from.threads;
+        ptt_.setup(text, re_, options_, from.begin, to);
+        ptt_.forward_scan(*re_.graph(), to, from.begin, to - 1, options_, false, &end);
+        return std::move(end.threads);
+    }
+
+    //---------------------------------------------------------------------
+    //  開始位置が[seek, bound]の最も前の一致を探してfoundに加える
+    //  戻り値  :  次の探索位置。一致しなければbound + 1
+    //---------------------------------------------------------------------
+    intptr_t find(const wchar_t* head, const intptr_t size, const intptr_t seek, const intptr_t bound, Capture& found)
+    {
+        const wchar_t* text = head;
+        const wchar_t* end = ptt_.locate(text, re_, options_, seek, size, bound);
+        if (!ptt_.error().empty()) {
+            what_ = ptt_.error();
+            return size + 1;
+        }
+        if (end == nullptr)
+            return bound + 1;
+        const size_t n = found.size();
+        found.insert(found.end(), ptt_.capture_.begin(), ptt_.capture_.end());
+        found.resize(n + ncap_, std::pair<intptr_t, size_t>(-1, 0));
+        found[n] = { text - head, static_cast<size_t>(end - text) };
+        return (end - head) + (end == text);
+    }
+
+    //---------------------------------------------------------------------
+    //  blocks_[first, until)を、piecesの区切りとfoundの一致(テキストの先頭からの位置)で作り直す
+    //  後のブロックの先頭をdeltaだけずらし、carryを求め直す
+    //---------------------------------------------------------------------
+    void rebuild(const size_t first, const size_t until, std::vector<piece>& pieces, const Capture& found, const intptr_t delta)
+    {
+        for (size_t b = first; b < until; b++)
+            count_ -= blocks_[b].capture.size() / ncap_;
+        count_ += found.size() / ncap_;
+
+        std::vector<block> fresh(pieces.size());
+        size_t i = 0;
+        for (size_t k = 0; k < pieces.size(); k++) {
+            block& b = fresh[k];
+            b.begin = pieces[k].begin;
+            b.carry = 0;
+            b.threads.swap(pieces[k].threads);
+            for (auto& t : b.threads)
+                t.start -= b.begin;
+            for (; i < found.size() && (k + 1 == pieces.size() || found[i].first < pieces[k + 1].begin); i += ncap_) {
+                for (size_t c = 0; c < ncap_; c++) {
+                    b.capture.push_back(found[i + c]);
+                    if (b.capture.back().first >= 0)
+                        b.capture.back().first -= b.begin;
+                }
+            }
+        }
+        blocks_.erase(blocks_.begin() + first, blocks_.begin() + until);
+        blocks_.insert(blocks_.begin() + first, std::make_move_iterator(fresh.begin()), std::make_move_iterator(fresh.end()));
+        const size_t stop = first + fresh.size();
+        for (size_t k = stop; k < blocks_.size(); k++)
+            blocks_[k].begin += delta;
+
+        //  作り直したブロックと、carryが変わる後のブロック
+        for (size_t k = first; k < blocks_.size(); k++) {
+            intptr_t carry = 0;
+            if (k > 0) {
+                const block& p = blocks_[k - 1];
+                const intptr_t s = p.capture.empty() ? p.begin + p.carry : p.begin + next(p.capture, p.capture.size() - ncap_);
+                carry = std::max<intptr_t>(s - blocks_[k].begin, 0);
+            }
+            if (k > stop && carry == blocks_[k].carry)
+                break;
+            blocks_[k].carry = carry;
+        }
+    }
+
+    //---------------------------------------------------------------------
+    //  保持している一致を捨てる
+    //---------------------------------------------------------------------
+    void clear()
+    {
+        blocks_.clear();
+        count_ = 0;
+        size_ = 0;
+        rescan_ = { 0, 0 };
+    }
+
+    const regex_compiled& re_;
+    const int             options_;
+    const size_t          ncap_;            //  一致毎のキャプチャの数
+    regex_ptt             ptt_;
+    std::vector<block>    blocks_;          //  ブロック(先頭の位置の順)
+    size_t                count_ = 0;       //  一致の数
+    intptr_t              size_ = 0;        //  テキストの文字数
+    std::pair<intptr_t, intptr_t> rescan_;  //  直前に照合し直した範囲
+    std::wstring          what_;            //  エラーメッセージ
+};
+
+/**************************************************************************
+ *                                                                        *
+ *  照合を少しずつ進めるクラス                                            *
+ *                                                                        *
+ **************************************************************************/
+//  regex_ptt::matchと同じ照合を、runを呼ぶたびに指定した手数だけ進める。イベントループの中で
+//  長い照合が他の処理を待たせないように使う。途中の状態(状態集合、置換表、次の開始位置)は
+//  オブジェクトに残るので、runを呼び直せば続きから進む。
+//  手数は、状態集合で探索できるパターンでは読み進めた文字数、それ以外のパターンでは
+//  バックトラックの関数呼び出し回数で数える。止めるのは文字の間か開始位置の間だけなので、
+//  一つの開始位置からの照合(状態集合で求めた開始位置でキャプチャを求める照合を含む)は
+//  一度のrunで終わらせる(その手数はregex_ptt::MAX_LIMITで抑えられる)
+//---------------------------------------------------------------------
+class regex_job
+{
+public:
+    static constexpr int64_t SLICE = 65536;     //  一度に進める手数の目安
 
-        if (node->type == node_type::END) {                             //  NFAリンクリスト終端
-            if (option & regex_ptt::SEARCH)
-                return text;                                            //  部分一致
-            return text[0] == L'\0' ? text : nullptr;                   //  完全一致か不一致
+    //---------------------------------------------------------------------
+    //  コンストラクタ
+    //  引数はregex_ptt::matchと同じ(regex_ptt::PARTIALは無視する)
+    //  re、textはregex_jobより長く生きていること
+    //---------------------------------------------------------------------
+    regex_job(const regex_compiled& re, const wchar_t* text, const int options = 0, const intptr_t seek = 0, const intptr_t size = -1)
+        : re_(re), options_(options & ~regex_ptt::PARTIAL), seek_(seek)
+    {
+        if (re.get() == nullptr)
+            return;
+        len_ = ptt_.setup(text, re, options_, seek, size);
+        if (len_ < 0) {
+            finish(nullptr);
+            return;
         }
+        text_ = text + seek;
 
-        //  ε遷移無限ループ対策
-        //  「置換表」処理の前に行わなければ、「置換表」が誤判定を起こす原因になる
-        if (node->type == node_type::ENDLOOP && node->val == text) {    //  ループ間でテキストを消費していない
-            if (node->n2->type == node_type::LOOP)                      //  ループせず次へ遷移する
-                return reg_find(node->n1, text, depth - 1, option);     //  最短一致の場合はn1が次の遷移先
-            return reg_find(node->n2, text, depth - 1, option);         //  最長一致の場合はn2が次の遷移先
+        //  マッチ長の範囲で判定できる不一致(regex_ptt::locateと同じ)
+        last_ = len_ - re.min_length();
+        if (seek > last_ || (!(options_ & regex_ptt::SEARCH) && re.max_length() >= 0 && len_ - seek > re.max_length())) {
+            finish(nullptr);
+            return;
         }
+        scan_ = re.graph() && !re.atomic();
+        pending_ = true;
+    }
 
-        //  置換表(「壊滅的なバックトラック」を抑制する)
-        if (table_ && node->n2) {                                       //  置換表が"有効" かつ 分岐のあるノード
-            if (table_->insert({ node,text }).second == false)
-                return nullptr;                                         //  既に評価済み(「一致しない」を返す)
+    bool pending() const { return pending_; }                   //  照合が終わっていない
+    regex_result result() const { return result_; }             //  照合の結果(終わるまでは空)
+
+    //---------------------------------------------------------------------
+    //  照合を進める
+    //  steps   :  進める手数の上限(1未満なら1とする)
+    //  戻り値  :  照合が終わればtrue(結果はresult関数で受け取る)。falseならもう一度呼ぶ
+    //---------------------------------------------------------------------
+    //  状態集合で探索できるパターンは、最も前の開始位置を状態集合で求めてから、その位置だけを
+    //  バックトラックで照合する。状態集合はsteps文字毎に止めて、要素をend_に残しておく。
+    //  それ以外のパターンは開始位置を動かしながら照合し、手数を使い切った開始位置の後で止める
+    //---------------------------------------------------------------------
+    bool run(int64_t steps)
+    {
+        if (!pending_)
+            return true;
+        steps = std::max<int64_t>(steps, 1);
+        if (scan_) {
+            const intptr_t from = end_.from < 0 ? seek_ : end_.from;
+            end_.stop = steps >= len_ - from ? len_ : from + static_cast<intptr_t>(steps);
+            const intptr_t pos = ptt_.forward_scan(*re_.graph(), len_, seek_, last_, options_, true, &end_);
+            if (pos < 0)
+                return end_.from == end_.stop ? false : finish(nullptr);
+            text_ = ptt_.input_head_ + pos;
+            ptt_.limit_ = regex_ptt::MAX_LIMIT;
+            return finish(ptt_.reg_find(re_.get(), text_, regex_ptt::MAX_DEPTH, options_));
         }
+        auto ret = ptt_.search(re_, text_, len_, last_, options_, &steps);
+        return ptt_.pending_ ? false : finish(ret);
+    }
 
-        intptr_t seek = 0;
-        switch (node->type) {
-        case node_type::BOL:
-            //  「^」- 行頭
-            if (text != input_head_ && (option & regex_ptt::SINGLE || *(text - 1) != L'\n'))
-                return nullptr;
-            break;
+private:
+    //---------------------------------------------------------------------
+    //  結果を設定して照合を終える
+    //---------------------------------------------------------------------
+    bool finish(const wchar_t* ret)
+    {
+        result_ = ptt_.make_result(text_, ret);
+        pending_ = false;
+        return true;
+    }
 
-        case node_type::EOL:
-            //  「$」- 行末
-            if (*text != L'\0')
-                return nullptr;
-            break;
+    const regex_compiled&  re_;
+    const int              options_;
+    const intptr_t         seek_;           //  探索開始位置
+    regex_ptt              ptt_;            //  途中の状態(置換表、キャプチャ)を持つ
+    regex_ptt::scan_end    end_;            //  止めた状態集合(end_.fromが次に進める位置)
+    const wchar_t*         text_ = nullptr; //  次に照合する開始位置(一致すればその開始位置)
+    intptr_t               len_ = 0;        //  テキストの文字数
+    intptr_t               last_ = 0;       //  開始位置の上限
+    bool                   scan_ = false;   //  状態集合で探索する
+    bool                   pending_ = false;
+    regex_result           result_;
+};
 
-        case node_type::GROUP:
-            //  「(」- グループ、キャプチャ
-            return group(node, text, depth, option);
+#ifdef REGEX_PTT_COROUTINE
+/**************************************************************************
+ *                                                                        *
+ *  regex_jobをC++20のコルーチンで包んだクラス                            *
+ *                                                                        *
+ **************************************************************************/
+//  match_slicedが返す。resumeを呼ぶたびにregex_job::runを一度呼んで中断する。
+//  イベントループは、終わるまで他の処理と交互にresumeを呼べばよい
+//---------------------------------------------------------------------
+class regex_task
+{
+public:
+    struct promise_type {
+        regex_result result;
 
-        case node_type::ENDGROUP:
-            //  「)」- 閉じカッコ
-            return end_group(node, text, depth, option);
+        regex_task get_return_object() { return regex_task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(const regex_result& r) { result = r; }
+        void unhandled_exception() { throw; }
+    };
 
-        case node_type::LOOP:
-            //  「*」- ループ開始ノード
-            return loop(node, text, depth, option);
+    regex_task(regex_task&& t) noexcept : handle_(t.handle_) { t.handle_ = nullptr; }
+    ~regex_task()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
 
-        case node_type::CLASS:
-            //  「[] or [^]」- 文字クラス
-            if (*text == L'\0' || (seek = char_class(node, text, option)) == 0)
-                return nullptr;
-            break;
+    //---------------------------------------------------------------------
+    //  照合を一区切り進める
+    //  戻り値  :  照合が終わればtrue(結果はresult関数で受け取る)
+    //---------------------------------------------------------------------
+    bool resume()
+    {
+        if (!handle_.done())
+            handle_.resume();
+        return handle_.done();
+    }
+    bool done() const { return handle_.done(); }
+    regex_result result() const { return handle_.promise().result; }    //  照合の結果(終わるまでは空)
 
-        case node_type::ESCAPE:
-            //  「\」- エスケープシーケンス
-            if ((seek = escape(node->val + 1, text, option)) == -1)
-                return nullptr;
-            break;
+private:
+    explicit regex_task(std::coroutine_handle<promise_type> h) : handle_(h) {}
+    regex_task(const regex_task&) = delete;
+    regex_task& operator=(const regex_task&) = delete;
 
-        default:
-            if (node->len == 1 && node->type == node_type::DEFAULT) {
-                // 「通常文字」
-                if ((text[0] == L'\0') || (node->val == nullptr) || (seek = cmp_char(node->val, text, option)) == 0)
-                    return nullptr;
-            }
-        }   //  switch-caseの終了
+    std::coroutine_handle<promise_type> handle_;
+};
 
-        //  再帰的に次のノードの探索を続ける
-        //  最初にn1遷移を試し、エラー応答でバックトラックしてきたら、(あれば)n2遷移を試す
-        auto ret = reg_find(node->n1, text + seek, depth - 1, option);
-        if (!ret && node->n2)
-            ret = reg_find(node->n2, text + seek, depth - 1, option);
-        return ret;
-    }
+//---------------------------------------------------------------------
+//  regex_ptt::matchと同じ照合を、steps手数ずつ進めるコルーチンを作る
+//  引数はregex_jobのコンストラクタとrunと同じ。re、textはregex_taskより長く生きていること
+//---------------------------------------------------------------------
+inline regex_task match_sliced(const regex_compiled& re, const wchar_t* text, const int options = 0, const int64_t steps = regex_job::SLICE, const intptr_t seek = 0, const intptr_t size = -1)
+{
+    regex_job job(re, text, options, seek, size);
+    while (!job.run(steps))
+        co_await std::suspend_always{};
+    co_return job.result();
+}
+#endif  //  REGEX_PTT_COROUTINE
+
+/**************************************************************************
+ *                                                                        *
+ *  コンパイルされた正規表現を使い回すキャッシュクラス                    *
+ *                                                                        *
+ **************************************************************************/
+//  パターン文字列をキーに、コンパイルされた正規表現を共有ポインタ(handle)で返す。
+//  handleが指すオブジェクトは変更しないので、複数のスレッドから同時に照合に使ってよい
+//  (regex_pttはスレッド毎に用意する)。キャッシュから追い出されても、handleが残っている
+//  間はオブジェクトは生きている。
+//  パターンのハッシュ値でSHARDS個の区画に分け、区画毎に排他制御と最近使った順の並びを持つ。
+//  容量(regex_compiled::bytesの合計)は区画毎に均等に割り当て、超えたら最も長く使われて
+//  いないものから追い出す。まだ無いパターンを同時に求められた場合は、最初のスレッドだけが
+//  コンパイルし、残りはその結果を待つ
+//---------------------------------------------------------------------
+class regex_cache
+{
+public:
+    using handle = std::shared_ptr<const regex_compiled>;
+    static constexpr size_t SHARDS = 16;            //  区画の数
 
     //---------------------------------------------------------------------
-    //  キャプチャの開始処理を行う
+    //  コンストラクタ
+    //  capacity  :  保持するコンパイル結果のバイト数の上限
     //---------------------------------------------------------------------
-    const wchar_t* group(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    explicit regex_cache(const size_t capacity = size_t(64) << 20) : capacity_(capacity)
     {
-        auto rollback = capture_[node->len].first;          //  バックトラックしたときに値を戻すために保存する
-        capture_[node->len].first = (text - input_head_);   //  キャプチャ開始インデックス値
+    }
 
-        auto ret = reg_find(node->n1, text, depth - 1, option);
-        if (ret == nullptr) {
-            capture_[node->len].first = rollback;           //  失敗で戻る前にロールバックする
-        }
-        return ret;
+    //---------------------------------------------------------------------
+    //  プロセス全体で共有するキャッシュ
+    //---------------------------------------------------------------------
+    static regex_cache& global()
+    {
+        static regex_cache cache;
+        return cache;
     }
 
     //---------------------------------------------------------------------
-    //  キャプチャデータを確定する
+    //  パターンのコンパイル結果を返す(無ければコンパイルして登録する)
+    //  pattern :  正規表現パターン文字列
+    //  戻り値  :  コンパイルされた正規表現。構文エラーもそのまま返す(err_msgで確認する)
     //---------------------------------------------------------------------
-    const wchar_t* end_group(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    handle get(const std::wstring_view pattern)
     {
-        auto rollback = capture_[node->len].second;     //  バックトラック時に値を戻すために保存する
-        capture_[node->len].second = (text - input_head_) - capture_[node->len].first;  //  文字列長
+        shard& s = shards_[std::hash<std::wstring_view>()(pattern) % SHARDS];
+        std::shared_future<handle> found;
+        std::promise<handle> made;
+        {
+            std::lock_guard<std::mutex> lock(s.lock);
+            auto it = s.index.find(pattern);
+            if (it != s.index.end()) {
+                s.lru.splice(s.lru.begin(), s.lru, it->second);    //  最も新しく使ったものにする
+                found = it->second->program;
+            } else {
+                s.lru.push_front({ std::wstring(pattern), made.get_future().share(), 0 });
+                s.index.emplace(s.lru.front().pattern, s.lru.begin());
+            }
+        }
+        if (found.valid()) {
+            hits_++;
+            return found.get();         //  コンパイル中なら終わるまで待つ
+        }
+        misses_++;
 
-        auto ret = reg_find(node->n1, text, depth - 1, option);
-        if (ret == nullptr) {
-            capture_[node->len].second = rollback;      //  失敗で戻る前にロールバックする
+        //  区画の排他制御の外でコンパイルする
+        handle program;
+        try {
+            program = std::make_shared<const regex_compiled>(std::wstring(pattern).c_str());
+        } catch (...) {
+            made.set_exception(std::current_exception());
+            std::lock_guard<std::mutex> lock(s.lock);
+            auto it = s.index.find(pattern);
+            if (it != s.index.end() && it->second->bytes == 0) {
+                s.lru.erase(it->second);
+                s.index.erase(it);
+            }
+            throw;
         }
-        return ret;
+        made.set_value(program);
+        std::lock_guard<std::mutex> lock(s.lock);
+        auto it = s.index.find(pattern);
+        if (it != s.index.end() && it->second->bytes == 0) {
+            it->second->bytes = program->bytes();
+            s.bytes += it->second->bytes;
+            evict(s);
+        }
+        return program;
     }
 
+    uint64_t hits() const { return hits_; }         //  キャッシュにあった(コンパイル中だったものを含む)回数
+    uint64_t misses() const { return misses_; }     //  コンパイルした回数
+    size_t capacity() const { return capacity_; }   //  バイト数の上限
+
     //---------------------------------------------------------------------
-    //  ε遷移無限ループ対策
-    //  LOOP - ENDLOOP間でテキスト消費を監視する
+    //  保持しているパターンの数とバイト数(コンパイル中のものは数に含め、バイト数に含めない)
     //---------------------------------------------------------------------
-    const wchar_t* loop(const nfa_node* node, const wchar_t* text, const long depth, const int option)
+    std::pair<size_t, size_t> usage()
     {
-        auto rollback = node->n2->val;  //  node->n2はENDLOOPノード
-        node->n2->val = text;           //  ENDLOOP側に現在のテキスト位置を知らせる
-        auto ret = reg_find(node->n1, text, depth - 1, option);
-        node->n2->val = rollback;       //  バックトラックにより戻ってきたのでロールバックする
+        std::pair<size_t, size_t> ret(0, 0);
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.lock);
+            ret.first += s.lru.size();
+            ret.second += s.bytes;
+        }
         return ret;
     }
 
     //---------------------------------------------------------------------
-    //  「通常文字」の一致処理
-    //  複雑になるのでUnicodeのサロゲートペアなどは考慮しない
+    //  コンパイルが終わったものを全て追い出す
     //---------------------------------------------------------------------
-    int cmp_char(const wchar_t* pattern, const wchar_t* text, const int option) const
+    void clear()
     {
-        if (*pattern == L'.' && *text != L'\n') {
-            return 1;
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.lock);
+            for (auto it = s.lru.begin(); it != s.lru.end(); ) {
+                if (it->bytes == 0) {
+                    ++it;               //  コンパイル中
+                    continue;
+                }
+                s.index.erase(it->pattern);
+                it = s.lru.erase(it);
+            }
+            s.bytes = 0;
         }
-        if (*pattern == *text)
-            return 1;
-        if (option & regex_ptt::NOCASE)
-            return cmp_nocase(*text, *pattern);
-        return 0;
     }
 
+private:
+    regex_cache(const regex_cache&) = delete;
+    regex_cache& operator=(const regex_cache&) = delete;
+
+    struct entry {
+        std::wstring               pattern;
+        std::shared_future<handle> program;
+        size_t                     bytes;   //  regex_compiled::bytes(コンパイル中は0)
+    };
+    struct shard {
+        std::mutex        lock;
+        std::list<entry>  lru;              //  最近使った順(先頭が最も新しい)
+        std::unordered_map<std::wstring_view, std::list<entry>::iterator> index;  //  キーはlruの要素のpatternを指す
+        size_t            bytes = 0;        //  コンパイルが終わったものの合計
+    };
+
     //---------------------------------------------------------------------
-    //  「通常文字」の一致処理を大文字小文字の区別なく行う
-    //  簡単にするためアルファベットのみを対象とする
+    //  区画の容量を超えていれば、最も長く使われていないものから追い出す(コンパイル中のものは除く)
     //---------------------------------------------------------------------
-    int cmp_nocase(const wchar_t t, const wchar_t ch) const
+    void evict(shard& s)
     {
-        return (t <= L'Z') ? (ch == (L'a' + (t - L'A'))) : (ch == (L'A' + (t - L'a')));
+        const size_t budget = capacity_ / SHARDS;
+        for (auto it = s.lru.end(); s.bytes > budget && it != s.lru.begin(); ) {
+            --it;
+            if (it->bytes == 0)
+                continue;
+            s.bytes -= it->bytes;
+            s.index.erase(it->pattern);
+            it = s.lru.erase(it);
+        }
     }
 
+    const size_t          capacity_;
+    shard                 shards_[SHARDS];
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+};
+
+/**************************************************************************
+ *                                                                        *
+ *  コンパイルされた正規表現をまとめたバイナリファイルのクラス            *
+ *                                                                        *
+ **************************************************************************/
+//  ビルド時などに一度だけコンパイルしてwrite関数で書き出し、起動時はopen関数で写像する
+//  (mmapが使えない環境では読み込む)。ファイルの中のリンクは全てポインタではなく序数なので、
+//  写像したまま構文解析も再配置もしない。
+//  ファイルはヘッダ、パターン毎の位置と長さの表、パターン毎のイメージ(regex_compiled::save)
+//  の順に並ぶ。バージョン、バイト順、wchar_tとレコードの大きさが違うファイルは開かない。
+//  照合器(regex_ptt)はnfa_nodeのポインタを辿るので、get関数は初めて使う時にイメージの
+//  序数をポインタに置き換えたregex_compiledを一度だけ作る(ノード数に比例する処理だけで、
+//  構文解析と解析はしない)。get関数は複数のスレッドから同時に呼んでよい
+//---------------------------------------------------------------------
+class regex_bundle
+{
+public:
+    static constexpr uint32_t MAGIC   = 0x58425052;    //  "RPBX"
+    static constexpr uint32_t VERSION = 1;              //  形式を変えたら上げる
+
     //---------------------------------------------------------------------
-    //  文字クラスの範囲指定(「[a-z]など」)の一致処理を
-    //  大文字小文字の区別なく行う
-    //  cmp_nocase同様、アルファベットのみを対象とする
+    //  コンストラクタ
+    //  resource  :  get関数で作るregex_compiledのメモリの確保元(nullptrは既定のもの)
     //---------------------------------------------------------------------
-    int cmp_nocase(const wchar_t start, const wchar_t end, const wchar_t target) const
+    explicit regex_bundle(std::pmr::memory_resource* resource = nullptr) : resource_(resource)
     {
-        if (iswalpha(target) && ((end >= L'A') && (start <= L'z'))) {
-            int tmp = (target <= L'Z') ? (L'a' + (target - L'A')) : (L'A' + (target - L'a'));
-            return (start <= tmp && tmp <= end);
-        }
-        return 0;
+    }
+
+    ~regex_bundle()
+    {
+        close();
     }
 
     //---------------------------------------------------------------------
-    //  文字クラス([], [^])内にある文字と比較する
-    //  一致した場合は1を返す。不一致なら0を返す
+    //  コンパイルされた正規表現をバイナリ形式にまとめる
+    //  programs  :  コンパイルされた正規表現の配列(構文エラーのものも書き出す)
+    //  count     :  programsの要素数
+    //  戻り値    :  ファイルの内容(書き出せないものがあれば空)
     //---------------------------------------------------------------------
-    int char_class(const nfa_node* node, const wchar_t* text, const int option)
+    static std::string build(const regex_compiled* const* programs, const size_t count)
     {
-        const wchar_t* s = node->val;
-        const int r = (s[0] == L'^');
-        for (intptr_t i = r; i < node->len; i++) {
-            if (s[i] == L'\\') {
-                if (escape(s + (++i), text, option) != -1)
-                    return 1 ^ r;
-            } else {
-                if (s[i + 1] == L'-' && s[i + 2] != L']') {
-                    wchar_t start = s[i];
-                    wchar_t end = s[i + 2];
-                    if (start <= *text && *text <= end)
-                        return 1 ^ r;
-                    if (option & regex_ptt::NOCASE && cmp_nocase(start, end, *text))
-                        return 1 ^ r;
-                    i += 2;
-                } else if (s[i] == L'.') {
-                    if (s[i] == *text)
-                        return 1 ^ r;
-                } else if (cmp_char(s + i, text, option)) {
-                    return 1 ^ r;
-                }
-            }
+        std::string out(sizeof(header) + sizeof(entry) * count, '\0');
+        out.append((8 - out.size() % 8) % 8, '\0');
+        std::vector<entry> dir(count);
+        for (size_t i = 0; i < count; i++) {
+            dir[i].offset = out.size();
+            if (!programs[i]->save(out))
+                return std::string();
+            dir[i].size = out.size() - dir[i].offset;
         }
-        return r;
+        header h = { MAGIC, VERSION, ENDIAN, sizeof(wchar_t), sizeof(regex_compiled::image_header),
+                     sizeof(regex_compiled::image_node), static_cast<uint32_t>(count), 0 };
+        std::memcpy(&out[0], &h, sizeof(h));
+        if (count)
+            std::memcpy(&out[sizeof(h)], dir.data(), sizeof(entry) * count);
+        return out;
     }
 
     //---------------------------------------------------------------------
-    //  エスケープシーケンス
-    //  戻り値  :  失敗なら-1を返す。成功ならマッチした文字数を返す
+    //  コンパイルされた正規表現をファイルに書き出す
+    //  戻り値  :  書き出せればtrue
     //---------------------------------------------------------------------
-    intptr_t escape(const wchar_t* pattern, const wchar_t* text, const int option)
+    static bool write(const char* path, const regex_compiled* const* programs, const size_t count)
     {
-        intptr_t val = -1;
-        switch (pattern[0]) {
-        case L't':  val = (L'\t' == *text);                             break;  //  水平タブ
-        case L'n':  val = (L'\n' == *text);                             break;  //  改行
-        case L'r':  val = (L'\r' == *text);                             break;  //  キャリッジリターン
-        case L'd':  val = iswdigit(*text);                              break;  //  数字
-        case L'D':  val = *text && (escape(L"d", text, option) == -1);  break;  //  数字以外
-        case L's':  val = iswspace(*text);                              break;  //  ホワイトスペース
-        case L'S':  val = *text && (escape(L"s", text, option) == -1);  break;  //  ホワイトスペース以外
-        case L'w':  val = (iswalnum(*text) || L'_' == *text);           break;  //  アルファベットとアンダースコア
-        case L'W':  val = *text && (escape(L"w", text, option) == -1);  break;  //  アルファベットとアンダースコア以外
-        case L'.':  val = (text[0] == L'.');                            break;  //  文字リテラル「.」
-        case L'B':  return !escape(L"b", text, option) ? -1 : 0;                //  単語境界以外
-        case L'b':                                                              //  単語境界
-            if (escape(L"w", text, option) != -1)
-                return (text == input_head_ || escape(L"W", text - 1, option) != -1) ? 0 : -1;
-            return (text != input_head_ && escape(L"w", text - 1, option) != -1) ? 0 : -1;
-        }   //  switch-caseの終端
-        if (val != -1)
-            return val == 0 ? -1 : 1;
-
-        if (iswdigit(pattern[0])) {
-            //  パターン内後方参照
-            int p = _wtoi(pattern);
-            if (p >= 1 && p < static_cast<int>(capture_.size()) && capture_[p].second >= 0) {
-                if (!capture_[p].second || !wcsncmp(text, input_head_ + capture_[p].first, capture_[p].second))
-                    return capture_[p].second;
+        const std::string image = build(programs, count);
+        if (image.empty())
+            return false;
+        FILE* fp = std::fopen(path, "wb");
+        if (fp == nullptr)
+            return false;
+        const bool ok = std::fwrite(image.data(), 1, image.size(), fp) == image.size();
+        return std::fclose(fp) == 0 && ok;
+    }
 
-                //  パターン内後方参照で失敗した場合は、置換表が原因で正しい解が得られない場合があるため
-                //  置換表をクリアする必要がある
-                table_clear();
-            }
-            return -1;
+    //---------------------------------------------------------------------
+    //  ファイルを開く(ヘッダと表だけを確かめ、パターンはget関数で初めて読む)
+    //  戻り値  :  開ければtrue。失敗したらerror関数で理由を返す
+    //---------------------------------------------------------------------
+    bool open(const char* path)
+    {
+        close();
+#ifdef REGEX_PTT_MMAP
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return fail(L"cannot open file.");
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return fail(L"cannot open file.");
         }
+        void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return fail(L"cannot map file.");
+        map_ = p;
+        map_size_ = static_cast<size_t>(st.st_size);
+        return attach(static_cast<const char*>(p), map_size_) || (close(), false);
+#else
+        FILE* fp = std::fopen(path, "rb");
+        if (fp == nullptr)
+            return fail(L"cannot open file.");
+        std::vector<char> bytes;
+        char buf[65536];
+        for (size_t n; (n = std::fread(buf, 1, sizeof(buf), fp)) > 0; )
+            bytes.insert(bytes.end(), buf, buf + n);
+        std::fclose(fp);
+        copy_.resize((bytes.size() + 7) / 8);       //  8バイト境界に置く
+        if (!bytes.empty())
+            std::memcpy(copy_.data(), bytes.data(), bytes.size());
+        return attach(reinterpret_cast<const char*>(copy_.data()), bytes.size()) || (close(), false);
+#endif
+    }
 
-        if (int n = cmp_char(pattern, text, option))
-            return n;
+    //---------------------------------------------------------------------
+    //  メモリ上の内容を使う(コピーしない。dataはregex_bundleより長く生きていること)
+    //  data  :  build関数で作った内容(8バイト境界に置くこと)
+    //  戻り値  :  使えればtrue
+    //---------------------------------------------------------------------
+    bool attach(const char* data, const size_t size)
+    {
+        if (data != static_cast<const void*>(map_) && data != static_cast<const void*>(copy_.data()))
+            close();
+        header h;
+        if (reinterpret_cast<uintptr_t>(data) % 8 != 0 || size < sizeof(h))
+            return fail(L"broken file.");
+        std::memcpy(&h, data, sizeof(h));
+        if (h.magic != MAGIC || h.endian != ENDIAN)
+            return fail(L"not a regex bundle.");
+        if (h.version != VERSION || h.wchar_size != sizeof(wchar_t) || h.header_size != sizeof(regex_compiled::image_header) ||
+            h.node_size != sizeof(regex_compiled::image_node))
+            return fail(L"unsupported bundle version.");
+        if (h.count > (size - sizeof(h)) / sizeof(entry))
+            return fail(L"broken file.");
+        auto dir = reinterpret_cast<const entry*>(data + sizeof(h));
+        for (uint32_t i = 0; i < h.count; i++) {
+            if (dir[i].offset % 8 != 0 || dir[i].offset > size || dir[i].size > size - dir[i].offset)
+                return fail(L"broken file.");
+        }
+        data_ = data;
+        dir_ = dir;
+        count_ = h.count;
+        programs_.reset(new std::unique_ptr<regex_compiled>[count_]);
+        once_.reset(new std::once_flag[count_]);
+        what_.clear();
+        return true;
+    }
 
-        return -1;
+    //---------------------------------------------------------------------
+    //  閉じる(get関数で作ったregex_compiledも解放する)
+    //---------------------------------------------------------------------
+    void close()
+    {
+        programs_.reset();
+        once_.reset();
+        data_ = nullptr;
+        dir_ = nullptr;
+        count_ = 0;
+#ifdef REGEX_PTT_MMAP
+        if (map_)
+            ::munmap(map_, map_size_);
+#endif
+        map_ = nullptr;
+        map_size_ = 0;
+        copy_.clear();
     }
 
+    size_t size() const { return count_; }                  //  パターンの数
+    const std::wstring& error() const { return what_; }     //  open, attach関数が失敗した理由
+
     //---------------------------------------------------------------------
-    //  正規表現探索時エラーメッセージの設定
+    //  i番目のパターン文字列(ファイルの中を指す。写像の構築はしない)
     //---------------------------------------------------------------------
-    void runtimeerror(const std::wstring msg)
+    std::wstring_view pattern(const size_t i) const
     {
-        what_ = msg;
+        return regex_compiled::image_pattern(data_ + dir_[i].offset, static_cast<size_t>(dir_[i].size));
     }
 
     //---------------------------------------------------------------------
-    //  置換表を初期化する
+    //  i番目のコンパイルされた正規表現(初めて呼ばれた時に作る)
+    //  戻り値  :  コンパイルされた正規表現。中身が壊れていればerr_msgにメッセージを設定する
     //---------------------------------------------------------------------
-    void table_clear()
+    const regex_compiled& get(const size_t i) const
+    {
+        std::call_once(once_[i], [this, i] {
+            programs_[i].reset(new regex_compiled(data_ + dir_[i].offset, static_cast<size_t>(dir_[i].size), resource_));
+        });
+        return *programs_[i];
+    }
+
+private:
+    regex_bundle(const regex_bundle&) = delete;
+    regex_bundle& operator=(const regex_bundle&) = delete;
+
+    static constexpr uint32_t ENDIAN = 0x01020304;      //  バイト順の確認用
+
+    struct header {
+        uint32_t magic, version, endian, wchar_size;
+        uint32_t header_size, node_size;                //  regex_compiled::image_header, image_nodeの大きさ
+        uint32_t count, reserved;
+    };
+    struct entry {
+        uint64_t offset, size;                          //  イメージのファイル先頭からの位置と長さ
+    };
+
+    bool fail(const wchar_t* msg)
     {
-        if (table_)
-            table_->clear();
+        what_ = msg;
+        return false;
     }
+
+    std::pmr::memory_resource*  resource_;
+    const char*                 data_     = nullptr;    //  ファイルの内容
+    const entry*                dir_      = nullptr;    //  パターン毎の位置と長さ
+    size_t                      count_    = 0;
+    void*                       map_      = nullptr;    //  写像した領域(mmapが使えなければnullptr)
+    size_t                      map_size_ = 0;
+    std::vector<uint64_t>       copy_;                  //  mmapが使えない場合に読み込んだ内容
+    mutable std::unique_ptr<std::unique_ptr<regex_compiled>[]> programs_;
+    mutable std::unique_ptr<std::once_flag[]> once_;
+    std::wstring                what_;
 };
 }   //  namespace nfa_plus_ttable
 #endif  //  _REGEX_PLUS_TRANSPOSITION_TABLE_REGEX_H_
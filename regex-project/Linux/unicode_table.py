@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+#-------------------------------------------------------------------------------
+#   unicode_table.h(Unicode文字プロパティ表)を生成する
+#-------------------------------------------------------------------------------
+#   使い方  :  python3 unicode_table.py > unicode_table.h  (または「make unicode」)
+#
+#   Pythonに組み込まれているUnicodeデータベース(unicodedata)から、regex.hが一文字の
+#   判定に使う表を作る。ロケール(setlocale)に依存しない判定にするのが目的。
+#   ・文字プロパティ  -  \d、\s、\wの判定と、大文字小文字の対応がある文字の印
+#   ・大文字小文字の環  -  大文字小文字を区別しない時に同じとみなす文字を、
+#                         次の文字への差分で環状につないだもの(k→K→K(ケルビン)→kなど)
+#   どちらもコードポイントの上位ビットでブロックを引く二段の表にして、同じ内容の
+#   ブロックを共有する。大文字小文字の対応は、一文字から一文字への単純な対応
+#   (str.upper/str.lowerの結果が一文字になるもの)だけを使う
+#-------------------------------------------------------------------------------
+import sys
+import unicodedata
+
+SHIFT = 7                       # ブロックの大きさ(1 << SHIFT文字)
+LIMIT = 0x110000
+
+DIGIT, SPACE, WORD, CASED = 0x01, 0x02, 0x04, 0x08
+
+# White_Spaceプロパティ(PropList.txt)
+WHITE_SPACE = [0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x20, 0x85, 0xa0, 0x1680] + list(range(0x2000, 0x200b)) + \
+              [0x2028, 0x2029, 0x202f, 0x205f, 0x3000]
+
+
+def single(s):
+    return ord(s) if len(s) == 1 else None
+
+
+def properties():
+    prop = [0] * LIMIT
+    for c in range(LIMIT):
+        cat = unicodedata.category(chr(c))
+        if cat == 'Nd':
+            prop[c] |= DIGIT | WORD
+        # \wはUTS #18の定義(英字、結合文字、数字、連結符)に従う
+        if cat[0] in 'LM' or cat in ('Nd', 'Nl', 'Pc'):
+            prop[c] |= WORD
+    for c in WHITE_SPACE:
+        prop[c] |= SPACE
+    return prop
+
+
+def orbits(prop):
+    # 大文字と小文字の単純な対応で、同じとみなす文字の集まりを作る
+    key = {}
+    for c in range(LIMIT):
+        if 0xd800 <= c < 0xe000:
+            continue
+        ch = chr(c)
+        up = single(ch.upper())
+        lo = single(chr(up).lower()) if up is not None else single(ch.lower())
+        if lo is None:
+            lo = single(ch.lower())
+        key.setdefault(lo if lo is not None else c, []).append(c)
+    delta = [0] * LIMIT
+    for members in key.values():
+        if len(members) < 2:
+            continue
+        members.sort()
+        for i, c in enumerate(members):
+            delta[c] = members[(i + 1) % len(members)] - c
+            prop[c] |= CASED
+    return delta
+
+
+def two_level(values):
+    size = 1 << SHIFT
+    blocks, index, seen = [], [], {}
+    for i in range(0, LIMIT, size):
+        block = tuple(values[i:i + size])
+        if block not in seen:
+            seen[block] = len(blocks)
+            blocks.append(block)
+        index.append(seen[block])
+    return index, blocks
+
+
+def ranges(prop, bit):
+    out, start = [], None
+    for c in range(LIMIT + 1):
+        on = c < LIMIT and prop[c] & bit
+        if on and start is None:
+            start = c
+        elif not on and start is not None:
+            out.append((start, c - 1))
+            start = None
+    return out
+
+
+def rows(values, fmt, per_line, indent):
+    values = list(values)
+    for i in range(0, len(values), per_line):
+        yield indent + ', '.join(fmt(v) for v in values[i:i + per_line]) + ','
+
+
+def main():
+    prop = properties()
+    delta = orbits(prop)
+    pidx, pblk = two_level(prop)
+    cidx, cblk = two_level(delta)
+    digits = ranges(prop, DIGIT)
+    assert len(pblk) < 0x10000 and len(cblk) < 0x10000
+
+    w = sys.stdout.write
+    w('//-----------------------------------------------------------------------------\n')
+    w('//  Unicode文字プロパティ表(Unicode %s)\n' % unicodedata.unidata_version)
+    w('//  unicode_table.pyが生成したファイルなので、直接編集しないこと\n')
+    w('//-----------------------------------------------------------------------------\n')
+    w('#pragma once\n\n#include <cstdint>\n\n')
+    w('namespace nfa_plus_ttable {\nnamespace unicode {\n\n')
+    w('constexpr uint8_t DIGIT = 0x%02x;     //  \\d(一般カテゴリNd)\n' % DIGIT)
+    w('constexpr uint8_t SPACE = 0x%02x;     //  \\s(White_Space)\n' % SPACE)
+    w('constexpr uint8_t WORD  = 0x%02x;     //  \\w(英字、結合文字、数字、連結符)\n' % WORD)
+    w('constexpr uint8_t CASED = 0x%02x;     //  大文字小文字の環に入っている\n' % CASED)
+    w('constexpr int     SHIFT = %d;        //  ブロックの大きさ(1 << SHIFT文字)\n\n' % SHIFT)
+
+    w('//  文字プロパティのブロック番号(コードポイント >> SHIFT)\n')
+    w('static const uint16_t prop_index[%d] = {\n' % len(pidx))
+    w('\n'.join(rows(pidx, str, 24, '    ')) + '\n};\n\n')
+    w('//  文字プロパティのブロック\n')
+    w('static const uint8_t prop_block[%d][%d] = {\n' % (len(pblk), 1 << SHIFT))
+    for b in pblk:
+        w('    {\n' + '\n'.join(rows(b, lambda v: '0x%x' % v, 32, '        ')) + '\n    },\n')
+    w('};\n\n')
+
+    w('//  大文字小文字の環のブロック番号(コードポイント >> SHIFT)\n')
+    w('static const uint16_t case_index[%d] = {\n' % len(cidx))
+    w('\n'.join(rows(cidx, str, 24, '    ')) + '\n};\n\n')
+    w('//  大文字小文字の環のブロック(次の文字への差分)\n')
+    w('static const int32_t case_block[%d][%d] = {\n' % (len(cblk), 1 << SHIFT))
+    for b in cblk:
+        w('    {\n' + '\n'.join(rows(b, str, 16, '        ')) + '\n    },\n')
+    w('};\n\n')
+
+    w('//  \\dに一致する文字の範囲(先頭、末尾)\n')
+    w('static const uint32_t digit_range[%d][2] = {\n' % len(digits))
+    w('\n'.join(rows(digits, lambda r: '{ 0x%x, 0x%x }' % r, 6, '    ')) + '\n};\n\n')
+    w('//  \\sに一致する文字\n')
+    w('static const uint32_t space_char[%d] = {\n' % len(WHITE_SPACE))
+    w('\n'.join(rows(WHITE_SPACE, lambda v: '0x%x' % v, 12, '    ')) + '\n};\n\n')
+
+    w('//-----------------------------------------------------------------------------\n')
+    w('//  文字のプロパティ(DIGIT、SPACE、WORD、CASEDの組み合わせ)\n')
+    w('//-----------------------------------------------------------------------------\n')
+    w('inline uint8_t property(const uint32_t c)\n{\n')
+    w('    return c < 0x%x ? prop_block[prop_index[c >> SHIFT]][c & ((1 << SHIFT) - 1)] : 0;\n}\n\n' % LIMIT)
+    w('//-----------------------------------------------------------------------------\n')
+    w('//  大文字小文字の環で次の文字(環に入っていなければc自身)\n')
+    w('//-----------------------------------------------------------------------------\n')
+    w('inline uint32_t orbit(const uint32_t c)\n{\n')
+    w('    return c < 0x%x ? c + case_block[case_index[c >> SHIFT]][c & ((1 << SHIFT) - 1)] : c;\n}\n\n' % LIMIT)
+    w('}   //  namespace unicode\n}   //  namespace nfa_plus_ttable\n')
+
+
+if __name__ == '__main__':
+    main()
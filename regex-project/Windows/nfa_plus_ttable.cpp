@@ -73,7 +73,7 @@ int show_usage()
         << L"exec        -  反復探索を行わない" << endl
         << L"group       -  キャプチャされたグループの値を表示する" << endl
         << L"hide        -  実行結果を出力しない" << endl
-        << L"icase       -  大文字小文字の区別をしない(アルファベットのみ)" << endl
+        << L"icase       -  大文字小文字の区別をしない(Unicodeの大文字小文字の対応表による)" << endl
         << L"limit=秒数  -  タイムアウト時間を秒単位で設定する(std::regexのみ有効)" << endl
         << L"match       -  完全一致検索" << endl
         << L"normal      -  従来型NFAエンジンを使う(置換表を使わない)" << endl
@@ -137,25 +137,26 @@ int regex_search_ptt(const wchar_t* text, const wchar_t* pattern, search_options
     }
 
     regex_ptt regex;
+    const intptr_t size = wcslen(text);                                 //  反復探索で毎回数え直さないように、文字数を求めておく
     vector<pair<intptr_t, size_t>> mc;                                  //  一致箇所を格納する{{位置, 長さ}, ...}
     vector<vector<pair<intptr_t, size_t>>> capture;                     //  キャプチャした値を格納する
     auto start = chrono::system_clock::now();                           //  実行時間の計測開始
 
     //  パターンマッチを実行する
-    if (auto res = regex.match(text, re, opt.regex_options)) {
-        intptr_t seek = 0;                                              //  探索開始位置
-        do {
-            if (opt.group)
-                capture.push_back({ res.begin() + 1,res.end() });       //  キャプチャした箇所を格納する
-            mc.push_back({ res.position(0), res.length(0) });           //  一致箇所を格納する
-            seek = res.position(0) + res.length(0);                     //  次の位置
-            if (res.length(0) == 0) {                                   //  ゼロ幅マッチ
-                if (*(text + seek) == L'\0')
-                    break;
-                ++seek;                                                 //  ゼロ幅はインクリメントしないと無限ループになる
-            }
-        } while (opt.all &&
-            (res = regex.match(text, re, opt.regex_options, seek)));    //  「反復探索を行う && マッチ成功」がループ条件
+    vector<pair<intptr_t, size_t>> res(re.capture());                   //  照合毎に一致箇所とキャプチャを上書きする領域
+    intptr_t seek = 0;                                                  //  探索開始位置
+    while (regex.match(text, re, opt.regex_options, seek, size, res.data(), res.size())) {
+        if (opt.group)
+            capture.push_back({ res.begin() + 1,res.end() });           //  キャプチャした箇所を格納する
+        mc.push_back(res[0]);                                           //  一致箇所を格納する
+        seek = res[0].first + res[0].second;                            //  次の位置
+        if (res[0].second == 0) {                                       //  ゼロ幅マッチ
+            if (*(text + seek) == L'\0')
+                break;
+            ++seek;                                                     //  ゼロ幅はインクリメントしないと無限ループになる
+        }
+        if (!opt.all)                                                   //  反復探索を行わない
+            break;
     }
     auto end = chrono::system_clock::now();                             //  実行時間の計測終了
 
@@ -0,0 +1,889 @@
+/******************************************************************************
+ *                                                                            *
+ *  regex_test.cpp                                                            *
+ *  Copyright (c) 2020 Gen Inomata. All rights reserved.                      *
+ *                                                                            *
+ ******************************************************************************/
+
+//  regex.hの動作確認。パターンとテキストの組を照合して期待どおりの結果になるか、
+//  同じ照合を別の経路(従来型NFAエンジンなど)で行って結果が揃うかを確かめる。
+//  失敗した項目を表示し、一つでもあれば終了コード1で終わる
+
+#include "regex.h"
+
+#ifdef _MSC_VER
+#pragma comment(linker, "/STACK:8388608")    //  スタックサイズ8M
+#endif
+
+#include <algorithm>
+#include <clocale>
+#include <cstring>
+#include <iterator>
+#include <iostream>
+#include <memory_resource>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace nfa_plus_ttable;
+
+static int failures = 0;
+static mt19937 rng(1);
+
+//---------------------------------------------------------------------
+//  確認する。条件が偽なら項目名と対象を表示する
+//---------------------------------------------------------------------
+static void check(const bool ok, const wchar_t* what, const wstring& pattern, const wstring& text = L"")
+{
+    if (ok)
+        return;
+    failures++;
+    wcout << L"NG  " << what << L"  /" << pattern << L"/";
+    if (!text.empty())
+        wcout << L"  [" << (text.size() > 40 ? text.substr(0, 40) + L"..." : text) << L"]";
+    wcout << endl;
+}
+
+//---------------------------------------------------------------------
+//  一致した位置(一致しなければ-1)
+//---------------------------------------------------------------------
+static intptr_t position(const regex_result& r)
+{
+    return r.size() ? r.position(0) : -1;
+}
+
+//---------------------------------------------------------------------
+//  一致の範囲とキャプチャが全て同じか
+//---------------------------------------------------------------------
+static bool same(const regex_result& a, const regex_result& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a.position(i) != b.position(i) || a.length(i) != b.length(i))
+            return false;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+//  alphabetの文字を並べた、長さがmax_len未満のテキスト
+//---------------------------------------------------------------------
+static wstring random_text(const wstring& alphabet, const size_t max_len)
+{
+    wstring s;
+    const size_t len = rng() % max_len;
+    for (size_t i = 0; i < len; i++)
+        s += alphabet[rng() % alphabet.size()];
+    return s;
+}
+
+//---------------------------------------------------------------------
+//  パターンをテキストに照合し、一致の位置と長さが期待どおりか(posが-1なら一致しないこと)
+//---------------------------------------------------------------------
+static void expect(const wchar_t* pattern, const wstring& text, const int options, const intptr_t pos, const size_t len = 0)
+{
+    regex_compiled re(pattern);
+    regex_ptt ptt;
+    auto r = ptt.match(text.c_str(), re, options);
+    check(re.err_msg().empty() && !r.is_error(), L"compile/match error", pattern, text);
+    check(position(r) == pos && (pos < 0 || r.length(0) == len), L"expected match", pattern, text);
+}
+
+//---------------------------------------------------------------------
+//  置換表を使う照合と従来型NFAエンジン(regex_ptt::NORMAL)の結果が揃うか
+//  (alphabetの文字を並べたテキストで試す。どちらかが制限に達したものは比べない)
+//---------------------------------------------------------------------
+static void against_normal(const vector<const wchar_t*>& patterns, const wstring& alphabet, const int options, const int rounds = 100)
+{
+    regex_ptt p, q;
+    for (auto pattern : patterns) {
+        regex_compiled re(pattern);
+        check(re.err_msg().empty(), L"compile", pattern);
+        for (int i = 0; i < rounds; i++) {
+            const wstring text = random_text(alphabet, 24);
+            auto a = p.match(text.c_str(), re, options);
+            auto b = q.match(text.c_str(), re, options | regex_ptt::NORMAL);
+            if (!a.is_error() && !b.is_error())
+                check(same(a, b), L"NORMAL/match", pattern, text);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  Latin-1の文字だけのテキストを、regex_ptt::test(const char*)に渡す形にする
+//---------------------------------------------------------------------
+static string latin1(const wstring& text)
+{
+    string ret;
+    for (auto c : text)
+        ret += static_cast<char>(c);
+    return ret;
+}
+
+//---------------------------------------------------------------------
+//  regex_ptt::matchを前の一致の末尾(空の一致なら次の位置)から繰り返した一致の並び
+//  (regex_pool::match_all、regex_streamなどが返すものと同じになるはず)
+//---------------------------------------------------------------------
+static vector<regex_result> all_matches(const wstring& text, const regex_compiled& re, const int options = 0)
+{
+    vector<regex_result> ret;
+    regex_ptt ptt;
+    for (intptr_t seek = 0; seek <= static_cast<intptr_t>(text.size());) {
+        auto r = ptt.match(text.c_str(), re, options | regex_ptt::SEARCH, seek, static_cast<intptr_t>(text.size()));
+        if (!r)
+            break;
+        seek = r.position(0) + static_cast<intptr_t>(r.length(0)) + (r.length(0) == 0);
+        ret.push_back(r);
+    }
+    return ret;
+}
+
+//---------------------------------------------------------------------
+//  一致の並びが同じか
+//---------------------------------------------------------------------
+static bool same(const vector<regex_result>& a, const vector<regex_result>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (!same(a[i], b[i]))
+            return false;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+//  本体が空に一致し得るループ(ε遷移無限ループの監視が要るもの)と、そうでないループ
+//---------------------------------------------------------------------
+static void nullable()
+{
+    expect(L"(a*)*b", L"aaab", 0, 0, 4);
+    expect(L"(a|)*c", L"aac", 0, 0, 3);
+    expect(L"(a?)+b", L"xb", regex_ptt::SEARCH, 1, 1);
+    expect(L"(a*)*", L"aa", 0, 0, 2);
+    expect(L"(a|b)*c", L"ababc", 0, 0, 5);
+    expect(L"(a*|b)*c", L"abx", regex_ptt::SEARCH, -1);
+    against_normal({ L"(a*)*b", L"(a|b*)*c", L"(ab|a?)+b", L"((a)|b)*", L"(a+)*c", L"(a|b)*" }, L"abc", regex_ptt::SEARCH);
+}
+
+//---------------------------------------------------------------------
+//  アトミックグループ、強欲な量指定子と、最長一致ループの自動強欲化
+//  (自動強欲化は、後続と共通の文字を持つループに掛かると一致が変わる)
+//---------------------------------------------------------------------
+static void possessive()
+{
+    expect(L"(?>a+)a", L"aaa", regex_ptt::SEARCH, -1);
+    expect(L"a++a", L"aaa", regex_ptt::SEARCH, -1);
+    expect(L"a*+b", L"aab", 0, 0, 3);
+    expect(L"(?>ab|a)c", L"ac", 0, 0, 2);
+    expect(L"(?>a|ab)c", L"abc", regex_ptt::SEARCH, -1);
+    expect(L"x(?>a+|b)*y", L"xaabay", 0, 0, 6);
+
+    expect(L"\\d+[a-z]", L"123x", 0, 0, 4);
+    expect(L"a+a", L"aaa", 0, 0, 3);
+    expect(L"[ab]+b", L"abab", 0, 0, 4);
+    expect(L"a*\\w", L"aaa", 0, 0, 3);
+    expect(L"\\w+\\s", L"ab c", regex_ptt::SEARCH, 0, 3);
+    expect(L"\\d+\\D", L"12a", 0, 0, 3);
+    expect(L"\\D+\\d", L"ab1", 0, 0, 3);
+    expect(L"[^\"]*\"", L"ab\"", 0, 0, 3);
+    expect(L"a+A", L"aa", regex_ptt::NOCASE, 0, 2);
+    expect(L"a+(b|a)", L"aaa", 0, 0, 3);
+    against_normal({ L"(?>a*)b", L"(?>a|ab)*c", L"a*+b|a", L"(a+|b)++c", L"(?>(a)|b)+\\1" }, L"abc", regex_ptt::SEARCH);
+}
+
+//---------------------------------------------------------------------
+//  一文字の繰り返し(RUN)。長いテキストでも再帰の深さの制限に達しない
+//---------------------------------------------------------------------
+static void runs()
+{
+    expect(L"a{3}", L"aaaa", regex_ptt::SEARCH, 0, 3);
+    expect(L"a{2,3}?", L"aaaa", regex_ptt::SEARCH, 0, 2);
+    expect(L"[a-c]{2,}x", L"abcx", 0, 0, 4);
+    expect(L".+", L"ab\ncd", regex_ptt::SEARCH, 0, 2);
+    expect(L"a.*?b", L"xacbcb", regex_ptt::SEARCH, 1, 3);
+    expect(L"a{0}b", L"ab", regex_ptt::SEARCH, 1, 1);
+
+    const wstring text = wstring(200000, L'a') + L"b";
+    expect(L"a*b", text, 0, 0, text.size());
+    expect(L"[ab]+?b", text, 0, 0, text.size());
+    expect(L"x*a+?c", text, 0, -1);
+    against_normal({ L"a{2,4}b", L"[ab]{3}?c", L"(a{1,3}|b)+c", L"a*?b+", L"\\w{2,}?a" }, L"abc", regex_ptt::SEARCH);
+
+    //  回数の上限はCOUNT_MAX。超えれば構文エラー
+    expect(L"a{65535}", wstring(65535, L'a'), 0, 0, 65535);
+    for (auto pattern : { L"a{65536}", L"a{3000000000}", L"a{1,2147483648}" })
+        check(!regex_compiled(pattern).err_msg().empty(), L"count limit", pattern);
+}
+
+//---------------------------------------------------------------------
+//  マッチ長の下限と上限
+//---------------------------------------------------------------------
+static void lengths()
+{
+    struct item {
+        const wchar_t* pattern;
+        intptr_t       min;
+        intptr_t       max;     //  -1は上限なし
+    };
+    const item items[] = {
+        { L"abc", 3, 3 }, { L"a+b", 2, -1 }, { L"(ab){2,3}", 4, 6 }, { L"a|bcd", 1, 3 },
+        { L"a?", 0, 1 }, { L"x{70}", 70, 70 }, { L"(a)\\1", 1, -1 }, { L"^a$", 1, 1 },
+    };
+    for (auto& it : items) {
+        regex_compiled re(it.pattern);
+        check(re.min_length() == it.min && re.max_length() == it.max, L"min/max length", it.pattern);
+    }
+    expect(L"abcd", L"abc", regex_ptt::SEARCH, -1);
+    expect(L"a{3}", L"aaaa", 0, -1);
+    expect(L"a{3}", L"aaa", 0, 0, 3);
+    expect(L"(a)\\1", L"aa", 0, 0, 2);
+}
+
+//---------------------------------------------------------------------
+//  先頭の「^」で行頭だけを探すregex_ptt::SEARCH
+//---------------------------------------------------------------------
+static void anchored()
+{
+    expect(L"^ab", L"xab\nab", regex_ptt::SEARCH, 4, 2);
+    expect(L"^ab", L"xab\nab", regex_ptt::SEARCH | regex_ptt::SINGLE, -1);
+    expect(L"^x", L"a\n\nx", regex_ptt::SEARCH, 3, 1);
+    expect(L"^(b|a)c", L"ac", regex_ptt::SEARCH, 0, 2);
+    expect(L"^b", L"ab", regex_ptt::SEARCH, -1);
+    against_normal({ L"^a+", L"^(a|b)c", L"^\\w+$", L"^$" }, L"ab\n", regex_ptt::SEARCH);
+}
+
+//---------------------------------------------------------------------
+//  末尾「$」で終わるパターンの逆向きの探索とfind_last
+//---------------------------------------------------------------------
+static void backward()
+{
+    expect(L"\\.(log|gz)$", L"a.log.gz", regex_ptt::SEARCH, 5, 3);
+    expect(L"b$", L"bab", regex_ptt::SEARCH, 2, 1);
+    expect(L"(a|ab)b*$", L"xabb", regex_ptt::SEARCH, 1, 3);
+
+    struct item {
+        const wchar_t* pattern;
+        const wchar_t* text;
+        intptr_t       pos;     //  -1は一致しない
+        size_t         len;
+    };
+    const item items[] = {
+        { L"ab", L"ab ab ab", 6, 2 }, { L"a+", L"aa baa", 5, 1 }, { L"x", L"ab", -1, 0 },
+        { L"b$", L"bab", 2, 1 }, { L"(a|b)c$", L"acbc", 2, 2 }, { L"a|b", L"xaxb", 3, 1 },
+    };
+    regex_ptt ptt;
+    for (auto& it : items) {
+        regex_compiled re(it.pattern);
+        auto r = ptt.find_last(it.text, re);
+        check(position(r) == it.pos && (it.pos < 0 || r.length(0) == it.len), L"find_last", it.pattern, it.text);
+    }
+}
+
+//  回数の大きい{n,m}を含むパターン(状態集合による探索とバックトラックの切り替わるRUN_MAXの前後)
+static const wchar_t* const bound_patterns[] = {
+    L"xa{1,70}y", L".{70}x|a{1,3}y", L"a{64}b", L"a{65}b", L"a{63,65}", L"[ab]{2,100}c",
+    L"(?:xa{1,70}y|a{2,3}z)", L"a{66,}b", L"b{70}?a", L"x\\w{65}y",
+};
+
+//---------------------------------------------------------------------
+//  回数の大きい{n,m}を試すテキスト
+//---------------------------------------------------------------------
+static vector<wstring> bound_texts()
+{
+    vector<wstring> texts = { L"x" + wstring(100, L'a') + L"y xaaay", L"x" + wstring(100, L'a') + L"y",
+                              wstring(65, L'b') + L"ay", wstring(64, L'a') + L"b", wstring(65, L'a') + L"b" };
+    for (int i = 0; i < 200; i++)
+        texts.push_back(random_text(L"abxyz", 200));
+    return texts;
+}
+
+//---------------------------------------------------------------------
+//  regex_ptt::testとregex_ptt::NOCAPTUREが、matchと同じ位置に一致するか
+//---------------------------------------------------------------------
+static void match_only()
+{
+    regex_ptt ptt;
+    for (auto& text : bound_texts()) {
+        for (auto pattern : bound_patterns) {
+            regex_compiled re(pattern);
+            auto r = ptt.match(text.c_str(), re, regex_ptt::SEARCH);
+            check(ptt.test(text.c_str(), re, regex_ptt::SEARCH) == static_cast<bool>(r), L"test/match", pattern, text);
+            auto nc = ptt.match(text.c_str(), re, regex_ptt::SEARCH | regex_ptt::NOCAPTURE);
+            check(position(nc) == position(r) && (!r || nc.length(0) == r.length(0)), L"NOCAPTURE/match", pattern, text);
+        }
+    }
+    const wchar_t* patterns[] = { L"(a|b)*c", L"a(b+)?c", L"(a)\\1", L"(?>a+)b", L"\\bab", L"x$|y" };
+    for (auto pattern : patterns) {
+        regex_compiled re(pattern);
+        for (int i = 0; i < 100; i++) {
+            const wstring text = random_text(L"abcxy ", 30);
+            auto r = ptt.match(text.c_str(), re, regex_ptt::SEARCH);
+            check(ptt.test(text.c_str(), re, regex_ptt::SEARCH) == static_cast<bool>(r), L"test/match", pattern, text);
+            auto nc = ptt.match(text.c_str(), re, regex_ptt::SEARCH | regex_ptt::NOCAPTURE);
+            check(position(nc) == position(r) && (!r || nc.length(0) == r.length(0)), L"NOCAPTURE/match", pattern, text);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  一致の範囲を求めてからキャプチャを求める照合が、従来型NFAエンジンと同じキャプチャを返すか
+//---------------------------------------------------------------------
+static void captures()
+{
+    against_normal({ L"(a|b)*c", L"(a+)(b*)c", L"x(a|ab)(c|bcd)", L"(ab){2,3}?c", L"(a|b){2,4}?b",
+                     L"(a{1,3})+b", L"((a)|(b))+", L"(a*)*?b", L"a(b)?c|(a)" }, L"abcx", regex_ptt::SEARCH);
+    regex_ptt p, q;
+    for (auto& text : bound_texts()) {
+        for (auto pattern : { L"(xa{1,70})y", L"(x|a{65})+b", L"(a{63,65})", L"(b{70}?)(a)" }) {
+            regex_compiled re(pattern);
+            auto a = p.match(text.c_str(), re, regex_ptt::SEARCH);
+            auto b = q.match(text.c_str(), re, regex_ptt::SEARCH | regex_ptt::NORMAL);
+            if (!a.is_error() && !b.is_error())
+                check(same(a, b), L"NORMAL/match", pattern, text);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  後方参照を含むパターン(置換表のキーにキャプチャの状態を含める)
+//---------------------------------------------------------------------
+static void backrefs()
+{
+    expect(L"(a|b)\\1", L"abb", regex_ptt::SEARCH, 1, 2);
+    expect(L"^(a+)\\1$", L"aaaa", regex_ptt::SEARCH, 0, 4);
+    expect(L"^(a+)\\1$", L"aaa", regex_ptt::SEARCH, -1);
+    expect(L"(a)\\2", L"aa", regex_ptt::SEARCH, -1);
+    expect(L"(a)|b\\1", L"b", regex_ptt::SEARCH, -1);
+    against_normal({ L"(a|b)\\1", L"(\\w+)-\\1", L"(a*)b\\1", L"((a)|b)+\\2", L"(a|b)*\\1c", L"(a)(b)?\\2" }, L"ab-c", regex_ptt::SEARCH);
+
+    //  キャプチャの状態が置換表を初期化する数(MAX_STATES)を超えるテキスト
+    wstring text;
+    for (int i = 0; i < 3000; i++)
+        text += to_wstring(i) + L"x ";
+    expect(L"(\\w+) \\1", text + L"ab ab", regex_ptt::SEARCH, static_cast<intptr_t>(text.size()), 5);
+}
+
+//---------------------------------------------------------------------
+//  Unicodeの文字プロパティによる\w、\d、\s、\bと、大文字小文字の環によるregex_ptt::NOCASE
+//---------------------------------------------------------------------
+static void properties()
+{
+    expect(L"\\w+", L"\u00e9\u65e5\u672c_1", 0, 0, 5);
+    expect(L"\\W", L"\u00e9", regex_ptt::SEARCH, -1);
+    expect(L"\\d+", L"\u0661\u0662", 0, 0, 2);
+    expect(L"\\s", L"a\u3000", regex_ptt::SEARCH, 1, 1);
+    expect(L"\\S", L"\u3000", regex_ptt::SEARCH, -1);
+    expect(L"\\b\u00e9", L"a\u00e9 \u00e9", regex_ptt::SEARCH, 3, 1);
+
+    expect(L"k", L"\u212a", regex_ptt::NOCASE, 0, 1);
+    expect(L"\u03a3+", L"\u03c3\u03c2", regex_ptt::NOCASE, 0, 2);
+    expect(L"[\u00e0-\u00ff]+", L"\u00c0\u00c9", regex_ptt::NOCASE, 0, 2);
+    expect(L"\u0436", L"\u0416", regex_ptt::NOCASE, 0, 1);
+    expect(L"[a-z]", L"\u212a", regex_ptt::NOCASE, 0, 1);
+    expect(L"k+\u212a", L"kk", regex_ptt::NOCASE, 0, 2);
+    expect(L"\u00e9", L"\u00c9", 0, -1);
+}
+
+//---------------------------------------------------------------------
+//  regex_ptt::NOCASEで、小文字だけのパターンが、小文字にそろえたテキストと同じ位置に一致するか
+//  (コンパイル時に作る大文字小文字を区別しない表と、一致の先頭になり得る文字)
+//---------------------------------------------------------------------
+static void nocase()
+{
+    expect(L"[^a]", L"A", regex_ptt::NOCASE, -1);
+    expect(L"[^a]", L"b", regex_ptt::NOCASE, 0, 1);
+    expect(L"\u00e9+", L"xx\u00c9\u00c9", regex_ptt::SEARCH | regex_ptt::NOCASE, 2, 2);
+    expect(L"[a-z]+\\d", L"--AbC1", regex_ptt::SEARCH | regex_ptt::NOCASE, 2, 4);
+
+    const wchar_t* patterns[] = { L"a+b", L"[ab]+\u00e9", L"(a|\u00e9)b*", L"[^a]+b", L"\\w+\u00e9", L".\u00e9", L"b[^\u00e9]" };
+    auto fold = [](wstring s) {
+        for (auto& c : s)
+            c = (c == L'A') ? L'a' : (c == L'B') ? L'b' : (c == L'\u00c9') ? L'\u00e9' : c;
+        return s;
+    };
+    regex_ptt ptt;
+    for (auto pattern : patterns) {
+        regex_compiled re(pattern);
+        for (int i = 0; i < 200; i++) {
+            const wstring text = random_text(L"aAbB\u00e9\u00c9x", 20);
+            auto a = ptt.match(text.c_str(), re, regex_ptt::SEARCH | regex_ptt::NOCASE);
+            auto b = ptt.match(fold(text).c_str(), re, regex_ptt::SEARCH);
+            check(same(a, b), L"NOCASE/folded", pattern, text);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  Latin-1のテキスト(const char*)とwchar_tのテキストで、test、matchの結果が揃うか
+//---------------------------------------------------------------------
+static void narrow()
+{
+    const wchar_t* atoms[] = { L".", L"[ab]", L"[^a\\n]", L"\\w", L"\\W", L"\\s", L"\\d", L"\\b", L"\\B", L"^", L"$",
+                               L"a", L"b", L"\u00e9", L"\u00c9", L"x", L"[\u00e0-\u00ff]", L"\u0100", L"[a-c\u0101]", L"\\n" };
+    const wstring alphabet = L"abx \n1\u00e9\u00c9\u00e0A_\u00ff";
+    regex_ptt p, q;
+    for (int i = 0; i < 400; i++) {
+        wstring pattern;
+        const int n = 1 + rng() % 4;
+        for (int k = 0; k < n; k++) {
+            wstring a = atoms[rng() % size(atoms)];
+            const wchar_t* quant[] = { L"", L"", L"*", L"+", L"?", L"{1,3}", L"{70}" };
+            if (a.size() > 1 || wstring(L"^$").find(a) == wstring::npos)
+                a += quant[rng() % size(quant)];
+            pattern += a;
+        }
+        if (rng() % 4 == 0)
+            pattern = L"(" + pattern + L")|" + atoms[rng() % size(atoms)];
+        regex_compiled re(pattern.c_str());
+        if (!re.err_msg().empty())
+            continue;
+        for (int k = 0; k < 4; k++) {
+            const wstring text = random_text(alphabet, 40);
+            const string s = latin1(text);
+            const int options = (rng() % 4 ? regex_ptt::SEARCH : 0) | (rng() % 4 ? 0 : regex_ptt::NOCASE) | (rng() % 5 ? 0 : regex_ptt::SINGLE);
+            const intptr_t seek = rng() % 4 ? 0 : rng() % (text.size() + 1);
+            auto a = p.match(text.c_str(), re, options, seek);
+            auto b = q.match(s.c_str(), re, options, seek);
+            check(same(a, b), L"match(char)/match", pattern, text);
+            check(p.test(text.c_str(), re, options, seek) == static_cast<bool>(a), L"test/match", pattern, text);
+            check(q.test(s.c_str(), re, options, seek) == static_cast<bool>(a), L"test(char)/match", pattern, text);
+        }
+    }
+    regex_ptt ptt;
+    for (auto& text : bound_texts()) {
+        const string s = latin1(text);
+        for (auto pattern : bound_patterns) {
+            regex_compiled re(pattern);
+            check(ptt.test(s.c_str(), re, regex_ptt::SEARCH) == static_cast<bool>(ptt.match(text.c_str(), re, regex_ptt::SEARCH)),
+                  L"test(char)/match", pattern, text);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  SIMDで読み飛ばす長いテキスト(一致の位置をずらして、ベクトルの境目をまたがせる)
+//---------------------------------------------------------------------
+static void simd_scan()
+{
+    for (size_t pad = 0; pad < 40; pad++) {
+        const wstring head(pad, L'-');
+        const wstring lower(1000, L'q');
+        expect(L"[a-z]+", head + lower + L"A", regex_ptt::SEARCH, static_cast<intptr_t>(pad), 1000);
+        expect(L"needle", head + lower + L"needle", regex_ptt::SEARCH, static_cast<intptr_t>(pad + 1000), 6);
+        expect(L"NEEDLE", head + lower + L"nEeDle", regex_ptt::SEARCH | regex_ptt::NOCASE, static_cast<intptr_t>(pad + 1000), 6);
+        expect(L"[xyz]\\d", head + lower + L"y7", regex_ptt::SEARCH, static_cast<intptr_t>(pad + 1000), 2);
+        expect(L"[\u03b1-\u03c9]+", head + lower + L"\u03b1\u03b2", regex_ptt::SEARCH, static_cast<intptr_t>(pad + 1000), 2);
+        expect(L"^b", head + lower + L"\nb", regex_ptt::SEARCH, static_cast<intptr_t>(pad + 1001), 1);
+        expect(L".*x", head + lower + L"\nqx", regex_ptt::SEARCH, static_cast<intptr_t>(pad + 1001), 2);
+        expect(L"[^q-]+", head + lower, regex_ptt::SEARCH, -1);
+    }
+}
+
+//---------------------------------------------------------------------
+//  regex_setの結果が、パターン毎のmatchと揃うか
+//---------------------------------------------------------------------
+static void sets()
+{
+    auto compare = [](const vector<wstring>& patterns, const vector<wstring>& texts) {
+        regex_set set(patterns);
+        check(set.err_msg().empty() && set.size() == patterns.size(), L"regex_set", L"");
+        regex_ptt ptt;
+        for (auto& text : texts) {
+            auto hits = ptt.test(text.c_str(), set, regex_ptt::SEARCH);
+            auto found = ptt.match(text.c_str(), set, regex_ptt::SEARCH);
+            for (size_t k = 0; k < patterns.size(); k++) {
+                regex_compiled re(patterns[k].c_str());
+                auto r = ptt.match(text.c_str(), re, regex_ptt::SEARCH);
+                const bool in = std::find(hits.begin(), hits.end(), static_cast<int>(k)) != hits.end();
+                check(in == static_cast<bool>(r), L"regex_set test/match", patterns[k], text);
+                intptr_t at = -1;
+                for (auto& f : found) {
+                    if (f.first == static_cast<int>(k))
+                        at = position(f.second);
+                }
+                check(at == position(r), L"regex_set match/match", patterns[k], text);
+            }
+        }
+    };
+    compare(vector<wstring>(begin(bound_patterns), end(bound_patterns)), bound_texts());
+
+    vector<wstring> texts;
+    for (int i = 0; i < 300; i++)
+        texts.push_back(random_text(L"abcdefoxr1 ", 40));
+    compare({ L"foo\\d+", L"bar", L"(ab|cd)ef", L"x*", L"^a", L"c$", L"(a)\\1", L"\\bb", L"a[^b]{2,}?f" }, texts);
+}
+
+//---------------------------------------------------------------------
+//  複数の文字列の照合(regex_ptt、regex_pool)が、文字列毎のmatchと揃うか
+//---------------------------------------------------------------------
+static void batch()
+{
+    vector<wstring> texts;
+    for (int i = 0; i < 5000; i++)
+        texts.push_back(random_text(L"abc1 ", 30));
+    vector<wstring_view> records(texts.begin(), texts.end());
+    regex_pool pool(4);
+    regex_ptt ptt;
+    for (auto pattern : { L"a+b", L"(a|b)\\1", L"^c", L"\\d$", L"b{2,}?c" }) {
+        regex_compiled re(pattern);
+        vector<uint64_t> selection((records.size() + 63) / 64);
+        vector<pair<intptr_t, size_t>> offsets(records.size());
+        const size_t tested = ptt.test(records.data(), records.size(), re, regex_ptt::SEARCH, selection.data());
+        const size_t matched = ptt.match(records.data(), records.size(), re, regex_ptt::SEARCH, offsets.data());
+        auto pool_selection = pool.test(records.data(), records.size(), re, regex_ptt::SEARCH);
+        auto pool_offsets = pool.match(records.data(), records.size(), re, regex_ptt::SEARCH);
+        check(pool.error().empty() && pool_selection == selection && pool_offsets == offsets, L"regex_pool/regex_ptt", pattern);
+
+        size_t count = 0;
+        for (size_t i = 0; i < texts.size(); i++) {
+            auto r = ptt.match(texts[i].c_str(), re, regex_ptt::SEARCH);
+            count += static_cast<bool>(r);
+            const bool bit = (selection[i / 64] >> (i % 64)) & 1;
+            check(bit == static_cast<bool>(r) && offsets[i].first == position(r) && (!r || offsets[i].second == r.length(0)),
+                  L"records/match", pattern, texts[i]);
+        }
+        check(tested == count && matched == count, L"records count", pattern);
+    }
+}
+
+//---------------------------------------------------------------------
+//  一つの長いテキストを区間に分けたregex_pool::match_allが、前から順に探した一致と揃うか
+//---------------------------------------------------------------------
+static void pool_all()
+{
+    wstring text;
+    while (text.size() < 150000)
+        text += random_text(L"abc\n x", 60);
+    regex_pool pool(4);
+    for (auto pattern : { L"a+b", L"x[^\\n]*c", L"^b", L"(a|b)\\1", L"a{0,3}", L"c\\s+x" }) {
+        regex_compiled re(pattern);
+        auto found = pool.match_all(text.c_str(), re, 0, static_cast<intptr_t>(text.size()));
+        check(pool.error().empty() && same(found, all_matches(text, re)), L"regex_pool::match_all", pattern);
+    }
+}
+
+//---------------------------------------------------------------------
+//  塊毎に渡したregex_streamの一致が、テキスト全体を前から順に探した一致と揃うか
+//---------------------------------------------------------------------
+static void stream()
+{
+    const size_t pieces[] = { 1, 2, 7, 64, 1000 };
+    for (auto pattern : { L"ab+c", L"\\w+", L"a.*?b", L"^x", L"(a)\\1", L"b$", L"\\bab\\b", L"a{2,70}c", L"x?" }) {
+        regex_compiled re(pattern);
+        for (int i = 0; i < 5; i++) {
+            wstring text;
+            while (text.size() < 2000)
+                text += random_text(L"abcx \n", 80);
+            const auto expected = all_matches(text, re);
+            for (auto piece : pieces) {
+                regex_stream st(re);
+                vector<regex_result> found;
+                for (size_t at = 0; at < text.size(); at += piece) {
+                    auto r = st.feed(text.data() + at, std::min(piece, text.size() - at));
+                    found.insert(found.end(), r.begin(), r.end());
+                }
+                auto r = st.finish();
+                found.insert(found.end(), r.begin(), r.end());
+                check(st.error().empty() && same(found, expected), L"regex_stream", pattern, text);
+            }
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  分かれた文字列のregex_stream::match_allが、つないだテキストの一致と揃うか
+//---------------------------------------------------------------------
+static void segments()
+{
+    for (auto pattern : { L"ab+c", L"\\w+", L"^x", L"(a)\\1", L"b$", L"a{2,70}c" }) {
+        regex_compiled re(pattern);
+        for (int i = 0; i < 50; i++) {
+            vector<wstring> parts;
+            wstring text;
+            for (int k = rng() % 8; k >= 0; k--) {
+                parts.push_back(random_text(L"abcx \n", 300));
+                text += parts.back();
+            }
+            vector<wstring_view> views(parts.begin(), parts.end());
+            regex_stream st(re);
+            auto found = st.match_all(views.data(), views.size());
+            check(st.error().empty() && same(found, all_matches(text, re)), L"regex_stream::match_all", pattern, text);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  後方参照、アトミックグループ、回数の大きい{n,m}を含むパターンのregex_ptt::PARTIAL
+//---------------------------------------------------------------------
+static void partial()
+{
+    struct item {
+        const wchar_t* pattern;
+        wstring        text;        //  一致しない(途切れた)テキスト
+        wstring        rest;        //  続けると一致する
+        int            options;
+    };
+    const item items[] = {
+        { L"(a)\\1",      L"a",                       L"a",   0 },
+        { L"(a)\\1",      L"xa",                      L"a",   regex_ptt::SEARCH },
+        { L"(\\w+)-\\1",  L"ab-a",                    L"b",   regex_ptt::SEARCH },
+        { L"xa{1,70}y",   L"x" + wstring(49, L'a'),   L"y",   0 },
+        { L"(?>ab|a)c",   L"ab",                      L"c",   regex_ptt::SEARCH },
+        { L"(?>a+)b",     L"zaa",                     L"ab",  regex_ptt::SEARCH },
+        { L"a++b",        L"aa",                      L"b",   0 },
+        { L"ab+c",        L"xab",                     L"bc",  regex_ptt::SEARCH },
+    };
+    regex_ptt ptt;
+    for (auto& it : items) {
+        regex_compiled re(it.pattern);
+        auto r = ptt.match(it.text.c_str(), re, it.options | regex_ptt::PARTIAL);
+        check(!r && r.is_partial(), L"PARTIAL", it.pattern, it.text);
+        const wstring whole = it.text + it.rest;
+        auto resumed = ptt.resume(whole.c_str());
+        auto direct = ptt.match(whole.c_str(), re, it.options);
+        check(static_cast<bool>(direct), L"PARTIAL(direct)", it.pattern, whole);
+        check(position(resumed) == position(direct) && (!resumed || resumed.length(0) == direct.length(0)),
+              L"resume/match", it.pattern, whole);
+    }
+    expect(L"abc", L"xyz", regex_ptt::SEARCH | regex_ptt::PARTIAL, -1);
+}
+
+//---------------------------------------------------------------------
+//  編集毎に照合し直したregex_incrementalの一致が、編集後のテキストの一致と揃うか
+//---------------------------------------------------------------------
+static void incremental()
+{
+    for (auto pattern : { L"ab+c", L"\\w+", L"^x.*", L"(a)\\1", L"b$", L"a{2,70}c" }) {
+        regex_compiled re(pattern);
+        wstring text;
+        while (text.size() < 20000)
+            text += random_text(L"abcx \n", 80);
+        regex_incremental inc(re);
+        inc.assign(text.c_str(), static_cast<intptr_t>(text.size()));
+        for (int i = 0; i < 60; i++) {
+            const intptr_t pos = rng() % (text.size() + 1);
+            const intptr_t removed = std::min<intptr_t>(rng() % 20, static_cast<intptr_t>(text.size()) - pos);
+            const wstring inserted = random_text(L"abcx \n", 20);
+            text.replace(pos, removed, inserted);
+            inc.edit(text.c_str(), static_cast<intptr_t>(text.size()), pos, removed, static_cast<intptr_t>(inserted.size()));
+            const auto expected = all_matches(text, re);
+            check(inc.error().empty() && inc.size() == expected.size() && same(inc.matches(), expected), L"regex_incremental", pattern);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  少しずつ進めたregex_job(とregex_task)の結果が、matchと揃うか
+//---------------------------------------------------------------------
+static void sliced()
+{
+    regex_ptt ptt;
+    for (auto pattern : { L"ab+c", L"(a|b)*c", L"(a)\\1", L"(?>a+)b", L"x$", L"a{2,70}c" }) {
+        regex_compiled re(pattern);
+        for (int i = 0; i < 30; i++) {
+            const wstring text = random_text(L"abcx", 2000);
+            for (const int options : { 0, static_cast<int>(regex_ptt::SEARCH) }) {
+                auto r = ptt.match(text.c_str(), re, options);
+                regex_job job(re, text.c_str(), options);
+                int calls = 0;
+                while (!job.run(1 + rng() % 50))
+                    calls++;
+                check(!job.pending() && same(job.result(), r), L"regex_job/match", pattern, text);
+#ifdef REGEX_PTT_COROUTINE
+                auto task = match_sliced(re, text.c_str(), options, 16);
+                while (!task.resume())
+                    ;
+                check(same(task.result(), r), L"regex_task/match", pattern, text);
+#endif
+                (void)calls;
+            }
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  オブジェクトの中に持つ数(regex_result::INLINE)を超えるキャプチャと、呼び出し側の領域に書くmatch
+//---------------------------------------------------------------------
+static void results()
+{
+    const wchar_t* pattern = L"(a)(b)(c)(d)(e)(f)(g)(h)(i)(j)(x)?";
+    const wstring text = L"--abcdefghij";
+    regex_compiled re(pattern);
+    regex_ptt ptt;
+    auto r = ptt.match(text.c_str(), re, regex_ptt::SEARCH);
+    check(r.size() == 12 && r.size() > regex_result::INLINE && r.position(0) == 2 && r.length(0) == 10, L"captures", pattern, text);
+    for (size_t i = 1; i <= 10 && i < r.size(); i++)
+        check(r.position(i) == static_cast<intptr_t>(i + 1) && r.length(i) == 1, L"capture", pattern, text);
+    auto copy = r;
+    regex_result moved = std::move(copy);
+    check(same(r, moved) && r.code() == regex_result::errc::NONE, L"copy/move", pattern, text);
+
+    vector<pair<intptr_t, size_t>> captures(4, { -1, 9 });
+    check(ptt.match(text.c_str(), re, regex_ptt::SEARCH, 0, -1, captures.data(), captures.size()), L"match(captures)", pattern, text);
+    for (size_t i = 0; i < captures.size(); i++)
+        check(captures[i].first == r.position(i) && captures[i].second == r.length(i), L"match(captures)", pattern, text);
+    check(!ptt.match(L"abc", re, 0, 0, -1, captures.data(), captures.size()), L"match(captures) no match", pattern);
+}
+
+//---------------------------------------------------------------------
+//  呼び出し側のメモリリソースを使うregex_compiled、regex_pttの結果が、既定のものと揃うか
+//---------------------------------------------------------------------
+static void resources()
+{
+    std::pmr::monotonic_buffer_resource resource;
+    regex_ptt p(&resource), q;
+    for (auto pattern : { L"(a|b)*c", L"a{2,70}c", L"(a)\\1", L"\\w+\\s", L"(?>a+)b" }) {
+        regex_compiled a(pattern, &resource), b(pattern);
+        for (int i = 0; i < 50; i++) {
+            const wstring text = random_text(L"abc ", 100);
+            check(same(p.match(text.c_str(), a, regex_ptt::SEARCH), q.match(text.c_str(), b, regex_ptt::SEARCH)), L"pmr/match", pattern, text);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+//  regex_cacheの共有、追い出しと、同時に求められたパターンのコンパイル
+//---------------------------------------------------------------------
+static void cache()
+{
+    regex_cache cache(1 << 20);
+    auto a = cache.get(L"a+b");
+    auto b = cache.get(L"a+b");
+    check(a == b && cache.hits() == 1 && cache.misses() == 1, L"regex_cache get", L"a+b");
+    check(!cache.get(L"a(")->err_msg().empty(), L"regex_cache error", L"a(");
+
+    //  同じパターンを同時に求めても、コンパイルは一度だけ
+    vector<thread> threads;
+    vector<regex_cache::handle> got(8);
+    for (size_t i = 0; i < got.size(); i++)
+        threads.emplace_back([&cache, &got, i] { got[i] = cache.get(L"(x|y)+z"); });
+    for (auto& t : threads)
+        t.join();
+    check(cache.misses() == 3 && std::all_of(got.begin(), got.end(), [&got](auto& h) { return h == got[0]; }), L"regex_cache threads", L"(x|y)+z");
+
+    //  容量を超えれば追い出すが、残っているhandleは使える
+    regex_cache small(4096);
+    auto kept = small.get(L"k+eep");
+    for (int i = 0; i < 200; i++)
+        small.get(L"p" + to_wstring(i) + L"[a-z]+");
+    check(small.usage().second <= small.capacity(), L"regex_cache capacity", L"");
+    regex_ptt ptt;
+    check(static_cast<bool>(ptt.match(L"kkeep", *kept)), L"regex_cache evicted handle", L"k+eep");
+    small.clear();
+    check(small.usage().first == 0 && static_cast<bool>(ptt.match(L"keep", *kept)), L"regex_cache clear", L"k+eep");
+}
+
+//---------------------------------------------------------------------
+//  バンドルに書き出して読み直した正規表現が、元と同じ結果になるか。
+//  壊した並びは読み込みに失敗するか、読み込めても範囲外を読まずに照合できるか
+//  (範囲外の読み書きはAddressSanitizerなどで調べる)
+//---------------------------------------------------------------------
+static void bundle()
+{
+    const wchar_t* patterns[] = {
+        L"ab+c", L"a.*?b", L"\\w+", L"x|y(z)", L"(a|b)c*", L"b\\b", L"^ab", L"c$", L"(a)b\\1", L"[a-c]{2,5}",
+        L"a[^\\n]*b", L"(?:ab)*", L"(?>a+)b", L"(a+)+x", L"^(ab|c)*$", L"\\d{3}-\\d+", L"a(", L"x{2,}?y",
+        L"xa{1,70}y", L"(ab){2,3}?c", L"a++b", L"[\\1a]b", L"a{99999}",
+    };
+    vector<unique_ptr<regex_compiled>> list;
+    vector<const regex_compiled*> ptrs;
+    for (auto p : patterns) {
+        list.emplace_back(new regex_compiled(p));
+        ptrs.push_back(list.back().get());
+    }
+    const string image = regex_bundle::build(ptrs.data(), ptrs.size());
+    vector<uint64_t> buffer((image.size() + 7) / 8);    //  8バイト境界に置く
+    char* data = reinterpret_cast<char*>(buffer.data());
+    memcpy(data, image.data(), image.size());
+
+    regex_bundle loaded;
+    check(loaded.attach(data, image.size()) && loaded.size() == list.size(), L"bundle attach", L"");
+    const wstring texts[] = { L"", L"abbc aab", L"xyz x", L"abab c", L"123-45", L"aaab", L"x" + wstring(30, L'a') + L"y", L"aba" };
+    const int options[] = { 0, regex_ptt::SEARCH, regex_ptt::SEARCH | regex_ptt::NOCASE };
+    regex_ptt p, q;
+    for (size_t k = 0; k < loaded.size() && k < list.size(); k++) {
+        check(loaded.pattern(k) == patterns[k] && loaded.get(k).err_msg() == list[k]->err_msg(), L"bundle pattern", patterns[k]);
+        for (auto& text : texts) {
+            for (const int option : options) {
+                auto a = p.match(text.c_str(), *list[k], option);
+                auto b = q.match(text.c_str(), loaded.get(k), option);
+                check(same(a, b), L"bundle match", patterns[k], text);
+            }
+        }
+    }
+
+    //  壊した並び
+    mt19937 flip(1);
+    int rejected = 0;
+    for (int round = 0; round < 2000; round++) {
+        memcpy(data, image.data(), image.size());
+        const int flips = 1 + flip() % 8;
+        for (int i = 0; i < flips; i++) {
+            const size_t at = flip() % image.size();
+            data[at] = (flip() % 2) ? static_cast<char>(data[at] ^ (1 << (flip() % 8))) : static_cast<char>(flip());
+        }
+        regex_bundle broken;
+        if (!broken.attach(data, image.size())) {
+            rejected++;
+            continue;
+        }
+        for (size_t k = 0; k < broken.size(); k++) {
+            const regex_compiled& re = broken.get(k);
+            if (!re.err_msg().empty()) {
+                rejected++;
+                continue;
+            }
+            for (auto& text : texts) {
+                p.match(text.c_str(), re, regex_ptt::SEARCH);
+                p.match(text.c_str(), re, regex_ptt::SEARCH | regex_ptt::PARTIAL);
+                p.test(text.c_str(), re, regex_ptt::SEARCH);
+                const string narrow = latin1(text);
+                p.test(narrow.c_str(), re, regex_ptt::SEARCH);
+            }
+        }
+    }
+    check(rejected > 0, L"bundle corrupted images are rejected", L"");
+}
+
+int main()
+{
+#ifndef _MSC_VER
+    setlocale(LC_CTYPE, "C.UTF-8");     //  パターンの解析(iswprint)がASCII以外の文字を受け付けるように
+#endif
+    nullable();
+    possessive();
+    runs();
+    lengths();
+    anchored();
+    backward();
+    match_only();
+    captures();
+    backrefs();
+    properties();
+    nocase();
+    narrow();
+    simd_scan();
+    sets();
+    batch();
+    pool_all();
+    stream();
+    segments();
+    partial();
+    incremental();
+    sliced();
+    results();
+    resources();
+    cache();
+    bundle();
+    if (failures) {
+        wcout << failures << L" failure(s)" << endl;
+        return 1;
+    }
+    wcout << L"OK" << endl;
+    return 0;
+}